@@ -0,0 +1,225 @@
+// Throughput of the /dev/shm/cpu_cache rings, see drivers/cpu_cache_abi.h.
+// Every ring gets a producer thread, standing in for the block provider,
+// and a consumer thread, standing in for rpage_allocator. They move blocks
+// through the alloc ring for a number of seconds, batch blocks per publish
+// and per take. Prints one csv line:
+//
+//   rings,batch,slots,layout,mitems_per_sec,ns_per_item
+//
+// -l puts every ring's head and tail next to the other rings' in two
+// arrays and drops the cached copy of the other side's index, the way the
+// rings were before the versioned layout, to show what that costs. Threads
+// are pinned to cpus 0, 1, 2, ... in producer, consumer order.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "../drivers/cpu_cache_abi.h"
+
+#define MAX_RINGS 256
+#define SPINS 1000 // before a waiting side yields, for machines with few cpus
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+struct side {
+  pthread_t tid;
+  int ring;
+  int cpu;
+  uint64_t items;
+  uint64_t sum;
+};
+
+static struct cpu_cache_header *cache;
+static uint32_t *heads[MAX_RINGS], *tails[MAX_RINGS];
+static uint32_t packed_heads[MAX_RINGS], packed_tails[MAX_RINGS];
+static int nrings = 1;
+static uint32_t batch = 1;
+static uint32_t slots = 64;
+static int duration = 5;
+static int legacy = 0;
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin(int cpu)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void backoff(uint32_t *spins)
+{
+  if (++*spins < SPINS) {
+    cpu_relax();
+  } else {
+    *spins = 0;
+    sched_yield();
+  }
+}
+
+static void *produce(void *arg)
+{
+  struct side *s = (struct side *) arg;
+  struct cpu_cache_block *items = cpu_cache_alloc_items(cache, s->ring);
+  uint32_t *head = heads[s->ring], *tail = tails[s->ring];
+  uint32_t mask = slots - 1, t = 0, h = 0, n, i, spins = 0;
+  uint64_t addr = 1;
+
+  pin(s->cpu);
+  while (!stop) {
+    if (legacy || t - h + batch > slots)
+      h = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    n = slots - (t - h);
+    if (n > batch)
+      n = batch;
+    if (!n) {
+      backoff(&spins);
+      continue;
+    }
+    for (i = 0; i < n; i++) {
+      items[(t + i) & mask].addr = addr++ << 22;
+      items[(t + i) & mask].rkey = 1;
+      items[(t + i) & mask].server = 0;
+    }
+    t += n;
+    __atomic_store_n(tail, t, __ATOMIC_RELEASE);
+    s->items += n;
+  }
+  return NULL;
+}
+
+static void *consume(void *arg)
+{
+  struct side *s = (struct side *) arg;
+  struct cpu_cache_block *items = cpu_cache_alloc_items(cache, s->ring);
+  uint32_t *head = heads[s->ring], *tail = tails[s->ring];
+  uint32_t mask = slots - 1, h = 0, t = 0, n, i, spins = 0;
+
+  pin(s->cpu);
+  while (!stop) {
+    if (legacy || t == h)
+      t = __atomic_load_n(tail, __ATOMIC_ACQUIRE);
+    n = t - h;
+    if (n > batch)
+      n = batch;
+    if (!n) {
+      backoff(&spins);
+      continue;
+    }
+    for (i = 0; i < n; i++)
+      s->sum += items[(h + i) & mask].addr;
+    h += n;
+    __atomic_store_n(head, h, __ATOMIC_RELEASE);
+    s->items += n;
+  }
+  return NULL;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-r rings] [-b batch] [-s slots] [-d seconds] "
+                  "[-l (packed indices)] [-H (print header)]\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  struct side *prod, *cons;
+  struct cpu_cache_header h = { 0 };
+  uint64_t items = 0, start, ns;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:b:s:d:lH")) != -1) {
+    switch (opt) {
+      case 'r': nrings = atoi(optarg); break;
+      case 'b': batch = atoi(optarg); break;
+      case 's': slots = atoi(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'l': legacy = 1; break;
+      case 'H':
+        printf("rings,batch,slots,layout,mitems_per_sec,ns_per_item\n");
+        return 0;
+      default: usage(argv[0]);
+    }
+  }
+
+  h.magic = CPU_CACHE_MAGIC;
+  h.version = CPU_CACHE_VERSION;
+  h.block_size = 4 << 20;
+  h.nr_rings = nrings;
+  h.alloc_slots = slots;
+  h.free_slots = min_ring_slots;
+  if (nrings < 1 || nrings > MAX_RINGS || batch < 1 || batch > slots ||
+      duration < 1 || cpu_cache_check(&h, ~0ULL))
+    usage(argv[0]);
+
+  cache = (struct cpu_cache_header *) mmap(NULL, cpu_cache_size(&h),
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (cache == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
+  }
+  *cache = h;
+
+  prod = (struct side *) calloc(nrings, sizeof(*prod));
+  cons = (struct side *) calloc(nrings, sizeof(*cons));
+  if (!prod || !cons) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < nrings; i++) {
+    heads[i] = legacy ? &packed_heads[i] : &cpu_cache_alloc_ring(cache, i)->head;
+    tails[i] = legacy ? &packed_tails[i] : &cpu_cache_alloc_ring(cache, i)->tail;
+  }
+
+  start = now_ns();
+  for (int i = 0; i < nrings; i++) {
+    prod[i].ring = cons[i].ring = i;
+    prod[i].cpu = 2 * i;
+    cons[i].cpu = 2 * i + 1;
+    if (pthread_create(&prod[i].tid, NULL, produce, &prod[i]) ||
+        pthread_create(&cons[i].tid, NULL, consume, &cons[i])) {
+      fprintf(stderr, "could not start ring %d\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  sleep(duration);
+  stop = 1;
+
+  for (int i = 0; i < nrings; i++) {
+    pthread_join(prod[i].tid, NULL);
+    pthread_join(cons[i].tid, NULL);
+    items += cons[i].items;
+  }
+  ns = now_ns() - start;
+
+  printf("%d,%u,%u,%s,%.2f,%.2f\n", nrings, batch, slots,
+         legacy ? "packed" : "padded", (double) items * 1000 / ns,
+         items ? (double) ns * nrings / items : 0.0);
+  return 0;
+}
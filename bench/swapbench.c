@@ -0,0 +1,177 @@
+// Swap workload for the fastswap benchmark scripts. Fills a region bigger
+// than the cgroup's memory.high, then touches random (or sequential) pages
+// of it from a number of threads and reports page throughput and per-access
+// latency percentiles as one csv line:
+//
+//   threads,pages_per_sec,mb_per_sec,p50_us,p99_us,p999_us
+//
+// Run it inside a memory limited cgroup, see sweep_queues.sh.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define PAGE_SIZE 4096UL
+#define BUCKET_NS 100
+#define NUM_BUCKETS 100000 // 10ms, slower accesses land in the last one
+
+struct thread {
+  pthread_t tid;
+  int id;
+  char *base;
+  size_t npages;
+  uint64_t ops;
+  uint32_t *hist;
+};
+
+static size_t size_mb = 4096;
+static int nthreads = 1;
+static int duration = 10;
+static int write_pct = 0;
+static int sequential = 0;
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift, good enough to pick pages
+static inline uint64_t next_rand(uint64_t *s)
+{
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return *s;
+}
+
+static void *run(void *arg)
+{
+  struct thread *t = (struct thread *) arg;
+  uint64_t seed = 0x9e3779b97f4a7c15ULL * (t->id + 1);
+  uint64_t start, ns;
+  size_t i = 0, page;
+  volatile char *p;
+
+  while (!stop) {
+    page = sequential ? i++ % t->npages : next_rand(&seed) % t->npages;
+    p = t->base + page * PAGE_SIZE;
+
+    start = now_ns();
+    if ((int) (next_rand(&seed) % 100) < write_pct)
+      *p = (char) page;
+    else
+      (void) *p;
+    ns = now_ns() - start;
+
+    t->hist[ns / BUCKET_NS < NUM_BUCKETS ? ns / BUCKET_NS : NUM_BUCKETS - 1]++;
+    t->ops++;
+  }
+
+  return NULL;
+}
+
+static double percentile(uint64_t *hist, uint64_t total, double pct)
+{
+  uint64_t target = (uint64_t) (total * pct), sum = 0;
+
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    sum += hist[i];
+    if (sum > target)
+      return (i + 1) * BUCKET_NS / 1000.0;
+  }
+  return NUM_BUCKETS * BUCKET_NS / 1000.0;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-s size_mb] [-t threads] [-d seconds] "
+                  "[-w write_pct] [-q (sequential)] [-H (print header)]\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  struct thread *threads;
+  uint64_t *hist, ops = 0;
+  size_t npages, per_thread;
+  char *base;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:t:d:w:qH")) != -1) {
+    switch (opt) {
+      case 's': size_mb = atol(optarg); break;
+      case 't': nthreads = atoi(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'w': write_pct = atoi(optarg); break;
+      case 'q': sequential = 1; break;
+      case 'H':
+        printf("threads,pages_per_sec,mb_per_sec,p50_us,p99_us,p999_us\n");
+        return 0;
+      default: usage(argv[0]);
+    }
+  }
+  if (nthreads < 1 || duration < 1 || size_mb < 1)
+    usage(argv[0]);
+
+  npages = size_mb * 1024 * 1024 / PAGE_SIZE;
+  per_thread = npages / nthreads;
+
+  base = (char *) mmap(NULL, npages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
+  }
+  // no transparent hugepages, fastswap swaps 4k pages
+  madvise(base, npages * PAGE_SIZE, MADV_NOHUGEPAGE);
+
+  // populate, the part that doesn't fit is pushed out to far memory
+  for (size_t i = 0; i < npages; i++)
+    memset(base + i * PAGE_SIZE, (int) i, PAGE_SIZE);
+
+  threads = (struct thread *) calloc(nthreads, sizeof(*threads));
+  hist = (uint64_t *) calloc(NUM_BUCKETS, sizeof(*hist));
+  if (!threads || !hist) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    threads[i].id = i;
+    threads[i].base = base + i * per_thread * PAGE_SIZE;
+    threads[i].npages = per_thread;
+    threads[i].hist = (uint32_t *) calloc(NUM_BUCKETS, sizeof(uint32_t));
+    if (!threads[i].hist ||
+        pthread_create(&threads[i].tid, NULL, run, &threads[i])) {
+      fprintf(stderr, "could not start thread %d\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  sleep(duration);
+  stop = 1;
+
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i].tid, NULL);
+    ops += threads[i].ops;
+    for (int b = 0; b < NUM_BUCKETS; b++)
+      hist[b] += threads[i].hist[b];
+  }
+
+  printf("%d,%.0f,%.1f,%.2f,%.2f,%.2f\n", nthreads,
+         (double) ops / duration,
+         (double) ops * PAGE_SIZE / duration / (1024 * 1024),
+         percentile(hist, ops, 0.50), percentile(hist, ops, 0.99),
+         percentile(hist, ops, 0.999));
+  return 0;
+}
@@ -0,0 +1,57 @@
+#!/bin/bash
+# Sweeps fastswap_rdma queue shapes (qsets x qps) and thread counts with
+# swapbench, printing one csv line per run:
+#
+#   qsets,qps,queues,threads,pages_per_sec,mb_per_sec,p50_us,p99_us,p999_us
+#
+# Run from the repo root after init_cgroup.sh, with the drivers built. The
+# server has to be restarted for every shape since it expects a fixed
+# number of queues, RESTART_SERVER does that with {nq} replaced by the
+# queue count, e.g.
+#
+#   RESTART_SERVER='ssh farmem "pkill rmserver; sleep 1; cd fastswap/farmemserver && (nohup ./rmserver 50000 {nq} > /dev/null 2>&1 &)"' \
+#   SIP=10.10.1.1 CIP=10.10.1.2 bench/sweep_queues.sh > queues.csv
+
+SIP=${SIP:?set SIP to the far memory server ip}
+CIP=${CIP:?set CIP to this node ip}
+SPORT=${SPORT:-50000}
+RESTART_SERVER=${RESTART_SERVER:?set RESTART_SERVER, see above}
+# qsets:qps, qsets=0 is one set per cpu
+SHAPES=${SHAPES:-"0:1 32:1 16:1 8:1 4:1 0:2"}
+THREADS=${THREADS:-"1 2 4 8 16 32 64"}
+SIZE_MB=${SIZE_MB:-16384}
+LIMIT=${LIMIT:-4G}
+DURATION=${DURATION:-20}
+
+CGROUP=/cgroup2/benchmarks/sweep
+NCPUS=$(nproc)
+DRIVERS=$(dirname $0)/../drivers
+SWAPBENCH=$(dirname $0)/swapbench
+
+mkdir -p $CGROUP
+echo $LIMIT > $CGROUP/memory.high
+
+echo -n "qsets,qps,queues,"
+$SWAPBENCH -H
+
+for shape in $SHAPES; do
+  qsets=${shape%:*}
+  qps=${shape#*:}
+  sets=$qsets
+  [ $sets -eq 0 ] && sets=$NCPUS
+  nq=$((sets * qps * 3))
+
+  sudo rmmod fastswap fastswap_rdma 2> /dev/null
+  eval ${RESTART_SERVER//\{nq\}/$nq}
+  sleep 2
+  sudo insmod $DRIVERS/fastswap_rdma.ko sport=$SPORT sip="$SIP" cip="$CIP" \
+    qsets=$qsets qps=$qps || exit 1
+  sudo insmod $DRIVERS/fastswap.ko || exit 1
+
+  for t in $THREADS; do
+    echo -n "$qsets,$qps,$nq,"
+    bash -c "echo \$\$ > $CGROUP/cgroup.procs && exec $SWAPBENCH -s $SIZE_MB -t $t -d $DURATION -w 50"
+  done
+done
+
+sudo rmmod fastswap fastswap_rdma
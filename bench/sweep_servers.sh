@@ -0,0 +1,97 @@
+#!/bin/bash
+# Swap bandwidth against the number of memory servers. For every count in
+# SERVERS it starts that many rmserver instances on this box, loads the
+# drivers striped across them and runs swapbench, printing csv:
+#
+#   servers,placement,threads,pages_per_sec,mb_per_sec,p50_us,p99_us,p999_us
+#
+# With RXE=1 (the default) the servers are reached over soft-RoCE on
+# NETDEV, so no RDMA NIC is needed:
+#
+#   bench/sweep_servers.sh > servers.csv
+#
+# Blocks reach rpage_allocator through /dev/shm/cpu_cache, PROVIDER is the
+# command that fills it, farmemserver/blockd by default. It runs with
+# {servers} replaced by the list of ip:port of the running servers, in
+# server id order. Some kernels don't route rxe over lo, use a veth pair as
+# NETDEV then.
+#
+# EC=k:r erasure codes the pages instead of striping them, counts in SERVERS
+# below k + r are skipped:
+#
+#   EC=4:1 SERVERS="5 6" bench/sweep_servers.sh
+
+RXE=${RXE:-1}
+NETDEV=${NETDEV:-lo}
+IP=${IP:-127.0.0.1}
+BASE_PORT=${BASE_PORT:-50000}
+PROVIDER=${PROVIDER:-"sudo $(dirname $0)/../farmemserver/blockd -s {servers} -i 0"}
+SERVERS=${SERVERS:-"1 2 4"}
+PLACEMENT=${PLACEMENT:-rr}
+EC=${EC:-}
+SERVER_GB=${SERVER_GB:-8}
+THREADS=${THREADS:-"4 16"}
+QSETS=${QSETS:-4}
+SIZE_MB=${SIZE_MB:-8192}
+LIMIT=${LIMIT:-2G}
+DURATION=${DURATION:-20}
+
+CGROUP=/cgroup2/benchmarks/servers
+BENCH=$(dirname $0)
+DRIVERS=$BENCH/../drivers
+RMSERVER=$BENCH/../farmemserver/rmserver
+NQ=$((QSETS * 3))
+
+if [ $RXE -eq 1 ]; then
+  sudo modprobe rdma_rxe
+  rdma link show | grep -q "netdev $NETDEV" || \
+    sudo rdma link add rxe_$NETDEV type rxe netdev $NETDEV || exit 1
+fi
+
+if [ -n "$EC" ]; then
+  mode=ec$EC
+  args="ec_k=${EC%:*} ec_r=${EC#*:}"
+  min_servers=$((${EC%:*} + ${EC#*:}))
+else
+  mode=$PLACEMENT
+  args="placement=$PLACEMENT"
+  min_servers=1
+fi
+
+mkdir -p $CGROUP
+echo $LIMIT > $CGROUP/memory.high
+
+echo -n "servers,placement,"
+$BENCH/swapbench -H
+
+for n in $SERVERS; do
+  [ $n -lt $min_servers ] && continue
+  list=""
+  pids=""
+  for ((i = 0; i < n; i++)); do
+    port=$((BASE_PORT + i))
+    $RMSERVER $port $NQ $SERVER_GB > /dev/null &
+    pids="$pids $!"
+    list="$list${list:+,}$IP:$port"
+  done
+  sleep 2
+
+  eval "${PROVIDER//\{servers\}/$list} &"
+  provider=$!
+  sleep 2
+
+  sudo insmod $DRIVERS/rpage_allocator.ko || exit 1
+  sudo insmod $DRIVERS/fastswap_rdma.ko sip="$list" cip="$IP" qsets=$QSETS \
+    $args || exit 1
+  sudo insmod $DRIVERS/fastswap.ko || exit 1
+
+  for t in $THREADS; do
+    echo -n "$n,$mode,"
+    bash -c "echo \$\$ > $CGROUP/cgroup.procs && exec $BENCH/swapbench -s $SIZE_MB -t $t -d $DURATION -q -w 100"
+  done
+
+  sudo rmmod fastswap fastswap_rdma rpage_allocator
+  sudo kill $provider 2> /dev/null
+  kill $pids 2> /dev/null
+  wait 2> /dev/null
+done
@@ -0,0 +1,92 @@
+#ifndef _CPU_CACHE_ABI_H
+#define _CPU_CACHE_ABI_H
+
+// layout of /dev/shm/cpu_cache, shared by rpage_allocator and the block
+// provider in userspace. the provider creates the file and fills in the
+// header, then feeds blocks to the kernel through a pair of rings per cpu:
+// blocks to use go in on the alloc ring, blocks the kernel is done with
+// come back on the free ring.
+//
+// every ring has one producer and one consumer, and its head and tail are
+// on cache lines of their own. the producer writes items and publishes
+// them with a release store of tail. the consumer loads tail with acquire,
+// reads the items and hands the room back with a release store of head.
+// head and tail run freely and are masked with the ring's slots - 1, so
+// tail - head is the number of items in the ring.
+
+#include <linux/types.h>
+
+#define CPU_CACHE_MAGIC 0x43504343u // "CCPC"
+#define CPU_CACHE_VERSION 2
+#define CPU_CACHE_LINE 64
+#define cpu_cache_aligned __attribute__((aligned(CPU_CACHE_LINE)))
+
+// the rings live right after the header, one cpu_cache_stride apart. a
+// cpu's rings are an alloc ring and its items, then a free ring and its
+// items. slot counts are powers of two of at least min_ring_slots, so the
+// item arrays are whole cache lines
+#define min_ring_slots 8
+
+struct cpu_cache_header {
+    __u32 magic;
+    __u32 version;
+    __u64 block_size;
+    // cpu n uses the rings n % nr_rings
+    __u32 nr_rings;
+    __u32 alloc_slots;
+    __u32 free_slots;
+} cpu_cache_aligned;
+
+struct cpu_cache_ring {
+    __u32 head cpu_cache_aligned; // written by the consumer
+    __u32 tail cpu_cache_aligned; // written by the producer
+} cpu_cache_aligned;
+
+// a block handed out by the provider. server is the index of the block's
+// server in fastswap_rdma's sip list. the free ring carries the address
+// back with the server id in the top bits, see RADDR_SERVER_SHIFT
+struct cpu_cache_block {
+    __u64 addr;
+    __u32 rkey;
+    __u32 server;
+};
+
+static inline __u64 cpu_cache_stride(const struct cpu_cache_header *h) {
+    return 2 * sizeof(struct cpu_cache_ring)
+        + (__u64)h->alloc_slots * sizeof(struct cpu_cache_block)
+        + (__u64)h->free_slots * sizeof(__u64);
+}
+
+// bytes the file needs for the rings h describes
+static inline __u64 cpu_cache_size(const struct cpu_cache_header *h) {
+    return sizeof(*h) + h->nr_rings * cpu_cache_stride(h);
+}
+
+static inline struct cpu_cache_ring *cpu_cache_alloc_ring(struct cpu_cache_header *h, __u32 n) {
+    return (struct cpu_cache_ring *)((char *)(h + 1) + n * cpu_cache_stride(h));
+}
+
+static inline struct cpu_cache_block *cpu_cache_alloc_items(struct cpu_cache_header *h, __u32 n) {
+    return (struct cpu_cache_block *)(cpu_cache_alloc_ring(h, n) + 1);
+}
+
+static inline struct cpu_cache_ring *cpu_cache_free_ring(struct cpu_cache_header *h, __u32 n) {
+    return (struct cpu_cache_ring *)(cpu_cache_alloc_items(h, n) + h->alloc_slots);
+}
+
+static inline __u64 *cpu_cache_free_items(struct cpu_cache_header *h, __u32 n) {
+    return (__u64 *)(cpu_cache_free_ring(h, n) + 1);
+}
+
+// 0 if the header describes rings this version can use
+static inline int cpu_cache_check(const struct cpu_cache_header *h, __u64 size) {
+    if(h->magic != CPU_CACHE_MAGIC || h->version != CPU_CACHE_VERSION)
+        return -1;
+    if(!h->nr_rings || h->alloc_slots < min_ring_slots || h->free_slots < min_ring_slots)
+        return -1;
+    if((h->alloc_slots & (h->alloc_slots - 1)) || (h->free_slots & (h->free_slots - 1)))
+        return -1;
+    return cpu_cache_size(h) <= size ? 0 : -1;
+}
+
+#endif
@@ -9,6 +9,16 @@
 #include <linux/page-flags.h>
 #include <linux/memcontrol.h>
 #include <linux/smp.h>
+#include <linux/rbtree.h>
+#include <linux/lz4.h>
+#include <linux/cgroup.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/hashtable.h>
+#include <linux/refcount.h>
+#include <linux/llist.h>
 
 #define B_DRAM 1
 #define B_RDMA 2
@@ -27,9 +37,789 @@
 #error "BACKEND can only be 1 (DRAM) or 2 (RDMA)"
 #endif
 
+/*
+ * Compressed cache tier. With cache_mb set, stored pages are lz4
+ * compressed into a cache on the numa node of the page and only go to the
+ * backend when that cache fills up: a writeback work then writes the
+ * oldest ones back. Loads that hit the cache decompress locally instead of
+ * paying a round trip to the backend. Cgroups can get a cache limit of
+ * their own through fastswap/cgroups in debugfs, which also shows their
+ * hits, misses and writebacks.
+ */
+
+static unsigned long cache_mb;
+module_param(cache_mb, ulong, 0444);
+MODULE_PARM_DESC(cache_mb, "compressed cache size per numa node in MB (default: 0, no cache)");
+
+/* pages that don't compress to this go to the backend right away */
+#define CACHE_MAX_LEN (PAGE_SIZE * 3 / 4)
+/* entries a writeback round takes off the lru */
+#define CACHE_WB_BATCH 32
+/* how often the state of removed cgroups is let go of */
+#define CACHE_REAP_INTERVAL 10000 /* ms */
+
+/* the state of a memory cgroup. it is looked up by the inode number of
+ * the cgroup's directory, which debugfs names it by, and belongs to the
+ * memcg whose pages it first sees. a removed cgroup's state is dropped,
+ * so a new cgroup that gets its number starts afresh */
+struct cache_cgroup {
+  struct hlist_node node; /* in cache_cgroups */
+  u64 ino; /* of the memory cgroup, 0 for pages of none */
+  /* holds a css reference while in cache_cgroups, NULL until the first
+   * page of a cgroup set up through debugfs */
+  struct mem_cgroup *memcg;
+  refcount_t refs; /* cache_cgroups' and one per cached entry */
+  unsigned long limit; /* bytes, 0 for no limit of its own */
+  atomic_long_t bytes;
+  atomic64_t hits;
+  atomic64_t misses;
+  atomic64_t writebacks;
+  atomic64_t rejects;
+  struct rcu_head rcu;
+};
+
+struct cache_entry {
+  struct rb_node node;
+  union {
+    struct list_head lru;
+    /* on wb_done once the backend is done with its copy */
+    struct llist_node wb_node;
+  };
+  pgoff_t offset;
+  struct cache_cgroup *cg;
+  /* being written back, and off the lru meanwhile */
+  bool wb;
+  /* invalidated during writeback, the writeback frees it */
+  bool dead;
+  /* the backend didn't take the copy */
+  bool wb_failed;
+  u32 len;
+  u8 data[];
+};
+
+struct cache_node {
+  spinlock_t lock;
+  struct rb_root tree;
+  struct list_head lru; /* oldest first */
+  unsigned long bytes;
+  unsigned long wb_bytes; /* of the entries under writeback */
+  struct work_struct wb_work;
+  /* entries whose writeback is over, which wb_end_work ends */
+  struct llist_head wb_done;
+  struct work_struct wb_end_work;
+  int nid;
+};
+
+static struct cache_node **cache_nodes;
+static unsigned long cache_limit;
+static struct cache_cgroup cache_cgroup_none = {
+  .refs = REFCOUNT_INIT(1),
+};
+static DEFINE_HASHTABLE(cache_cgroups, 6);
+static DEFINE_SPINLOCK(cache_cgroups_lock);
+static struct delayed_work cache_reap_work;
+/* woken whenever writeback of an entry is over */
+static DECLARE_WAIT_QUEUE_HEAD(cache_wb_wait);
+static DEFINE_PER_CPU(void *, cache_wrkmem);
+static DEFINE_PER_CPU(u8 *, cache_buf);
+
+/* under rcu_read_lock or cache_cgroups_lock */
+static struct cache_cgroup *cache_cgroup_find(u64 ino)
+{
+  struct cache_cgroup *cg;
+
+  hash_for_each_possible_rcu(cache_cgroups, cg, node, ino)
+    if (cg->ino == ino)
+      return cg;
+  return NULL;
+}
+
+static void cache_cgroup_put(struct cache_cgroup *cg)
+{
+  if (refcount_dec_and_test(&cg->refs))
+    kfree_rcu(cg, rcu);
+}
+
+/* takes cg out of cache_cgroups, under cache_cgroups_lock. its cached
+ * entries keep it around until they are gone */
+static void cache_cgroup_unhash(struct cache_cgroup *cg)
+{
+  hash_del_rcu(&cg->node);
+  if (cg->memcg)
+    css_put(&cg->memcg->css);
+  cache_cgroup_put(cg);
+}
+
+/* the state of memcg, NULL if there is no memory for it or the cgroup is
+ * being removed. under rcu_read_lock */
+static struct cache_cgroup *cache_cgroup(struct mem_cgroup *memcg)
+{
+#ifdef CONFIG_MEMCG
+  struct cache_cgroup *cg, *new;
+  u64 ino;
+
+  if (!memcg)
+    return &cache_cgroup_none;
+  ino = cgroup_ino(memcg->css.cgroup);
+  cg = cache_cgroup_find(ino);
+  if (likely(cg && READ_ONCE(cg->memcg) == memcg))
+    return cg;
+
+  /* this is the swap out path, don't reclaim for it */
+  new = kzalloc(sizeof(*new), GFP_NOWAIT | __GFP_NOWARN);
+  spin_lock(&cache_cgroups_lock);
+  cg = cache_cgroup_find(ino);
+  if (cg && cg->memcg == memcg)
+    goto out_unlock;
+  if (!css_tryget_online(&memcg->css)) {
+    cg = NULL;
+    goto out_unlock;
+  }
+  /* set up through debugfs before its first page */
+  if (cg && !cg->memcg) {
+    WRITE_ONCE(cg->memcg, memcg);
+    goto out_unlock;
+  }
+  /* the number was a removed cgroup's */
+  if (cg)
+    cache_cgroup_unhash(cg);
+
+  cg = new;
+  new = NULL;
+  if (!cg) {
+    css_put(&memcg->css);
+    goto out_unlock;
+  }
+  cg->ino = ino;
+  cg->memcg = memcg;
+  refcount_set(&cg->refs, 1);
+  hash_add_rcu(cache_cgroups, &cg->node, ino);
+
+out_unlock:
+  spin_unlock(&cache_cgroups_lock);
+  kfree(new);
+  return cg;
+#else
+  return &cache_cgroup_none;
+#endif
+}
+
+/* lets go of the state of removed cgroups, and of their memcgs */
+static void cache_cgroups_reap(struct work_struct *work)
+{
+  struct cache_cgroup *cg;
+  struct hlist_node *tmp;
+  int bkt;
+
+  spin_lock(&cache_cgroups_lock);
+  hash_for_each_safe(cache_cgroups, bkt, tmp, cg, node)
+    if (cg->memcg && !(READ_ONCE(cg->memcg->css.flags) & CSS_ONLINE))
+      cache_cgroup_unhash(cg);
+  spin_unlock(&cache_cgroups_lock);
+
+  queue_delayed_work(system_unbound_wq, &cache_reap_work,
+                     msecs_to_jiffies(CACHE_REAP_INTERVAL));
+}
+
+/* stores run in reclaim, so the page's cgroup is the one it is charged
+ * to, not the current task's */
+static struct mem_cgroup *page_cgroup(struct page *page)
+{
+#ifdef CONFIG_MEMCG
+  return page->mem_cgroup;
+#else
+  return NULL;
+#endif
+}
+
+/* swapin pages aren't charged yet when they are loaded. under
+ * rcu_read_lock */
+static struct mem_cgroup *current_cgroup(void)
+{
+#ifdef CONFIG_MEMCG
+  return mem_cgroup_from_css(task_css(current, memory_cgrp_id));
+#else
+  return NULL;
+#endif
+}
+
+static void cache_entry_free(struct cache_entry *e)
+{
+  cache_cgroup_put(e->cg);
+  kfree(e);
+}
+
+static struct cache_entry *cache_search(struct cache_node *cn, pgoff_t offset)
+{
+  struct rb_node *node = cn->tree.rb_node;
+  struct cache_entry *e;
+
+  while (node) {
+    e = rb_entry(node, struct cache_entry, node);
+    if (offset < e->offset)
+      node = node->rb_left;
+    else if (offset > e->offset)
+      node = node->rb_right;
+    else
+      return e;
+  }
+  return NULL;
+}
+
+static void cache_insert(struct cache_node *cn, struct cache_entry *e)
+{
+  struct rb_node **link = &cn->tree.rb_node, *parent = NULL;
+  struct cache_entry *pos;
+
+  while (*link) {
+    parent = *link;
+    pos = rb_entry(parent, struct cache_entry, node);
+    BUG_ON(e->offset == pos->offset);
+    if (e->offset < pos->offset)
+      link = &parent->rb_left;
+    else
+      link = &parent->rb_right;
+  }
+  rb_link_node(&e->node, parent, link);
+  rb_insert_color(&e->node, &cn->tree);
+
+  cn->bytes += e->len;
+  atomic_long_add(e->len, &e->cg->bytes);
+}
+
+static void cache_erase(struct cache_node *cn, struct cache_entry *e)
+{
+  rb_erase(&e->node, &cn->tree);
+  cn->bytes -= e->len;
+  atomic_long_sub(e->len, &e->cg->bytes);
+}
+
+/* the entry of offset with the lock of its node held, or NULL. a page is
+ * cached on its own node, which usually is the one loading it */
+static struct cache_entry *cache_find(pgoff_t offset, struct cache_node **cnp)
+{
+  struct cache_entry *e;
+  int i, nid = numa_node_id();
+
+  for (i = 0; i < nr_node_ids; i++, nid = (nid + 1) % nr_node_ids) {
+    if (!cache_nodes[nid])
+      continue;
+    spin_lock(&cache_nodes[nid]->lock);
+    e = cache_search(cache_nodes[nid], offset);
+    if (e) {
+      *cnp = cache_nodes[nid];
+      return e;
+    }
+    spin_unlock(&cache_nodes[nid]->lock);
+  }
+  return NULL;
+}
+
+static bool cache_holds(pgoff_t offset, bool wb)
+{
+  struct cache_node *cn;
+  struct cache_entry *e;
+  bool ret;
+
+  e = cache_find(offset, &cn);
+  if (!e)
+    return false;
+  ret = wb ? e->wb : !e->dead;
+  spin_unlock(&cn->lock);
+  return ret;
+}
+
+/* drops the cached copy of offset before a newer one is stored. a copy
+ * under writeback is waited for, so that the backend sees the writes of
+ * offset in order */
+static void cache_drop(pgoff_t offset)
+{
+  struct cache_node *cn;
+  struct cache_entry *e;
+
+  for (;;) {
+    e = cache_find(offset, &cn);
+    if (!e)
+      return;
+    if (!e->wb) {
+      list_del(&e->lru);
+      cache_erase(cn, e);
+      spin_unlock(&cn->lock);
+      cache_entry_free(e);
+      return;
+    }
+    spin_unlock(&cn->lock);
+    wait_event(cache_wb_wait, !cache_holds(offset, true));
+  }
+}
+
+/* returns 0 if page went into the cache, its writeback is over then */
+static int cache_store(pgoff_t offset, struct page *page)
+{
+  struct cache_node *cn = cache_nodes[page_to_nid(page)];
+  struct cache_cgroup *cg;
+  struct cache_entry *e = NULL;
+  void *wrkmem;
+  int len;
+
+  cache_drop(offset);
+
+  /* the entry holds a reference on the cgroup's state */
+  rcu_read_lock();
+  cg = cache_cgroup(page_cgroup(page));
+  if (cg && !refcount_inc_not_zero(&cg->refs))
+    cg = NULL;
+  rcu_read_unlock();
+  if (!cg)
+    return -1;
+
+  /* writeback can't keep up, or the cgroup is over its limit */
+  if (READ_ONCE(cn->bytes) >= 2 * cache_limit ||
+      (cg->limit && atomic_long_read(&cg->bytes) >= cg->limit))
+    goto reject;
+
+  wrkmem = get_cpu_var(cache_wrkmem);
+  len = LZ4_compress_default(page_address(page), this_cpu_read(cache_buf),
+                             PAGE_SIZE, CACHE_MAX_LEN, wrkmem);
+  if (len > 0) {
+    e = kmalloc(sizeof(*e) + len, GFP_NOWAIT | __GFP_NOWARN);
+    if (e)
+      memcpy(e->data, this_cpu_read(cache_buf), len);
+  }
+  put_cpu_var(cache_wrkmem);
+  if (!e)
+    goto reject;
+
+  e->offset = offset;
+  e->cg = cg;
+  e->wb = false;
+  e->dead = false;
+  e->len = len;
+
+  spin_lock(&cn->lock);
+  cache_insert(cn, e);
+  list_add_tail(&e->lru, &cn->lru);
+  spin_unlock(&cn->lock);
+
+  if (READ_ONCE(cn->bytes) > cache_limit)
+    queue_work(system_unbound_wq, &cn->wb_work);
+
+  end_page_writeback(page);
+  return 0;
+
+reject:
+  atomic64_inc(&cg->rejects);
+  cache_cgroup_put(cg);
+  return -1;
+}
+
+/* returns 0 if offset was cached, page is unlocked then */
+static int cache_load(pgoff_t offset, struct page *page)
+{
+  struct cache_node *cn;
+  struct cache_entry *e;
+  int ret;
+
+  e = cache_find(offset, &cn);
+  if (!e)
+    return -1;
+  if (e->dead) {
+    spin_unlock(&cn->lock);
+    return -1;
+  }
+
+  ret = LZ4_decompress_safe(e->data, page_address(page), e->len, PAGE_SIZE);
+  atomic64_inc(&e->cg->hits);
+  spin_unlock(&cn->lock);
+
+  if (likely(ret == PAGE_SIZE)) {
+    SetPageUptodate(page);
+  } else {
+    pr_err("bad cached page at offset %lu: %d\n", offset, ret);
+    SetPageError(page);
+  }
+  unlock_page(page);
+  return 0;
+}
+
+static void cache_miss(int n)
+{
+  struct cache_cgroup *cg;
+
+  rcu_read_lock();
+  cg = cache_cgroup(current_cgroup());
+  if (cg)
+    atomic64_add(n, &cg->misses);
+  rcu_read_unlock();
+}
+
+/* returns true if the backend copy of offset goes away with a writeback
+ * in flight, false if the caller has to free it */
+static bool cache_invalidate(pgoff_t offset)
+{
+  struct cache_node *cn;
+  struct cache_entry *e;
+
+  e = cache_find(offset, &cn);
+  if (!e)
+    return false;
+  if (e->wb) {
+    e->dead = true;
+    spin_unlock(&cn->lock);
+    return true;
+  }
+  list_del(&e->lru);
+  cache_erase(cn, e);
+  spin_unlock(&cn->lock);
+  cache_entry_free(e);
+  return false;
+}
+
+/* hands e, whose writeback is over, to wb_end_work. ok if the backend
+ * has it now */
+static void cache_wb_done(struct cache_node *cn, struct cache_entry *e,
+                          bool ok)
+{
+  e->wb_failed = !ok;
+  if (llist_add(&e->wb_node, &cn->wb_done))
+    queue_work(system_unbound_wq, &cn->wb_end_work);
+}
+
+/* the backend is done with the copy of a cached entry, which may be in
+ * its write completion */
+static void cache_wb_end(struct page *page, bool ok)
+{
+  struct cache_entry *e = (struct cache_entry *)page_private(page);
+  struct cache_node *cn = cache_nodes[page_to_nid(page)];
+
+  set_page_private(page, 0);
+  __free_page(page);
+  cache_wb_done(cn, e, ok);
+}
+
+/* ends the writeback of entries. written ones leave the cache, and the
+ * ones that weren't go back on the lru to be tried again */
+static void cache_wb_end_work(struct work_struct *work)
+{
+  struct cache_node *cn = container_of(work, struct cache_node, wb_end_work);
+  struct llist_node *list = llist_del_all(&cn->wb_done), *dead = NULL;
+  struct cache_entry *e, *next;
+
+  spin_lock(&cn->lock);
+  llist_for_each_entry_safe(e, next, list, wb_node) {
+    cn->wb_bytes -= e->len;
+    if (e->dead) {
+      e->wb_node.next = dead;
+      dead = &e->wb_node;
+    } else if (e->wb_failed) {
+      e->wb = false;
+      list_add(&e->lru, &cn->lru);
+    } else {
+      atomic64_inc(&e->cg->writebacks);
+      cache_erase(cn, e);
+      cache_entry_free(e);
+    }
+  }
+  spin_unlock(&cn->lock);
+
+  /* invalidated entries take the backend copy of their offset with them.
+   * they stay in the tree until it is gone, so that a new store of the
+   * offset waits for that */
+  if (dead) {
+    llist_for_each_entry(e, dead, wb_node)
+      sswap_rdma_free_page(e->offset);
+    spin_lock(&cn->lock);
+    llist_for_each_entry_safe(e, next, dead, wb_node) {
+      cache_erase(cn, e);
+      cache_entry_free(e);
+    }
+    spin_unlock(&cn->lock);
+  }
+  wake_up_all(&cache_wb_wait);
+}
+
+/* writes the oldest entries of a node back until what isn't under
+ * writeback yet is 1/8 below its limit. the writes complete on their own,
+ * see cache_wb_end. entries stay in the cache, and keep serving loads,
+ * until the backend has them */
+static void cache_writeback(struct work_struct *work)
+{
+  struct cache_node *cn = container_of(work, struct cache_node, wb_work);
+  struct cache_entry *batch[CACHE_WB_BATCH], *e;
+  unsigned long low = cache_limit - cache_limit / 8;
+  struct page *page;
+  int i, n, ret;
+
+  for (;;) {
+    n = 0;
+    spin_lock(&cn->lock);
+    while (n < CACHE_WB_BATCH && cn->bytes - cn->wb_bytes > low &&
+           !list_empty(&cn->lru)) {
+      e = list_first_entry(&cn->lru, struct cache_entry, lru);
+      list_del(&e->lru);
+      e->wb = true;
+      cn->wb_bytes += e->len;
+      batch[n++] = e;
+    }
+    spin_unlock(&cn->lock);
+    if (!n)
+      return;
+
+    for (i = 0; i < n; i++) {
+      e = batch[i];
+      /* no io, reclaim would store into this very cache. the page comes
+       * from the node of the cache, cache_wb_end finds it by that */
+      page = alloc_pages_node(cn->nid, GFP_NOIO | __GFP_NOWARN |
+                              __GFP_NORETRY | __GFP_THISNODE, 0);
+      if (!page)
+        break;
+      ret = LZ4_decompress_safe(e->data, page_address(page), e->len,
+                                PAGE_SIZE);
+      WARN_ON(ret != PAGE_SIZE);
+      set_page_private(page, (unsigned long)e);
+      /* the backend ends writeback once the page is remote */
+      set_page_writeback(page);
+      if (sswap_rdma_write(page, e->offset)) {
+        end_page_writeback(page);
+        set_page_private(page, 0);
+        __free_page(page);
+        break;
+      }
+    }
+
+    /* out of pages or backend space, leave the rest for the next store */
+    if (i < n) {
+      for (; i < n; i++)
+        cache_wb_done(cn, batch[i], false);
+      return;
+    }
+  }
+}
+
+static void cache_destroy(void)
+{
+  struct cache_entry *e, *next;
+  struct cache_cgroup *cg;
+  struct hlist_node *tmp;
+  int cpu, nid, bkt;
+
+  cancel_delayed_work_sync(&cache_reap_work);
+  for_each_possible_cpu(cpu) {
+    vfree(per_cpu(cache_wrkmem, cpu));
+    kfree(per_cpu(cache_buf, cpu));
+  }
+
+  if (!cache_nodes)
+    return;
+  for (nid = 0; nid < nr_node_ids; nid++) {
+    if (!cache_nodes[nid])
+      continue;
+    cancel_work_sync(&cache_nodes[nid]->wb_work);
+    wait_event(cache_wb_wait, !READ_ONCE(cache_nodes[nid]->wb_bytes));
+    flush_work(&cache_nodes[nid]->wb_end_work);
+    rbtree_postorder_for_each_entry_safe(e, next, &cache_nodes[nid]->tree, node)
+      kfree(e);
+    kfree(cache_nodes[nid]);
+  }
+  kfree(cache_nodes);
+  cache_nodes = NULL;
+
+  /* the entries are gone, and their references with them */
+  hash_for_each_safe(cache_cgroups, bkt, tmp, cg, node) {
+    hash_del(&cg->node);
+    if (cg->memcg)
+      css_put(&cg->memcg->css);
+    kfree(cg);
+  }
+}
+
+static int cache_init(void)
+{
+  struct cache_node *cn;
+  int cpu, nid;
+
+  INIT_DELAYED_WORK(&cache_reap_work, cache_cgroups_reap);
+  cache_limit = cache_mb << 20;
+  cache_nodes = kcalloc(nr_node_ids, sizeof(*cache_nodes), GFP_KERNEL);
+  if (!cache_nodes)
+    return -ENOMEM;
+
+  for_each_node_state(nid, N_MEMORY) {
+    cn = kzalloc_node(sizeof(*cn), GFP_KERNEL, nid);
+    if (!cn)
+      goto out_destroy;
+    spin_lock_init(&cn->lock);
+    cn->tree = RB_ROOT;
+    INIT_LIST_HEAD(&cn->lru);
+    INIT_WORK(&cn->wb_work, cache_writeback);
+    init_llist_head(&cn->wb_done);
+    INIT_WORK(&cn->wb_end_work, cache_wb_end_work);
+    cn->nid = nid;
+    cache_nodes[nid] = cn;
+  }
+
+  for_each_possible_cpu(cpu) {
+    per_cpu(cache_wrkmem, cpu) = vmalloc(LZ4_MEM_COMPRESS);
+    per_cpu(cache_buf, cpu) = kmalloc(CACHE_MAX_LEN, GFP_KERNEL);
+    if (!per_cpu(cache_wrkmem, cpu) || !per_cpu(cache_buf, cpu))
+      goto out_destroy;
+  }
+
+  queue_delayed_work(system_unbound_wq, &cache_reap_work,
+                     msecs_to_jiffies(CACHE_REAP_INTERVAL));
+  pr_info("compressed cache of %lu MB per node\n", cache_mb);
+  return 0;
+
+out_destroy:
+  cache_destroy();
+  return -ENOMEM;
+}
+
+static int cache_nodes_show(struct seq_file *m, void *v)
+{
+  int nid;
+
+  seq_puts(m, "node cached_kb limit_kb\n");
+  for (nid = 0; nid < nr_node_ids; nid++)
+    if (cache_nodes[nid])
+      seq_printf(m, "%d %lu %lu\n", nid, READ_ONCE(cache_nodes[nid]->bytes) >> 10,
+                 cache_limit >> 10);
+  return 0;
+}
+
+static void cache_cgroup_show(struct seq_file *m, struct cache_cgroup *cg)
+{
+  seq_printf(m, "%llu %lu %ld %lld %lld %lld %lld\n", cg->ino,
+             READ_ONCE(cg->limit) >> 20, atomic_long_read(&cg->bytes) >> 10,
+             atomic64_read(&cg->hits), atomic64_read(&cg->misses),
+             atomic64_read(&cg->writebacks), atomic64_read(&cg->rejects));
+}
+
+static int cache_cgroups_show(struct seq_file *m, void *v)
+{
+  struct cache_cgroup *cg;
+  int bkt;
+
+  seq_puts(m, "ino limit_mb cached_kb hits misses writebacks rejects\n");
+  cache_cgroup_show(m, &cache_cgroup_none);
+  rcu_read_lock();
+  hash_for_each_rcu(cache_cgroups, bkt, cg, node)
+    cache_cgroup_show(m, cg);
+  rcu_read_unlock();
+  return 0;
+}
+
+/* takes "<ino> <limit in MB>", ino being the inode number of the cgroup's
+ * directory (stat -c %i), and a limit of 0 lifting the cgroup's limit. a
+ * cgroup not seen yet gets its state here */
+static ssize_t cache_cgroups_write(struct file *file, const char __user *ubuf,
+                                   size_t len, loff_t *ppos)
+{
+  struct cache_cgroup *cg, *new;
+  unsigned long mb;
+  char buf[64];
+  u64 ino;
+
+  if (len >= sizeof(buf))
+    return -EINVAL;
+  if (copy_from_user(buf, ubuf, len))
+    return -EFAULT;
+  buf[len] = '\0';
+
+  if (sscanf(buf, "%llu %lu", &ino, &mb) != 2 || !ino)
+    return -EINVAL;
+
+  new = kzalloc(sizeof(*new), GFP_KERNEL);
+  spin_lock(&cache_cgroups_lock);
+  cg = cache_cgroup_find(ino);
+  if (!cg && new) {
+    cg = new;
+    new = NULL;
+    cg->ino = ino;
+    refcount_set(&cg->refs, 1);
+    hash_add_rcu(cache_cgroups, &cg->node, ino);
+  }
+  if (cg)
+    WRITE_ONCE(cg->limit, mb << 20);
+  spin_unlock(&cache_cgroups_lock);
+  kfree(new);
+
+  return cg ? len : -ENOMEM;
+}
+
+static int cache_nodes_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, cache_nodes_show, NULL);
+}
+
+static int cache_cgroups_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, cache_cgroups_show, NULL);
+}
+
+static const struct file_operations cache_nodes_fops = {
+  .owner = THIS_MODULE,
+  .open = cache_nodes_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations cache_cgroups_fops = {
+  .owner = THIS_MODULE,
+  .open = cache_cgroups_open,
+  .read = seq_read,
+  .write = cache_cgroups_write,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+/*
+ * returns true if page is a single value repeated, which goes in *value.
+ * most other pages differ within their first cache line, so the scan
+ * xors a line's worth of words against the value at a time and bails out
+ * at the first line that has a difference
+ */
+static bool page_same_filled(struct page *page, u64 *value)
+{
+  const u64 *p = page_address(page);
+  u64 v = p[0], diff;
+  int i;
+
+  if (p[PAGE_SIZE / sizeof(*p) - 1] != v)
+    return false;
+
+  for (i = 0; i < PAGE_SIZE / sizeof(*p); i += 8) {
+    diff = (p[i] ^ v) | (p[i + 1] ^ v) | (p[i + 2] ^ v) | (p[i + 3] ^ v) |
+           (p[i + 4] ^ v) | (p[i + 5] ^ v) | (p[i + 6] ^ v) | (p[i + 7] ^ v);
+    if (diff)
+      return false;
+  }
+
+  *value = v;
+  return true;
+}
+
 static int sswap_store(unsigned type, pgoff_t pageid,
         struct page *page)
 {
+  u64 value;
+
+  /* same filled pages aren't stored anywhere, the backend only keeps
+   * their value. a cached older version goes first, so that its
+   * writeback doesn't land after the value */
+  if (page_same_filled(page, &value)) {
+    if (cache_nodes)
+      cache_drop(pageid);
+    if (!sswap_rdma_write_filled(pageid, value)) {
+      end_page_writeback(page);
+      return 0;
+    }
+  }
+
+  if (cache_nodes && !cache_store(pageid, page))
+    return 0;
+
   if (sswap_rdma_write(page, pageid/* << PAGE_SHIFT*/)) {
     pr_err("could not store page remotely\n");
     return -1;
@@ -44,6 +834,12 @@ static int sswap_store(unsigned type, pgoff_t pageid,
  */
 static int sswap_load_async(unsigned type, pgoff_t pageid, struct page *page)
 {
+  if (cache_nodes) {
+    if (!cache_load(pageid, page))
+      return 0;
+    cache_miss(1);
+  }
+
   if (unlikely(sswap_rdma_read_async(page, pageid /*<< PAGE_SHIFT*/))) {
     pr_err("could not read page remotely\n");
     return -1;
@@ -52,8 +848,49 @@ static int sswap_load_async(unsigned type, pgoff_t pageid, struct page *page)
   return 0;
 }
 
+/*
+ * return the number of pages, from the start of pages, that were posted
+ */
+static int sswap_load_async_batch(unsigned type, pgoff_t *pageids,
+        struct page **pages, int nr)
+{
+  int i, n, ret;
+
+  if (!cache_nodes) {
+    ret = sswap_rdma_read_async_batch(pages, pageids, nr);
+    if (unlikely(ret < nr))
+      pr_err("could only post %d of %d reads remotely\n", ret, nr);
+    return ret;
+  }
+
+  /* hits are served on the spot, the misses between them go out as one
+   * batch each */
+  for (i = 0; i < nr; i += ret) {
+    if (!cache_load(pageids[i], pages[i])) {
+      ret = 1;
+      continue;
+    }
+    for (n = 1; i + n < nr && !cache_holds(pageids[i + n], false); n++)
+      ;
+    cache_miss(n);
+    ret = sswap_rdma_read_async_batch(pages + i, pageids + i, n);
+    if (unlikely(ret < n)) {
+      pr_err("could only post %d of %d reads remotely\n", i + ret, nr);
+      return i + ret;
+    }
+  }
+
+  return nr;
+}
+
 static int sswap_load(unsigned type, pgoff_t pageid, struct page *page)
 {
+  if (cache_nodes) {
+    if (!cache_load(pageid, page))
+      return 0;
+    cache_miss(1);
+  }
+
   if (unlikely(sswap_rdma_read_sync(page, pageid /*<< PAGE_SHIFT*/))) {
     pr_err("could not read page remotely\n");
     return -1;
@@ -69,6 +906,8 @@ static int sswap_poll_load(int cpu)
 
 static void sswap_invalidate_page(unsigned type, pgoff_t offset)
 {
+  if (cache_nodes && cache_invalidate(offset))
+    return;
   sswap_rdma_free_page(offset /*<< PAGE_SHIFT*/);
   return;
 }
@@ -89,18 +928,39 @@ static struct frontswap_ops sswap_frontswap_ops = {
   .load = sswap_load,
   .poll_load = sswap_poll_load,
   .load_async = sswap_load_async,
+  .load_async_batch = sswap_load_async_batch,
   .invalidate_page = sswap_invalidate_page,
   .invalidate_area = sswap_invalidate_area,
 
 };
 
+static struct dentry *sswap_debugfs_root;
+
 static int __init sswap_init_debugfs(void)
 {
+  if (!cache_nodes)
+    return 0;
+
+  sswap_debugfs_root = debugfs_create_dir("fastswap", NULL);
+  if (!sswap_debugfs_root)
+    return -ENOMEM;
+
+  debugfs_create_file("cache", 0444, sswap_debugfs_root, NULL,
+                      &cache_nodes_fops);
+  debugfs_create_file("cgroups", 0644, sswap_debugfs_root, NULL,
+                      &cache_cgroups_fops);
   return 0;
 }
 
 static int __init init_sswap(void)
 {
+  if (cache_mb && cache_init()) {
+    pr_err("could not set up the compressed cache\n");
+    return -ENOMEM;
+  }
+
+  if (cache_nodes)
+    sswap_rdma_set_write_end(cache_wb_end);
   frontswap_register_ops(&sswap_frontswap_ops);
   if (sswap_init_debugfs())
     pr_err("sswap debugfs failed\n");
@@ -112,6 +972,9 @@ static int __init init_sswap(void)
 static void __exit exit_sswap(void)
 {
   pr_info("unloading sswap\n");
+  debugfs_remove_recursive(sswap_debugfs_root);
+  cache_destroy();
+  sswap_rdma_set_write_end(NULL);
 }
 
 module_init(init_sswap);
@@ -0,0 +1,490 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+/*
+ * Microbenchmarks for the fastswap data path. Pick one with test= at
+ * insmod, results go to dmesg:
+ *
+ *   sudo insmod fastswap_bench.ko test=dma pages=4096 threads=1
+ *   sudo rmmod fastswap_bench
+ *
+ *   sudo insmod fastswap_bench.ko test=lookup threads=128
+ *   sudo insmod fastswap_bench.ko test=alloc threads=128
+ */
+
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/completion.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/delay.h>
+#include <linux/rhashtable.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
+#include <rdma/ib_verbs.h>
+
+static char test[16] = "dma";
+static int npages = 4096;
+static int nthreads = 1;
+static int rounds = 16;
+static int nblocks = 25600;
+module_param_string(test, test, sizeof(test), 0444);
+module_param_named(pages, npages, int, 0444);
+module_param_named(threads, nthreads, int, 0444);
+module_param(rounds, int, 0444);
+module_param_named(blocks, nblocks, int, 0444);
+
+struct bench_thread {
+  struct task_struct *task;
+  int id;
+  int (*fn)(struct bench_thread *);
+  void *priv;
+  /* filled in by fn */
+  u64 ns[2];
+  u64 ops[2];
+  int ret;
+  struct completion done;
+};
+
+static atomic_t bench_ready;
+static atomic_t bench_go;
+
+static int bench_thread_fn(void *data)
+{
+  struct bench_thread *t = data;
+
+  /* start all threads at once so they actually contend */
+  atomic_inc(&bench_ready);
+  while (!atomic_read(&bench_go))
+    cpu_relax();
+
+  t->ret = t->fn(t);
+  complete(&t->done);
+
+  while (!kthread_should_stop())
+    msleep(1);
+  return 0;
+}
+
+/* runs fn on nthreads kthreads, one per cpu, and sums up their results */
+static int run_threads(int (*fn)(struct bench_thread *), void *priv,
+                       u64 *ns, u64 *ops)
+{
+  struct bench_thread *threads;
+  int i, ret = 0;
+
+  threads = kcalloc(nthreads, sizeof(*threads), GFP_KERNEL);
+  if (!threads)
+    return -ENOMEM;
+
+  atomic_set(&bench_ready, 0);
+  atomic_set(&bench_go, 0);
+
+  for (i = 0; i < nthreads; i++) {
+    threads[i].id = i;
+    threads[i].fn = fn;
+    threads[i].priv = priv;
+    init_completion(&threads[i].done);
+    threads[i].task = kthread_create(bench_thread_fn, &threads[i],
+                                     "sswap_bench/%d", i);
+    if (IS_ERR(threads[i].task)) {
+      pr_err("kthread_create failed\n");
+      ret = PTR_ERR(threads[i].task);
+      nthreads = i;
+      break;
+    }
+    kthread_bind(threads[i].task, i % num_online_cpus());
+    wake_up_process(threads[i].task);
+  }
+
+  while (atomic_read(&bench_ready) < nthreads)
+    msleep(1);
+  atomic_set(&bench_go, 1);
+
+  ns[0] = ns[1] = ops[0] = ops[1] = 0;
+  for (i = 0; i < nthreads; i++) {
+    wait_for_completion(&threads[i].done);
+    kthread_stop(threads[i].task);
+    if (threads[i].ret)
+      ret = threads[i].ret;
+    ns[0] += threads[i].ns[0];
+    ns[1] += threads[i].ns[1];
+    ops[0] += threads[i].ops[0];
+    ops[1] += threads[i].ops[1];
+  }
+
+  kfree(threads);
+  return ret;
+}
+
+/*
+ * test=dma: per page cost of the dma map + sync + unmap that the data path
+ * does without physaddr, against the page_to_phys it does with it. Run it
+ * once booted with the iommu on and once with it off (or iommu=pt) to see
+ * what the mapping costs in each case.
+ */
+
+static struct ib_device *bench_ibdev;
+
+static int bench_add_one(struct ib_device *dev)
+{
+  if (!bench_ibdev)
+    bench_ibdev = dev;
+  return 0;
+}
+
+static void bench_remove_one(struct ib_device *dev, void *client_data)
+{
+  if (dev == bench_ibdev)
+    bench_ibdev = NULL;
+}
+
+static struct ib_client bench_ib_client = {
+  .name   = "sswap_bench",
+  .add    = bench_add_one,
+  .remove = bench_remove_one
+};
+
+static int dma_bench_fn(struct bench_thread *t)
+{
+  struct ib_device *dev = t->priv;
+  struct page **pages;
+  u64 dma, start, sum = 0;
+  int i, r, ret = 0;
+
+  pages = kvcalloc(npages, sizeof(*pages), GFP_KERNEL);
+  if (!pages)
+    return -ENOMEM;
+
+  for (i = 0; i < npages; i++) {
+    pages[i] = alloc_page(GFP_KERNEL);
+    if (!pages[i]) {
+      ret = -ENOMEM;
+      goto out_free;
+    }
+  }
+
+  for (r = 0; r < rounds; r++) {
+    /* the write path: map + sync for the device, unmap on completion */
+    start = ktime_get_ns();
+    for (i = 0; i < npages; i++) {
+      dma = ib_dma_map_page(dev, pages[i], 0, PAGE_SIZE, DMA_TO_DEVICE);
+      if (unlikely(ib_dma_mapping_error(dev, dma))) {
+        ret = -EIO;
+        goto out_free;
+      }
+      ib_dma_sync_single_for_device(dev, dma, PAGE_SIZE, DMA_TO_DEVICE);
+      ib_dma_unmap_page(dev, dma, PAGE_SIZE, DMA_TO_DEVICE);
+    }
+    t->ns[0] += ktime_get_ns() - start;
+    t->ops[0] += npages;
+
+    /* physaddr */
+    start = ktime_get_ns();
+    for (i = 0; i < npages; i++)
+      sum += page_to_phys(pages[i]);
+    t->ns[1] += ktime_get_ns() - start;
+    t->ops[1] += npages;
+  }
+
+  /* keep the compiler from dropping the loop */
+  if (!sum)
+    pr_info("no pages\n");
+
+out_free:
+  for (i = 0; i < npages && pages[i]; i++)
+    __free_page(pages[i]);
+  kvfree(pages);
+  return ret;
+}
+
+static int dma_bench(void)
+{
+  struct page *page;
+  u64 ns[2], ops[2], dma;
+  bool identity;
+  int ret;
+
+  ret = ib_register_client(&bench_ib_client);
+  if (ret)
+    return ret;
+
+  if (!bench_ibdev) {
+    pr_err("no rdma device found\n");
+    ret = -ENODEV;
+    goto out_unregister;
+  }
+
+  page = alloc_page(GFP_KERNEL);
+  if (!page) {
+    ret = -ENOMEM;
+    goto out_unregister;
+  }
+  dma = ib_dma_map_page(bench_ibdev, page, 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+  identity = !ib_dma_mapping_error(bench_ibdev, dma) &&
+             dma == page_to_phys(page);
+  if (!ib_dma_mapping_error(bench_ibdev, dma))
+    ib_dma_unmap_page(bench_ibdev, dma, PAGE_SIZE, DMA_BIDIRECTIONAL);
+  __free_page(page);
+
+  pr_info("dma: device %s, dma is %s\n", dev_name(&bench_ibdev->dev),
+          identity ? "identity mapped (iommu off or pt)" : "translated");
+
+  ret = run_threads(dma_bench_fn, bench_ibdev, ns, ops);
+  if (ret)
+    goto out_unregister;
+
+  pr_info("dma: %d threads x %d pages x %d rounds\n", nthreads, npages, rounds);
+  pr_info("dma: map+sync+unmap %llu ns/page\n", div64_u64(ns[0], ops[0]));
+  pr_info("dma: page_to_phys   %llu ns/page\n", div64_u64(ns[1], ops[1]));
+
+out_unregister:
+  ib_unregister_client(&bench_ib_client);
+  return ret;
+}
+
+/*
+ * test=lookup: cost of finding the rkey and server address of the block a
+ * remote address is in, the way rpage_allocator used to (rhashtable with
+ * jhash, keyed by the block address) against the way it does now (index
+ * into block_table). every thread looks up pages random addresses per
+ * round, in blocks blocks.
+ */
+
+#define LOOKUP_BLOCK_SHIFT 22
+
+struct lookup_block {
+  u64 raddr;
+  u64 remote;
+  u32 rkey;
+  struct rhash_head node;
+};
+
+static const struct rhashtable_params lookup_params = {
+  .head_offset = offsetof(struct lookup_block, node),
+  .key_offset = offsetof(struct lookup_block, raddr),
+  .key_len = sizeof(((struct lookup_block *)0)->raddr),
+  .hashfn = jhash,
+};
+
+struct lookup_ctx {
+  struct rhashtable map;
+  struct lookup_block *blocks;
+  struct lookup_block **table;
+};
+
+static int lookup_bench_fn(struct bench_thread *t)
+{
+  struct lookup_ctx *ctx = t->priv;
+  struct lookup_block *b;
+  u64 start, key, sum = 0;
+  u32 seed = t->id * 2654435761U + 1;
+  u32 *idx;
+  int i, r;
+
+  idx = kvcalloc(npages, sizeof(*idx), GFP_KERNEL);
+  if (!idx)
+    return -ENOMEM;
+  for (i = 0; i < npages; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    idx[i] = seed % nblocks;
+  }
+
+  for (r = 0; r < rounds; r++) {
+    /* old: hash the block address */
+    start = ktime_get_ns();
+    for (i = 0; i < npages; i++) {
+      key = (u64)idx[i] << LOOKUP_BLOCK_SHIFT;
+      b = rhashtable_lookup_fast(&ctx->map, &key, lookup_params);
+      sum += b->remote + b->rkey;
+    }
+    t->ns[0] += ktime_get_ns() - start;
+    t->ops[0] += npages;
+
+    /* new: index the table with the block number */
+    start = ktime_get_ns();
+    for (i = 0; i < npages; i++) {
+      key = (u64)idx[i] << LOOKUP_BLOCK_SHIFT;
+      b = READ_ONCE(ctx->table[key >> LOOKUP_BLOCK_SHIFT]);
+      sum += b->remote + b->rkey;
+    }
+    t->ns[1] += ktime_get_ns() - start;
+    t->ops[1] += npages;
+  }
+
+  /* keep the compiler from dropping the loops */
+  if (!sum)
+    pr_info("no blocks\n");
+
+  kvfree(idx);
+  return 0;
+}
+
+static int lookup_bench(void)
+{
+  struct lookup_ctx ctx;
+  u64 ns[2], ops[2];
+  int i, ret;
+
+  ctx.blocks = vzalloc(nblocks * sizeof(*ctx.blocks));
+  ctx.table = vzalloc(nblocks * sizeof(*ctx.table));
+  ret = -ENOMEM;
+  if (!ctx.blocks || !ctx.table)
+    goto out_free;
+
+  ret = rhashtable_init(&ctx.map, &lookup_params);
+  if (ret)
+    goto out_free;
+
+  for (i = 0; i < nblocks; i++) {
+    ctx.blocks[i].raddr = (u64)i << LOOKUP_BLOCK_SHIFT;
+    ctx.blocks[i].remote = 0x7f0000000000ULL + ctx.blocks[i].raddr;
+    ctx.blocks[i].rkey = i + 1;
+    ctx.table[i] = &ctx.blocks[i];
+    ret = rhashtable_insert_fast(&ctx.map, &ctx.blocks[i].node,
+                                 lookup_params);
+    if (ret)
+      goto out_destroy;
+  }
+
+  ret = run_threads(lookup_bench_fn, &ctx, ns, ops);
+  if (ret)
+    goto out_destroy;
+
+  pr_info("lookup: %d threads x %d lookups x %d rounds in %d blocks\n",
+          nthreads, npages, rounds, nblocks);
+  pr_info("lookup: rhashtable  %llu ns/lookup\n", div64_u64(ns[0], ops[0]));
+  pr_info("lookup: block table %llu ns/lookup\n", div64_u64(ns[1], ops[1]));
+
+out_destroy:
+  rhashtable_destroy(&ctx.map);
+out_free:
+  vfree(ctx.table);
+  vfree(ctx.blocks);
+  return ret;
+}
+
+/*
+ * test=alloc: stress of rpage_allocator's page allocation. every thread
+ * allocates pages remote pages and frees them again, per round, for 1, 2,
+ * 4... up to threads threads. the ns per alloc + free staying flat as
+ * threads are added is linear scaling. needs rpage_allocator.ko loaded
+ * with blocks coming in through /dev/shm/cpu_cache.
+ */
+
+/* from rpage_allocator.ko, looked up at run time so that the other tests
+ * don't need it loaded */
+u64 alloc_remote_page(u32 server);
+void free_remote_page(u64 raddr);
+
+struct alloc_ctx {
+  u64 (*alloc)(u32 server);
+  void (*free)(u64 raddr);
+};
+
+static int alloc_bench_fn(struct bench_thread *t)
+{
+  struct alloc_ctx *ctx = t->priv;
+  u64 *raddrs, start;
+  int i, k, r, ret = 0;
+
+  raddrs = kvcalloc(npages, sizeof(*raddrs), GFP_KERNEL);
+  if (!raddrs)
+    return -ENOMEM;
+
+  for (r = 0; r < rounds; r++) {
+    start = ktime_get_ns();
+    for (i = 0; i < npages; i++) {
+      raddrs[i] = ctx->alloc(0);
+      if (unlikely(!raddrs[i])) {
+        ret = -ENOMEM;
+        break;
+      }
+    }
+    /* free in another order than allocated, like swap does */
+    for (k = 1; k < i; k += 2)
+      ctx->free(raddrs[k]);
+    for (k = 0; k < i; k += 2)
+      ctx->free(raddrs[k]);
+    t->ns[0] += ktime_get_ns() - start;
+    t->ops[0] += npages;
+    if (ret)
+      break;
+  }
+
+  kvfree(raddrs);
+  return ret;
+}
+
+static int alloc_bench(void)
+{
+  struct alloc_ctx ctx;
+  int max_threads = nthreads;
+  u64 ns[2], ops[2];
+  int ret = 0;
+
+  ctx.alloc = symbol_get(alloc_remote_page);
+  ctx.free = symbol_get(free_remote_page);
+  if (!ctx.alloc || !ctx.free) {
+    pr_err("rpage_allocator is not loaded\n");
+    ret = -ENOENT;
+    goto out_put;
+  }
+
+  pr_info("alloc: %d pages x %d rounds per thread\n", npages, rounds);
+  for (nthreads = 1; ; nthreads = min(nthreads * 2, max_threads)) {
+    ret = run_threads(alloc_bench_fn, &ctx, ns, ops);
+    if (ret)
+      break;
+    pr_info("alloc: %3d threads %llu ns/page, %llu kpages/s\n", nthreads,
+            div64_u64(ns[0], ops[0]),
+            div64_u64(ops[0] * nthreads * NSEC_PER_MSEC, ns[0]));
+    if (nthreads == max_threads)
+      break;
+  }
+  nthreads = max_threads;
+
+out_put:
+  if (ctx.alloc)
+    symbol_put(alloc_remote_page);
+  if (ctx.free)
+    symbol_put(free_remote_page);
+  return ret;
+}
+
+static int __init sswap_bench_init(void)
+{
+  int ret;
+
+  if (nthreads < 1 || npages < 1 || rounds < 1 || nblocks < 1)
+    return -EINVAL;
+
+  pr_info("running %s\n", test);
+
+  if (!strcmp(test, "dma"))
+    ret = dma_bench();
+  else if (!strcmp(test, "lookup"))
+    ret = lookup_bench();
+  else if (!strcmp(test, "alloc"))
+    ret = alloc_bench();
+  else {
+    pr_err("unknown test %s\n", test);
+    ret = -EINVAL;
+  }
+
+  if (ret)
+    pr_err("%s failed: %d\n", test, ret);
+  return ret;
+}
+
+static void __exit sswap_bench_exit(void)
+{
+}
+
+module_init(sswap_bench_init);
+module_exit(sswap_bench_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("Fastswap microbenchmarks");
@@ -8,18 +8,40 @@
 #define REMOTE_BUF_SIZE (ONEGB * 32) /* must match what server is allocating */
 
 static void *drambuf;
+static void (*write_end)(struct page *page, bool ok);
+
+/* fn is told when the write of a page that is not in the swap cache is
+ * over, see the rdma backend */
+void sswap_rdma_set_write_end(void (*fn)(struct page *page, bool ok))
+{
+	write_end = fn;
+}
+EXPORT_SYMBOL(sswap_rdma_set_write_end);
 
 int sswap_rdma_write(struct page *page, u64 roffset)
 {
+	bool private = !PageSwapCache(page);
 	void *page_vaddr;
 
 	page_vaddr = kmap_atomic(page);
 	copy_page((void *) (drambuf + roffset), page_vaddr);
 	kunmap_atomic(page_vaddr);
+
+	/* the store is synchronous, so writeback ends right away */
+	end_page_writeback(page);
+	if (private && write_end)
+		write_end(page, true);
 	return 0;
 }
 EXPORT_SYMBOL(sswap_rdma_write);
 
+/* the buffer is local memory anyway, there is nothing to save */
+int sswap_rdma_write_filled(u64 roffset, u64 value)
+{
+	return -1;
+}
+EXPORT_SYMBOL(sswap_rdma_write_filled);
+
 int sswap_rdma_poll_load(int cpu)
 {
 	return 0;
@@ -44,6 +66,17 @@ int sswap_rdma_read_async(struct page *page, u64 roffset)
 }
 EXPORT_SYMBOL(sswap_rdma_read_async);
 
+int sswap_rdma_read_async_batch(struct page **pages, pgoff_t *roffsets, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		sswap_rdma_read_async(pages[i], roffsets[i]);
+
+	return nr;
+}
+EXPORT_SYMBOL(sswap_rdma_read_async_batch);
+
 int sswap_rdma_read_sync(struct page *page, u64 roffset)
 {
 	return sswap_rdma_read_async(page, roffset);
@@ -6,8 +6,11 @@
 
 
 int sswap_rdma_read_async(struct page *page, u64 roffset);
+int sswap_rdma_read_async_batch(struct page **pages, pgoff_t *roffsets, int nr);
 int sswap_rdma_read_sync(struct page *page, u64 roffset);
 int sswap_rdma_write(struct page *page, u64 roffset);
+int sswap_rdma_write_filled(u64 roffset, u64 value);
+void sswap_rdma_set_write_end(void (*fn)(struct page *page, bool ok));
 int sswap_rdma_poll_load(int cpu);
 int sswap_rdma_drain_loads_sync(int cpu, int target);
 
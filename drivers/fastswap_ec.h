@@ -0,0 +1,250 @@
+#if !defined(_SSWAP_EC_H)
+#define _SSWAP_EC_H
+
+/*
+ * Reed-Solomon erasure code over GF(2^8) for the erasure coded store mode
+ * of the rdma backend. A page is split into k data fragments and r parity
+ * fragments are computed from them with a Cauchy matrix, so any k of the
+ * k + r fragments give the page back. Region multiplies use AVX2 when the
+ * cpu has it and the fpu is usable in the calling context.
+ */
+
+#include <linux/types.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/mm.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+
+#define EC_MAX_K 8
+#define EC_MAX_R 4
+#define EC_MAX_FRAGS (EC_MAX_K + EC_MAX_R)
+
+struct sswap_ec {
+  int k;
+  int r;
+  size_t frag_size;
+  /* coding matrix rows of the parity fragments, the data rows are the
+   * identity */
+  u8 parity[EC_MAX_R][EC_MAX_K];
+  bool avx2;
+};
+
+static u8 gf_exp[512];
+static u8 gf_log[256];
+
+static void gf_init(void)
+{
+  int i, x = 1;
+
+  /* x^8 + x^4 + x^3 + x^2 + 1, 2 is a generator */
+  for (i = 0; i < 255; i++) {
+    gf_exp[i] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if (x & 0x100)
+      x ^= 0x11d;
+  }
+  for (i = 255; i < 512; i++)
+    gf_exp[i] = gf_exp[i - 255];
+}
+
+static inline u8 gf_mul(u8 a, u8 b)
+{
+  if (!a || !b)
+    return 0;
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline u8 gf_inv(u8 a)
+{
+  return gf_exp[255 - gf_log[a]];
+}
+
+/* dst ^= c * src */
+static void gf_mul_add_scalar(u8 *dst, const u8 *src, u8 c, size_t len)
+{
+  u8 tbl[256];
+  size_t i;
+
+  for (i = 0; i < 256; i++)
+    tbl[i] = gf_mul(c, i);
+  for (i = 0; i < len; i++)
+    dst[i] ^= tbl[src[i]];
+}
+
+#ifdef CONFIG_X86_64
+/* dst ^= c * src, 32 bytes at a time. c * x is lo[x & 0xf] ^ hi[x >> 4],
+ * vpshufb does both table lookups. len is a multiple of 32 and the caller
+ * holds the fpu */
+static void gf_mul_add_avx2(u8 *dst, const u8 *src, u8 c, size_t len)
+{
+  static const u8 x0f = 0x0f;
+  u8 lo[16], hi[16];
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    lo[i] = gf_mul(c, i);
+    hi[i] = gf_mul(c, i << 4);
+  }
+
+  asm volatile("vbroadcasti128 %0, %%ymm7" : : "m" (lo[0]));
+  asm volatile("vbroadcasti128 %0, %%ymm6" : : "m" (hi[0]));
+  asm volatile("vpbroadcastb %0, %%ymm5" : : "m" (x0f));
+
+  for (; len; len -= 32, src += 32, dst += 32) {
+    asm volatile("vmovdqu %0, %%ymm0" : : "m" (src[0]));
+    asm volatile("vpsrlw $4, %ymm0, %ymm1");
+    asm volatile("vpand %ymm5, %ymm0, %ymm0");
+    asm volatile("vpand %ymm5, %ymm1, %ymm1");
+    asm volatile("vpshufb %ymm0, %ymm7, %ymm2");
+    asm volatile("vpshufb %ymm1, %ymm6, %ymm3");
+    asm volatile("vpxor %ymm2, %ymm3, %ymm2");
+    asm volatile("vpxor %0, %%ymm2, %%ymm2" : : "m" (dst[0]));
+    asm volatile("vmovdqu %%ymm2, %0" : "=m" (dst[0]));
+  }
+}
+#endif
+
+/* the fpu can't be taken from every context the completions run in, fall
+ * back to the tables there */
+static bool ec_fpu_begin(struct sswap_ec *ec)
+{
+#ifdef CONFIG_X86_64
+  if (ec->avx2 && irq_fpu_usable()) {
+    kernel_fpu_begin();
+    return true;
+  }
+#endif
+  return false;
+}
+
+static void ec_fpu_end(bool fpu)
+{
+#ifdef CONFIG_X86_64
+  if (fpu)
+    kernel_fpu_end();
+#endif
+}
+
+static inline void ec_mul_add(u8 *dst, const u8 *src, u8 c, size_t len,
+                              bool fpu)
+{
+#ifdef CONFIG_X86_64
+  if (fpu) {
+    gf_mul_add_avx2(dst, src, c, len);
+    return;
+  }
+#endif
+  gf_mul_add_scalar(dst, src, c, len);
+}
+
+static int sswap_ec_init(struct sswap_ec *ec, int k, int r)
+{
+  int i, j;
+
+  if (k < 2 || k > EC_MAX_K || (k & (k - 1)) || r < 1 || r > EC_MAX_R)
+    return -EINVAL;
+
+  gf_init();
+  ec->k = k;
+  ec->r = r;
+  ec->frag_size = PAGE_SIZE / k;
+
+  /* cauchy rows 1 / (x_j + y_i) with x_j = j and y_i = r + i. every square
+   * submatrix of a cauchy matrix is invertible, so any k fragments do */
+  for (j = 0; j < r; j++)
+    for (i = 0; i < k; i++)
+      ec->parity[j][i] = gf_inv(j ^ (r + i));
+
+#ifdef CONFIG_X86_64
+  ec->avx2 = boot_cpu_has(X86_FEATURE_AVX) && boot_cpu_has(X86_FEATURE_AVX2);
+#else
+  ec->avx2 = false;
+#endif
+  return 0;
+}
+
+/* frags[0..k) are the data fragments, fills in frags[k..k+r) */
+static void sswap_ec_encode(struct sswap_ec *ec, u8 **frags)
+{
+  bool fpu = ec_fpu_begin(ec);
+  int i, j;
+
+  for (j = 0; j < ec->r; j++) {
+    memset(frags[ec->k + j], 0, ec->frag_size);
+    for (i = 0; i < ec->k; i++)
+      ec_mul_add(frags[ec->k + j], frags[i], ec->parity[j][i],
+                 ec->frag_size, fpu);
+  }
+
+  ec_fpu_end(fpu);
+}
+
+/* sel[0..k) are the fragments that were read into frags. rebuilds every
+ * data fragment that is not among them into its frags buffer */
+static int sswap_ec_decode(struct sswap_ec *ec, const u8 *sel, u8 **frags)
+{
+  u8 m[EC_MAX_K][EC_MAX_K], inv[EC_MAX_K][EC_MAX_K];
+  bool have[EC_MAX_FRAGS] = { false };
+  int k = ec->k, i, j, t, p;
+  u8 c;
+  bool fpu;
+
+  /* rows of the coding matrix for the fragments we have */
+  for (t = 0; t < k; t++) {
+    have[sel[t]] = true;
+    for (i = 0; i < k; i++) {
+      if (sel[t] < k)
+        m[t][i] = (sel[t] == i);
+      else
+        m[t][i] = ec->parity[sel[t] - k][i];
+      inv[t][i] = (t == i);
+    }
+  }
+
+  /* gauss-jordan */
+  for (i = 0; i < k; i++) {
+    for (p = i; p < k && !m[p][i]; p++)
+      ;
+    if (p == k)
+      return -EINVAL;
+    if (p != i) {
+      for (j = 0; j < k; j++) {
+        swap(m[i][j], m[p][j]);
+        swap(inv[i][j], inv[p][j]);
+      }
+    }
+    c = gf_inv(m[i][i]);
+    for (j = 0; j < k; j++) {
+      m[i][j] = gf_mul(m[i][j], c);
+      inv[i][j] = gf_mul(inv[i][j], c);
+    }
+    for (t = 0; t < k; t++) {
+      if (t == i || !m[t][i])
+        continue;
+      c = m[t][i];
+      for (j = 0; j < k; j++) {
+        m[t][j] ^= gf_mul(c, m[i][j]);
+        inv[t][j] ^= gf_mul(c, inv[i][j]);
+      }
+    }
+  }
+
+  fpu = ec_fpu_begin(ec);
+  for (i = 0; i < k; i++) {
+    if (have[i])
+      continue;
+    memset(frags[i], 0, ec->frag_size);
+    for (t = 0; t < k; t++)
+      if (inv[i][t])
+        ec_mul_add(frags[i], frags[sel[t]], inv[i][t], ec->frag_size, fpu);
+  }
+  ec_fpu_end(fpu);
+
+  return 0;
+}
+
+#endif
@@ -1,25 +1,213 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include "fastswap_rdma.h"
+#include "fastswap_ec.h"
 #include <linux/slab.h>
 #include <linux/cpumask.h> 
 #include <linux/delay.h>
-
-static struct sswap_rdma_ctrl *gctrl;
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
+#include <linux/lz4.h>
+#include <linux/xxhash.h>
+#include <linux/refcount.h>
+#include <linux/kthread.h>
+#include <linux/srcu.h>
+#include <linux/llist.h>
+
+/* one ctrl per memory server, indexed by server id */
+static struct sswap_rdma_ctrl *gctrls[max_servers];
+static int nservers;
 static int serverport;
 static int numqueues;
 static int numcpus;
-static char serverip[INET_ADDRSTRLEN];
+static int qsets;
+static int qps = 1;
+static int queues_per_type;
+static DEFINE_PER_CPU(unsigned int, qp_rr);
+static char placement[16] = "rr";
+static char sweight[128];
+static int stripe = 16;
+enum { PLACE_RR, PLACE_WEIGHTED, PLACE_HASH };
+static u32 place_policy;
+static u32 weights[max_servers];
+static u32 weight_sum;
+static DEFINE_PER_CPU(unsigned int, place_rr);
+/* servers whose qps went into error */
+static DECLARE_BITMAP(servers_down, max_servers);
+static int ec_k;
+static int ec_r = 1;
+static char serverip[512];
 static char clientip[INET_ADDRSTRLEN];
-static struct kmem_cache *req_cache;
+static bool physaddr;
+static bool adaptive_cq = true;
+static bool compress;
+static bool dedup;
+static int conn_window = 32;
+static int compact_mbps;
 module_param_named(sport, serverport, int, 0644);
 module_param_named(nq, numqueues, int, 0644);
-module_param_string(sip, serverip, INET_ADDRSTRLEN, 0644);
+MODULE_PARM_DESC(nq, "ignored, the queue count follows from qsets and qps");
+module_param(qsets, int, 0444);
+MODULE_PARM_DESC(qsets, "queue sets, cpus are split evenly between them (default: one per cpu)");
+module_param(qps, int, 0444);
+MODULE_PARM_DESC(qps, "qps per queue set for each of sync reads, async reads and writes (default: 1)");
+module_param_string(sip, serverip, sizeof(serverip), 0644);
+MODULE_PARM_DESC(sip, "memory servers, comma separated ip or ip:port (port defaults to sport)");
+module_param_string(placement, placement, sizeof(placement), 0444);
+MODULE_PARM_DESC(placement, "how pages are spread over the servers: rr, weighted or hash");
+module_param_string(sweight, sweight, sizeof(sweight), 0444);
+MODULE_PARM_DESC(sweight, "comma separated server weights for placement=weighted, e.g. their capacity in GB");
+module_param(stripe, int, 0444);
+MODULE_PARM_DESC(stripe, "pages placed on a server before moving to the next (default: 16)");
+module_param(ec_k, int, 0444);
+MODULE_PARM_DESC(ec_k, "erasure code every page into ec_k data fragments on different servers: 2, 4 or 8 (default: 0, off)");
+module_param(ec_r, int, 0444);
+MODULE_PARM_DESC(ec_r, "parity fragments per page with ec_k, up to 4 (default: 1)");
 module_param_string(cip, clientip, INET_ADDRSTRLEN, 0644);
+module_param(physaddr, bool, 0444);
+MODULE_PARM_DESC(physaddr, "address pages by physical address instead of mapping each transfer (needs iommu off or iommu=pt)");
+module_param(adaptive_cq, bool, 0444);
+MODULE_PARM_DESC(adaptive_cq, "switch async read cqs to polling under heavy readahead");
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "lz4 compress pages into 512B to 2KB remote slots, pages that don't fit in 2KB are stored whole");
+module_param(dedup, bool, 0444);
+MODULE_PARM_DESC(dedup, "pages with the same contents share one remote page");
+module_param(conn_window, int, 0444);
+MODULE_PARM_DESC(conn_window, "queues of a server that connect at once at load time (default: 32)");
+module_param(compact_mbps, int, 0644);
+MODULE_PARM_DESC(compact_mbps, "MB/s of pages the compactor may move out of sparse remote blocks, not with ec_k, compress or dedup (default: 0, off)");
+
+/* compress: the compressed length of every offset, 0 for offsets stored
+ * as whole pages. the entry in the offset map is the slot address. the
+ * lengths are kept in leaves beside those of the offset map, which come
+ * in with them */
+#define RPAGE_CLEN_LEAF_SIZE (RPAGE_LEAF_ENTRIES * sizeof(u16))
+static u16 *clen_map[RPAGE_NUM_LEAVES];
+/* compressed copies of pages on their way to or from the slots */
+static mempool_t *cz_page_pool;
+static DEFINE_PER_CPU(void *, cz_wrkmem);
+static atomic64_t cz_stored = ATOMIC64_INIT(0);
+static atomic64_t cz_bytes = ATOMIC64_INIT(0);
+static atomic64_t cz_whole = ATOMIC64_INIT(0);
+#define CZ_POOL_SIZE 256
+static atomic_t num_filled_pages = ATOMIC_INIT(0);
+static atomic_t num_map_leaves = ATOMIC_INIT(0);
+static atomic_t num_clen_leaves = ATOMIC_INIT(0);
+
+/* dedup: an index of the remote pages by the contents they hold */
+struct dedup_entry {
+  u64 fp[2]; /* fingerprint of the contents */
+  u64 raddr;
+  u32 clen;
+  bool ready; /* the write of the contents is done */
+  refcount_t refs; /* offsets mapped to raddr */
+  struct rhash_head fp_node;
+  struct rhash_head raddr_node;
+  struct rcu_head rcu;
+};
+static struct rhashtable dedup_fp_map;
+static struct rhashtable dedup_raddr_map;
+static struct kmem_cache *dedup_cache;
+static DEFINE_SPINLOCK(dedup_lock);
+/* offsets mapped to a remote page that another offset holds too */
+static atomic_t dedup_shared = ATOMIC_INIT(0);
+static atomic64_t dedup_hits = ATOMIC64_INIT(0);
+
+/* compaction: a few live pages can keep a remote block from ever being
+ * given back. the compactor takes sparse blocks out of allocation, copies
+ * their pages through a local page to pages of denser blocks and points
+ * the offsets at the copies, so that the blocks empty out for gc. passes
+ * are COMPACT_INTERVAL apart and move up to compact_mbps MB each */
+#define COMPACT_INTERVAL 1000 /* ms */
+#define COMPACT_BATCH 32 /* pages copied at once */
+#define COMPACT_MAX_PAGES (1 << 16) /* pages one pass moves at most */
+#define COMPACT_MAX_BLOCKS 256 /* blocks one pass picks at most */
+#define COMPACT_BLOCK_PAGES (rblock_size >> PAGE_SHIFT)
+
+struct compact_batch {
+  u64 roffsets[COMPACT_BATCH];
+  u64 from[COMPACT_BATCH];
+  u64 to[COMPACT_BATCH];
+  struct page *pages[COMPACT_BATCH];
+  int n;
+  bool failed;
+  atomic_t remaining;
+  struct completion done;
+};
+
+/* what a pass took: the blocks it picked, and the pages it moved out of
+ * them, which it frees once no read can still go to them */
+struct compact_state {
+  struct compact_batch batch;
+  u64 *pages;
+  u32 npages;
+  u64 blocks[COMPACT_MAX_BLOCKS];
+  u32 nblocks;
+};
+static struct compact_state compact;
+static struct task_struct *compact_task;
+/* reverse map of the page blocks, by block_table index: the offset each
+ * page was last handed to, so that a pass only looks at the pages of the
+ * blocks it picked. an offset that has let go of its page since doesn't
+ * point to it any more, which the pass checks */
+static u32 **compact_owners;
+/* reads hold it from looking up the remote page of an offset until the
+ * read completes, so that the compactor knows when none can still go to
+ * a page it moved */
+DEFINE_STATIC_SRCU(compact_srcu);
+static atomic64_t compact_moved = ATOMIC64_INIT(0);
+static atomic64_t compact_aborted = ATOMIC64_INIT(0);
+
+/* records that the remote page raddr now holds roffset. a page whose
+ * block has no room in the reverse map for it is never moved */
+static void compact_set_owner(u64 raddr, u64 roffset)
+{
+  u32 **dir, *leaf;
+
+  if (!compact_owners)
+    return;
+  dir = &compact_owners[raddr_block_idx(raddr)];
+  leaf = READ_ONCE(*dir);
+  if (unlikely(!leaf)) {
+    /* this is the swap out path, don't reclaim for it */
+    leaf = kzalloc(COMPACT_BLOCK_PAGES * sizeof(u32),
+                   GFP_NOWAIT | __GFP_NOWARN);
+    if (!leaf)
+      return;
+    if (cmpxchg(dir, NULL, leaf)) {
+      kfree(leaf);
+      leaf = READ_ONCE(*dir);
+    }
+  }
+  WRITE_ONCE(leaf[(raddr >> PAGE_SHIFT) & (COMPACT_BLOCK_PAGES - 1)], roffset);
+}
+
+/* a read section of compact_srcu ends in the completion handler, not in
+ * the task that began it, so it stays out of lockdep */
+static inline int compact_read_lock(void)
+{
+  int idx;
+
+  preempt_disable();
+  idx = __srcu_read_lock(&compact_srcu);
+  preempt_enable();
+  return idx;
+}
+
+static inline void compact_read_unlock(int idx)
+{
+  __srcu_read_unlock(&compact_srcu, idx);
+}
 
 // TODO: destroy ctrl
 
 #define CONNECTION_TIMEOUT_MS 60000
+/* the queues of a ctrl connect concurrently, so their cm handlers can race
+ * to pick its device */
+static DEFINE_MUTEX(rdev_lock);
 #define QP_QUEUE_DEPTH 256
 /* we don't really use recv wrs, so any small number should do */
 #define QP_MAX_RECV_WR 4
@@ -27,6 +215,39 @@ module_param_string(cip, clientip, INET_ADDRSTRLEN, 0644);
 #define QP_MAX_SEND_WR	(4096)
 #define CQ_NUM_CQES	(QP_MAX_SEND_WR)
 #define POLL_BATCH_HIGH (QP_MAX_SEND_WR / 4)
+/* a signaled write retires every unsignaled one posted before it */
+#define WRITE_SIGNAL_INTERVAL 32
+/* how long unsignaled writes may sit at the tail of an idle queue */
+#define WRITE_FLUSH_DELAY 1 /* jiffies */
+/* async read cq: completions per ADAPT_WINDOW_NS above which the cq is
+ * polled, and below which it goes back to interrupts */
+#define ADAPT_WINDOW_NS (100 * NSEC_PER_USEC)
+#define ADAPT_POLL_RATE 32
+#define ADAPT_IRQ_RATE 8
+/* how often a polled cq is reaped when nobody else does it */
+#define ADAPT_POLL_PERIOD_NS (20 * NSEC_PER_USEC)
+#define ASYNC_POLL_BUDGET 64
+/* event moderation for the async read cq in interrupt mode */
+#define CQ_MOD_COUNT 8
+#define CQ_MOD_PERIOD 16 /* usecs */
+
+/* queues are laid out by type, then by set, then by qp within the set:
+ * idx = (type * qsets + set) * qps + k. cpus are split evenly between the
+ * sets, in cpu id order. */
+static inline int queue_set(unsigned int idx)
+{
+  return (idx % queues_per_type) / qps;
+}
+
+static inline int cpu_to_set(unsigned int cpu)
+{
+  return cpu * qsets / nr_cpu_ids;
+}
+
+static inline int set_first_cpu(int set)
+{
+  return DIV_ROUND_UP(set * nr_cpu_ids, qsets);
+}
 
 static int sswap_rdma_addone(struct ib_device *dev)
 {
@@ -46,10 +267,53 @@ static struct ib_client sswap_rdma_ib_client = {
   .remove = sswap_rdma_removeone
 };
 
+/* the local dma lkey of the pd covers every dma address of the device. when
+ * the device sees physical memory 1:1 (no iommu, or iommu=pt) and dma is
+ * coherent, that is all of physical memory registered once, and the per
+ * page map/sync/unmap on the data path can go. checks that by mapping a
+ * page and comparing its dma address with its physical address. */
+static bool sswap_rdma_identity_dma(struct ib_device *dev)
+{
+  struct page *page;
+  u64 dma;
+  bool identity;
+
+  if (IS_ENABLED(CONFIG_ARCH_HAS_SYNC_DMA_FOR_DEVICE) ||
+      IS_ENABLED(CONFIG_ARCH_HAS_SYNC_DMA_FOR_CPU)) {
+    pr_info("dma is not coherent on this arch\n");
+    return false;
+  }
+
+  if (!dev->dma_device ||
+      dma_get_mask(dev->dma_device) != DMA_BIT_MASK(64)) {
+    pr_info("device cannot address all of physical memory\n");
+    return false;
+  }
+
+  page = alloc_page(GFP_KERNEL);
+  if (!page)
+    return false;
+
+  dma = ib_dma_map_page(dev, page, 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+  if (ib_dma_mapping_error(dev, dma)) {
+    __free_page(page);
+    return false;
+  }
+  identity = (dma == page_to_phys(page));
+  ib_dma_unmap_page(dev, dma, PAGE_SIZE, DMA_BIDIRECTIONAL);
+  __free_page(page);
+
+  if (!identity)
+    pr_info("device dma is translated (iommu or software device)\n");
+
+  return identity;
+}
+
 static struct sswap_rdma_dev *sswap_rdma_get_device(struct rdma_queue *q)
 {
   struct sswap_rdma_dev *rdev = NULL;
 
+  mutex_lock(&rdev_lock);
   if (!q->ctrl->rdev) {
     rdev = kzalloc(sizeof(*rdev), GFP_KERNEL);
     if (!rdev) {
@@ -73,8 +337,15 @@ static struct sswap_rdma_dev *sswap_rdma_get_device(struct rdma_queue *q)
       goto out_free_pd;
     }
 
+    if (physaddr) {
+      rdev->identity_dma = sswap_rdma_identity_dma(rdev->dev);
+      pr_info("physaddr requested, using %s\n", rdev->identity_dma ?
+              "physical addresses" : "per page dma mappings");
+    }
+
     q->ctrl->rdev = rdev;
   }
+  mutex_unlock(&rdev_lock);
 
   return q->ctrl->rdev;
 
@@ -83,6 +354,7 @@ out_free_pd:
 out_free_dev:
   kfree(rdev);
 out_err:
+  mutex_unlock(&rdev_lock);
   return NULL;
 }
 
@@ -104,7 +376,13 @@ static int sswap_rdma_create_qp(struct rdma_queue *queue)
   init_attr.cap.max_send_wr = QP_MAX_SEND_WR;
   init_attr.cap.max_recv_wr = QP_MAX_RECV_WR;
   init_attr.cap.max_recv_sge = 1;
-  init_attr.cap.max_send_sge = 1;
+  /* every sge makes each send queue entry bigger, only the queues that
+   * read readahead clusters get more than one */
+  queue->max_sge = 1;
+  if (queue->qp_type == QP_READ_ASYNC)
+    queue->max_sge = min_t(u32, RDMA_MAX_SGE,
+                           rdev->dev->attrs.max_send_sge);
+  init_attr.cap.max_send_sge = queue->max_sge;
   init_attr.sq_sig_type = IB_SIGNAL_REQ_WR;
   init_attr.qp_type = IB_QPT_RC;
   init_attr.send_cq = queue->cq;
@@ -122,6 +400,151 @@ static int sswap_rdma_create_qp(struct rdma_queue *queue)
   return ret;
 }
 
+/* caller holds q->cq_lock with bh disabled. runs the completion handlers
+ * of up to budget async read cqes */
+static int sswap_rdma_reap_async(struct rdma_queue *q, int budget)
+{
+  int i, n, done = 0;
+
+  while (done < budget) {
+    n = ib_poll_cq(q->cq, min_t(int, budget - done, ARRAY_SIZE(q->wcs)),
+                   q->wcs);
+    if (n <= 0)
+      break;
+    for (i = 0; i < n; i++)
+      q->wcs[i].wr_cqe->done(q->cq, &q->wcs[i]);
+    done += n;
+    if (n < ARRAY_SIZE(q->wcs))
+      break;
+  }
+
+  q->window_comps += done;
+  return done;
+}
+
+/* reaps the async read cq from process context, unless someone else is
+ * already at it */
+static int sswap_rdma_poll_async(struct rdma_queue *q, int budget)
+{
+  int done = 0;
+
+  if (spin_trylock_bh(&q->cq_lock)) {
+    done = sswap_rdma_reap_async(q, budget);
+    spin_unlock_bh(&q->cq_lock);
+  }
+  return done;
+}
+
+/* caller holds q->cq_lock. once per window, moves the cq between
+ * interrupt and polled mode by the completion rate seen in the window */
+static void sswap_rdma_adapt(struct rdma_queue *q)
+{
+  u64 now = ktime_get_ns();
+  u64 elapsed = now - q->window_start;
+
+  if (elapsed < ADAPT_WINDOW_NS)
+    return;
+
+  if (!q->polled && q->window_comps * ADAPT_WINDOW_NS >=
+                    ADAPT_POLL_RATE * elapsed) {
+    WRITE_ONCE(q->polled, true);
+    hrtimer_start(&q->poll_timer, ns_to_ktime(ADAPT_POLL_PERIOD_NS),
+                  HRTIMER_MODE_REL);
+  } else if (q->polled && q->window_comps * ADAPT_WINDOW_NS <
+                          ADAPT_IRQ_RATE * elapsed) {
+    /* poll_timer stops by itself */
+    WRITE_ONCE(q->polled, false);
+  }
+
+  q->window_start = now;
+  q->window_comps = 0;
+}
+
+static int sswap_rdma_async_poll(struct irq_poll *iop, int budget)
+{
+  struct rdma_queue *q = container_of(iop, struct rdma_queue, iop);
+  int done;
+
+  spin_lock(&q->cq_lock);
+  done = sswap_rdma_reap_async(q, budget);
+  if (adaptive_cq)
+    sswap_rdma_adapt(q);
+  spin_unlock(&q->cq_lock);
+
+  if (done < budget) {
+    irq_poll_complete(iop);
+    /* in polled mode the cq stays unarmed */
+    if (!q->polled && ib_req_notify_cq(q->cq, IB_CQ_NEXT_COMP |
+                                       IB_CQ_REPORT_MISSED_EVENTS) > 0)
+      irq_poll_sched(iop);
+  }
+
+  return done;
+}
+
+static void sswap_rdma_async_cq_event(struct ib_cq *cq, void *cq_context)
+{
+  struct rdma_queue *q = cq_context;
+
+  irq_poll_sched(&q->iop);
+}
+
+/* a polled cq is mostly reaped by the threads posting to it, this makes
+ * sure completions still get reaped when they stop */
+static enum hrtimer_restart sswap_rdma_poll_timer(struct hrtimer *timer)
+{
+  struct rdma_queue *q = container_of(timer, struct rdma_queue, poll_timer);
+
+  if (!READ_ONCE(q->polled))
+    return HRTIMER_NORESTART;
+
+  irq_poll_sched(&q->iop);
+  hrtimer_forward_now(timer, ns_to_ktime(ADAPT_POLL_PERIOD_NS));
+  return HRTIMER_RESTART;
+}
+
+static int sswap_rdma_create_async_cq(struct rdma_queue *q, int comp_vector)
+{
+  struct ib_device *ibdev = q->ctrl->rdev->dev;
+  struct ib_cq_init_attr cq_attr = {
+    .cqe = CQ_NUM_CQES,
+    .comp_vector = comp_vector,
+  };
+  int ret;
+
+  q->cq = ib_create_cq(ibdev, sswap_rdma_async_cq_event, NULL, q, &cq_attr);
+  if (IS_ERR(q->cq))
+    return PTR_ERR(q->cq);
+
+  /* not every device does moderation, it's only an optimization */
+  ret = ib_modify_cq(q->cq, CQ_MOD_COUNT, CQ_MOD_PERIOD);
+  if (ret)
+    pr_info_once("no cq moderation: %d\n", ret);
+
+  q->polled = false;
+  q->window_start = ktime_get_ns();
+  q->window_comps = 0;
+  hrtimer_init(&q->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  q->poll_timer.function = sswap_rdma_poll_timer;
+  irq_poll_init(&q->iop, ASYNC_POLL_BUDGET, sswap_rdma_async_poll);
+
+  ib_req_notify_cq(q->cq, IB_CQ_NEXT_COMP);
+  return 0;
+}
+
+static void sswap_rdma_free_cq(struct rdma_queue *q)
+{
+  if (q->qp_type != QP_READ_ASYNC) {
+    ib_free_cq(q->cq);
+    return;
+  }
+
+  irq_poll_disable(&q->iop);
+  WRITE_ONCE(q->polled, false);
+  hrtimer_cancel(&q->poll_timer);
+  ib_destroy_cq(q->cq);
+}
+
 static void sswap_rdma_destroy_queue_ib(struct rdma_queue *q)
 {
   struct sswap_rdma_dev *rdev;
@@ -132,27 +555,39 @@ static void sswap_rdma_destroy_queue_ib(struct rdma_queue *q)
   rdev = q->ctrl->rdev;
   ibdev = rdev->dev;
   //rdma_destroy_qp(q->ctrl->cm_id);
-  ib_free_cq(q->cq);
+  sswap_rdma_free_cq(q);
 }
 
 static int sswap_rdma_create_queue_ib(struct rdma_queue *q)
 {
   struct ib_device *ibdev = q->ctrl->rdev->dev;
   int ret;
-  int comp_vector = 0;
+  /* spread the queues over the completion vectors by the cpus of their
+   * set, so a queue's interrupts land near the cpus that use it */
+  int idx = q - q->ctrl->queues;
+  int cpu = set_first_cpu(queue_set(idx)) + idx % qps;
+  int comp_vector = cpu % ibdev->num_comp_vectors;
 
   pr_info("start: %s\n", __FUNCTION__);
 
-  if (q->qp_type == QP_READ_ASYNC)
-    q->cq = ib_alloc_cq(ibdev, q, CQ_NUM_CQES,
-      comp_vector, IB_POLL_SOFTIRQ);
-  else
-    q->cq = ib_alloc_cq(ibdev, q, CQ_NUM_CQES,
-      comp_vector, IB_POLL_DIRECT);
-
-  if (IS_ERR(q->cq)) {
-    ret = PTR_ERR(q->cq);
-    goto out_err;
+  /* writes are completion driven: pages leave writeback from the
+   * completion handler instead of being polled for by the storer */
+  if (q->qp_type == QP_READ_ASYNC) {
+    ret = sswap_rdma_create_async_cq(q, comp_vector);
+    if (ret)
+      goto out_err;
+  } else {
+    if (q->qp_type == QP_WRITE_SYNC)
+      q->cq = ib_alloc_cq(ibdev, q, CQ_NUM_CQES,
+        comp_vector, IB_POLL_SOFTIRQ);
+    else
+      q->cq = ib_alloc_cq(ibdev, q, CQ_NUM_CQES,
+        comp_vector, IB_POLL_DIRECT);
+
+    if (IS_ERR(q->cq)) {
+      ret = PTR_ERR(q->cq);
+      goto out_err;
+    }
   }
 
   ret = sswap_rdma_create_qp(q);
@@ -162,7 +597,7 @@ static int sswap_rdma_create_queue_ib(struct rdma_queue *q)
   return 0;
 
 out_destroy_ib_cq:
-  ib_free_cq(q->cq);
+  sswap_rdma_free_cq(q);
 out_err:
   return ret;
 }
@@ -191,7 +626,8 @@ static int sswap_rdma_addr_resolved(struct rdma_queue *q)
     sswap_rdma_destroy_queue_ib(q);
   }
 
-  return 0;
+  /* a failure completes cm_done now instead of after the timeout */
+  return ret;
 }
 
 static int sswap_rdma_route_resolved(struct rdma_queue *q,
@@ -219,7 +655,7 @@ static int sswap_rdma_route_resolved(struct rdma_queue *q,
     sswap_rdma_destroy_queue_ib(q);
   }
 
-  return 0;
+  return ret;
 }
 
 static int sswap_rdma_conn_established(struct rdma_queue *q)
@@ -287,7 +723,11 @@ inline static int sswap_rdma_wait_for_cm(struct rdma_queue *queue)
   return queue->cm_error;
 }
 
-static int sswap_rdma_init_queue(struct sswap_rdma_ctrl *ctrl,
+static void sswap_rdma_flush_writes(struct work_struct *work);
+
+/* sets a queue up and starts resolving the server's address. the cm
+ * handler takes it from there, sswap_rdma_finish_queue waits for it */
+static int sswap_rdma_start_queue(struct sswap_rdma_ctrl *ctrl,
     int idx)
 {
   struct rdma_queue *queue;
@@ -299,14 +739,31 @@ static int sswap_rdma_init_queue(struct sswap_rdma_ctrl *ctrl,
   queue->ctrl = ctrl;
   init_completion(&queue->cm_done);
   atomic_set(&queue->pending, 0);
+  init_waitqueue_head(&queue->credit_wait);
   spin_lock_init(&queue->cq_lock);
+  spin_lock_init(&queue->sq_lock);
   queue->qp_type = get_queue_type(idx);
 
+  /* the request ring is the only place data path requests come from, so
+   * it is sized to hold a request for every wr the qp can have posted */
+  BUILD_BUG_ON(QP_MAX_SEND_WR & (QP_MAX_SEND_WR - 1));
+  queue->head = 0;
+  queue->tail = 0;
+  queue->unsignaled = 0;
+  queue->write_failed = false;
+  INIT_DELAYED_WORK(&queue->flush_work, sswap_rdma_flush_writes);
+  queue->reqs = kvcalloc(QP_MAX_SEND_WR, sizeof(struct rdma_req), GFP_KERNEL);
+  if (!queue->reqs) {
+    pr_err("no memory for request ring\n");
+    return -ENOMEM;
+  }
+
   queue->cm_id = rdma_create_id(&init_net, sswap_rdma_cm_handler, queue,
       RDMA_PS_TCP, IB_QPT_RC);
   if (IS_ERR(queue->cm_id)) {
     pr_err("failed to create cm id: %ld\n", PTR_ERR(queue->cm_id));
-    return -ENODEV;
+    ret = -ENODEV;
+    goto out_free_reqs;
   }
 
   queue->cm_error = -ETIMEDOUT;
@@ -318,16 +775,28 @@ static int sswap_rdma_init_queue(struct sswap_rdma_ctrl *ctrl,
     goto out_destroy_cm_id;
   }
 
-  ret = sswap_rdma_wait_for_cm(queue);
-  if (ret) {
-    pr_err("sswap_rdma_wait_for_cm failed\n");
-    goto out_destroy_cm_id;
-  }
-
   return 0;
 
 out_destroy_cm_id:
   rdma_destroy_id(queue->cm_id);
+out_free_reqs:
+  kvfree(queue->reqs);
+  queue->reqs = NULL;
+  return ret;
+}
+
+static int sswap_rdma_finish_queue(struct rdma_queue *queue)
+{
+  int ret = sswap_rdma_wait_for_cm(queue);
+
+  if (ret) {
+    pr_err("sswap_rdma_wait_for_cm failed for queue %td: %d\n",
+           queue - queue->ctrl->queues, ret);
+    rdma_destroy_id(queue->cm_id);
+    kvfree(queue->reqs);
+    queue->reqs = NULL;
+  }
+
   return ret;
 }
 
@@ -338,26 +807,46 @@ static void sswap_rdma_stop_queue(struct rdma_queue *q)
 
 static void sswap_rdma_free_queue(struct rdma_queue *q)
 {
+  cancel_delayed_work_sync(&q->flush_work);
   rdma_destroy_qp(q->cm_id);
-  ib_free_cq(q->cq);
+  sswap_rdma_free_cq(q);
   rdma_destroy_id(q->cm_id);
+  kvfree(q->reqs);
+  q->reqs = NULL;
 }
 
+/* queues connect conn_window at a time instead of one by one, so loading
+ * takes a few round trips to the server rather than one per queue */
 static int sswap_rdma_init_queues(struct sswap_rdma_ctrl *ctrl)
 {
-  int ret, i;
-  for (i = 0; i < numqueues; ++i) {
-    ret = sswap_rdma_init_queue(ctrl, i);
-    if (ret) {
-      pr_err("failed to initialized queue: %d\n", i);
-      goto out_free_queues;
+  int ret = 0, err, i, started = 0, done = 0;
+  int window = max(conn_window, 1);
+
+  while (done < started || (!ret && started < numqueues)) {
+    if (!ret && started < numqueues && started - done < window) {
+      ret = sswap_rdma_start_queue(ctrl, started);
+      if (ret)
+        pr_err("failed to initialized queue: %d\n", started);
+      else
+        started++;
+      continue;
+    }
+
+    /* queues are set up in order, so the oldest is the one to wait for */
+    err = sswap_rdma_finish_queue(&ctrl->queues[done++]);
+    if (err && !ret) {
+      pr_err("failed to initialized queue: %d\n", done - 1);
+      ret = err;
     }
   }
 
-  return 0;
+  if (!ret)
+    return 0;
 
-out_free_queues:
-  for (i--; i >= 0; i--) {
+  /* every started queue is done by now, the failed ones freed themselves */
+  for (i = 0; i < started; i++) {
+    if (!ctrl->queues[i].reqs)
+      continue;
     sswap_rdma_stop_queue(&ctrl->queues[i]);
     sswap_rdma_free_queue(&ctrl->queues[i]);
   }
@@ -389,11 +878,12 @@ static int sswap_rdma_parse_ipaddr(struct sockaddr_in *saddr, char *ip)
   return 0;
 }
 
-static int sswap_rdma_create_ctrl(struct sswap_rdma_ctrl **c)
+static int sswap_rdma_create_ctrl(struct sswap_rdma_ctrl **c, char *ip,
+                                  int port)
 {
   int ret;
   struct sswap_rdma_ctrl *ctrl;
-  pr_info("will try to connect to %s:%d\n", serverip, serverport);
+  pr_info("will try to connect to %s:%d\n", ip, port);
 
   *c = kzalloc(sizeof(struct sswap_rdma_ctrl), GFP_KERNEL);
   if (!*c) {
@@ -403,12 +893,12 @@ static int sswap_rdma_create_ctrl(struct sswap_rdma_ctrl **c)
   ctrl = *c;
 
   ctrl->queues = kzalloc(sizeof(struct rdma_queue) * numqueues, GFP_KERNEL);
-  ret = sswap_rdma_parse_ipaddr(&(ctrl->addr_in), serverip);
+  ret = sswap_rdma_parse_ipaddr(&(ctrl->addr_in), ip);
   if (ret) {
     pr_err("sswap_rdma_parse_ipaddr failed: %d\n", ret);
     return -EINVAL;
   }
-  ctrl->addr_in.sin_port = cpu_to_be16(serverport);
+  ctrl->addr_in.sin_port = cpu_to_be16(port);
 
   ret = sswap_rdma_parse_ipaddr(&(ctrl->srcaddr_in), clientip);
   if (ret) {
@@ -420,17 +910,178 @@ static int sswap_rdma_create_ctrl(struct sswap_rdma_ctrl **c)
   return sswap_rdma_init_queues(ctrl);
 }
 
+static void sswap_rdma_destroy_ctrls(void)
+{
+  int i;
+
+  for (i = 0; i < nservers; i++) {
+    sswap_rdma_stopandfree_queues(gctrls[i]);
+    kfree(gctrls[i]->queues);
+    kfree(gctrls[i]);
+    gctrls[i] = NULL;
+  }
+  nservers = 0;
+}
+
+static void sswap_ec_destroy(void);
+static void sswap_cz_destroy(void);
+static void sswap_dedup_destroy(void);
+static void sswap_compact_destroy(void);
+static void rpage_leaves_free(void);
+static struct work_struct write_undo_work;
+
 static void __exit sswap_rdma_cleanup_module(void)
 {
-  sswap_rdma_stopandfree_queues(gctrl);
+  sswap_compact_destroy();
+  sswap_rdma_destroy_ctrls();
+  flush_work(&write_undo_work);
   ib_unregister_client(&sswap_rdma_ib_client);
-  kfree(gctrl);
-  gctrl = NULL;
-  if (req_cache) {
-    kmem_cache_destroy(req_cache);
-  }
+  sswap_ec_destroy();
+  sswap_cz_destroy();
+  sswap_dedup_destroy();
 
   del_timer(&swap_pages_timer);
+  rpage_leaves_free();
+}
+
+/* maps len bytes at off of page. erasure coded fragments map only their
+ * part of the page, so that unmapping one doesn't clobber another */
+static inline u64 sswap_rdma_map_page(struct rdma_queue *q, struct page *page,
+  unsigned int off, unsigned int len, enum dma_data_direction dir)
+{
+  struct ib_device *dev = q->ctrl->rdev->dev;
+  u64 dma;
+
+  if (q->ctrl->rdev->identity_dma)
+    return page_to_phys(page) + off;
+
+  dma = ib_dma_map_page(dev, page, off, len, dir);
+  if (unlikely(ib_dma_mapping_error(dev, dma)))
+    return 0;
+
+  ib_dma_sync_single_for_device(dev, dma, len, dir);
+  return dma;
+}
+
+static inline void sswap_rdma_unmap_page(struct rdma_queue *q, u64 dma,
+  unsigned int len, enum dma_data_direction dir)
+{
+  if (!q->ctrl->rdev->identity_dma)
+    ib_dma_unmap_page(q->ctrl->rdev->dev, dma, len, dir);
+}
+
+/* the qp completes in posting order, so a completion for req also means
+ * that every older request in the ring is done, signaled or not. retire
+ * all of them and hand their credits back. */
+static void sswap_rdma_ring_retire(struct rdma_queue *q, struct rdma_req *req,
+  void (*fn)(struct rdma_queue *, struct rdma_req *))
+{
+  struct rdma_req *pos;
+  int n = 0;
+
+  do {
+    pos = &q->reqs[q->tail & (QP_MAX_SEND_WR - 1)];
+    q->tail++;
+    fn(q, pos);
+    n++;
+  } while (pos != req);
+
+  /* slots must be done with before the credits let them be reused */
+  smp_mb__before_atomic();
+  atomic_sub(n, &q->pending);
+  if (wq_has_sleeper(&q->credit_wait))
+    wake_up(&q->credit_wait);
+}
+
+static void ec_frag_done(struct ec_io *io);
+static void compact_io_done(struct compact_batch *b);
+
+/* the qp of a failed wr is in error from now on. keep erasure coded io away
+ * from its server, and have the fragment's page rebuilt from the others */
+static void sswap_rdma_req_failed(struct rdma_queue *q, struct rdma_req *req)
+{
+  if (!test_and_set_bit(q->ctrl->id, servers_down))
+    pr_err("server %d is down\n", q->ctrl->id);
+  if (req->ec && ec_k)
+    req->ec->failed = true;
+  else if (req->move)
+    req->move->failed = true;
+}
+
+/* pages that are not in the swap cache are private copies, which the
+ * compressed cache of fastswap.c writes back. it is told when their write
+ * is over, from the write completion */
+static void (*write_end)(struct page *page, bool ok);
+
+void sswap_rdma_set_write_end(void (*fn)(struct page *page, bool ok))
+{
+  write_end = fn;
+}
+EXPORT_SYMBOL(sswap_rdma_set_write_end);
+
+/* ends the writeback of page, whose contents are remote now if ok */
+static void sswap_rdma_end_write(struct page *page, bool ok)
+{
+  /* a swap cache page may be gone once its writeback is over */
+  bool private = !PageSwapCache(page);
+
+  end_page_writeback(page);
+  if (private && write_end)
+    write_end(page, ok);
+}
+
+static void sswap_rdma_write_undo(u64 roffset);
+
+/* a write that didn't make it: keep its offset out of the map, and have
+ * reclaim keep the page and write it again, which goes to disk once the
+ * server is marked down */
+static void sswap_rdma_write_failed(struct rdma_req *req)
+{
+  struct page *page = req->page;
+
+  sswap_rdma_write_undo(req->roffset);
+  SetPageError(page);
+  set_page_dirty(page);
+  ClearPageReclaim(page);
+  pr_alert_ratelimited("write of offset %llu failed\n", req->roffset);
+  sswap_rdma_end_write(page, false);
+}
+
+static void sswap_rdma_write_complete(struct rdma_queue *q, struct rdma_req *req)
+{
+  unsigned long *entry;
+
+  if (unlikely(q->write_failed))
+    sswap_rdma_req_failed(q, req);
+
+  /* a flush marker, see sswap_rdma_flush_writes */
+  if (!req->page)
+    return;
+
+  sswap_rdma_unmap_page(q, req->dma, req->len, DMA_TO_DEVICE);
+  if (req->bounce)
+    mempool_free(req->bounce, cz_page_pool);
+  if (req->ec && ec_k) {
+    ec_frag_done(req->ec);
+    return;
+  }
+  if (req->move) {
+    compact_io_done(req->move);
+    return;
+  }
+  if (unlikely(q->write_failed)) {
+    sswap_rdma_write_failed(req);
+    return;
+  }
+
+  /* the data is remote now: let reads of this offset, and of the ones
+   * that will share its remote page, through and hand the page back to
+   * reclaim */
+  if (req->dedup)
+    smp_store_release(&req->dedup->ready, true);
+  entry = (unsigned long *)rpage_entry_ptr(req->roffset);
+  clear_bit_unlock(RPAGE_WRITEBACK_BIT, entry);
+  sswap_rdma_end_write(req->page, true);
 }
 
 static void sswap_rdma_write_done(struct ib_cq *cq, struct ib_wc *wc)
@@ -438,79 +1089,142 @@ static void sswap_rdma_write_done(struct ib_cq *cq, struct ib_wc *wc)
   struct rdma_req *req =
     container_of(wc->wr_cqe, struct rdma_req, cqe);
   struct rdma_queue *q = cq->cq_context;
-  struct ib_device *ibdev = q->ctrl->rdev->dev;
 
   if (unlikely(wc->status != IB_WC_SUCCESS)) {
     pr_err("sswap_rdma_write_done status is not success, it is=%d\n", wc->status);
-    //q->write_error = wc->status;
+    /* the unsignaled writes before req made it, req and the ones after
+     * it didn't */
+    if (!q->write_failed && &q->reqs[q->tail & (QP_MAX_SEND_WR - 1)] != req)
+      sswap_rdma_ring_retire(q,
+        &q->reqs[(req - q->reqs - 1) & (QP_MAX_SEND_WR - 1)],
+        sswap_rdma_write_complete);
+    q->write_failed = true;
+  }
+
+  sswap_rdma_ring_retire(q, req, sswap_rdma_write_complete);
+}
+
+static void sswap_rdma_read_complete(struct rdma_queue *q, struct rdma_req *req)
+{
+  int ret;
+
+  sswap_rdma_unmap_page(q, req->dma, req->len, DMA_FROM_DEVICE);
+  if (req->ec && ec_k) {
+    ec_frag_done(req->ec);
+    return;
+  }
+  if (req->move) {
+    compact_io_done(req->move);
+    return;
+  }
+
+  /* the remote page is no longer read, the compactor may free it */
+  compact_read_unlock(req->srcu_idx);
+
+  if (req->bounce) {
+    ret = LZ4_decompress_safe(page_address(req->bounce),
+                              page_address(req->page), req->len, PAGE_SIZE);
+    mempool_free(req->bounce, cz_page_pool);
+    if (unlikely(ret != PAGE_SIZE)) {
+      pr_err_ratelimited("bad compressed page: %d\n", ret);
+      SetPageError(req->page);
+      unlock_page(req->page);
+      return;
+    }
   }
-  ib_dma_unmap_page(ibdev, req->dma, PAGE_SIZE, DMA_TO_DEVICE);
 
-  atomic_dec(&q->pending);
-  kmem_cache_free(req_cache, req);
+  SetPageUptodate(req->page);
+  unlock_page(req->page);
 }
 
+/* only the last wr of a read chain is signaled, its completion retires the
+ * whole chain. the other wrs of a chain only complete on error. */
 static void sswap_rdma_read_done(struct ib_cq *cq, struct ib_wc *wc)
 {
   struct rdma_req *req =
     container_of(wc->wr_cqe, struct rdma_req, cqe);
   struct rdma_queue *q = cq->cq_context;
-  struct ib_device *ibdev = q->ctrl->rdev->dev;
 
-  if (unlikely(wc->status != IB_WC_SUCCESS))
+  if (unlikely(wc->status != IB_WC_SUCCESS)) {
     pr_err("sswap_rdma_read_done status is not success, it is=%d\n", wc->status);
+    sswap_rdma_req_failed(q, req);
+  }
 
-  ib_dma_unmap_page(ibdev, req->dma, PAGE_SIZE, DMA_FROM_DEVICE);
-
-  SetPageUptodate(req->page);
-  unlock_page(req->page);
-  complete(&req->done);
-  atomic_dec(&q->pending);
-  kmem_cache_free(req_cache, req);
+  sswap_rdma_ring_retire(q, req, sswap_rdma_read_complete);
 }
 
-inline static int sswap_rdma_post_rdma(struct rdma_queue *q, struct rdma_req *qe,
-  struct ib_sge *sge, u64 raddr, /*u32 rkey,*/enum ib_wr_opcode op)
+/* fills in scratch wr i of q, with scratch sge s, for the transfer of the
+ * part of a page that qe has mapped. caller holds q->sq_lock */
+inline static int __sswap_rdma_prep_rdma(struct rdma_queue *q, int i, int s,
+  struct rdma_req *qe, u64 raddr, enum ib_wr_opcode op)
 {
-  const struct ib_send_wr *bad_wr;
-  struct ib_rdma_wr rdma_wr = {};
-  int ret;
-  //struct block_info *bi = NULL; 
-  u64 raddr_block = raddr >> BLOCK_SHIFT;
-  raddr_block = raddr_block << BLOCK_SHIFT;  
+  struct ib_rdma_wr *wr = &q->wrs[i];
+  struct ib_sge *sge = &q->sges[s];
+  struct block_info *bi = raddr_to_block(raddr);
 
   BUG_ON(qe->dma == 0);
   BUG_ON(raddr == 0);
-  BUG_ON((raddr & ((1 << PAGE_SHIFT) - 1)) != 0);
+  BUG_ON(raddr & RPAGE_FLAGS_MASK);
+  /* a transfer stays within one remote page */
+  BUG_ON((raddr & ~PAGE_MASK) + qe->len > PAGE_SIZE);
 
   sge->addr = qe->dma;
-  sge->length = PAGE_SIZE;
+  sge->length = qe->len;
   sge->lkey = q->ctrl->rdev->pd->local_dma_lkey;
 
-  /* TODO: add a chain of WR, we already have a list so should be easy
-   * to just post requests in batches */
-  rdma_wr.wr.next    = NULL;
-  rdma_wr.wr.wr_cqe  = &qe->cqe;
-  rdma_wr.wr.sg_list = sge;
-  rdma_wr.wr.num_sge = 1;
-  rdma_wr.wr.opcode  = op;
-  rdma_wr.wr.send_flags = IB_SEND_SIGNALED;
-  rdma_wr.remote_addr = /*q->ctrl->servermr.baseaddr +*/ raddr;
-
-  //bi = rhashtable_lookup_fast(blocks_map, &raddr_, blocks_map_params);
-  //if(!bi || bi->rkey == 0) {
-    //pr_err("cannot get rkey\n");
-    //return -1;
-  //}
-  rdma_wr.rkey = get_rkey(raddr_block);
-  //rdma_wr.rkey = rkey;
-  if(rdma_wr.rkey == 0) {
+  memset(wr, 0, sizeof(*wr));
+  wr->wr.wr_cqe  = &qe->cqe;
+  wr->wr.sg_list = sge;
+  wr->wr.num_sge = 1;
+  wr->wr.opcode  = op;
+  wr->wr.send_flags = IB_SEND_SIGNALED;
+  if (unlikely(!bi)) {
     pr_err("remote address(%p) is invalid.\n", (void*)raddr);
     return -1;
   }
+  wr->remote_addr = bi->remote + (raddr & (rblock_size - 1));
+  wr->rkey = bi->rkey;
+
+  return 0;
+}
+
+inline static int sswap_rdma_prep_rdma(struct rdma_queue *q, int i,
+  struct rdma_req *qe, u64 raddr, enum ib_wr_opcode op)
+{
+  return __sswap_rdma_prep_rdma(q, i, i, qe, raddr, op);
+}
+
+/* adds the page qe has mapped to scratch wr i of q as the next sge, the
+ * wr then reads it from right after the pages it already reads. its
+ * completion stands for qe from now on, which is the newest req in the
+ * ring of all the wr reads */
+inline static void sswap_rdma_add_sge(struct rdma_queue *q, int i, int s,
+  struct rdma_req *qe)
+{
+  struct ib_rdma_wr *wr = &q->wrs[i];
+  struct ib_sge *sge = &q->sges[s];
+
+  BUG_ON(sge != wr->wr.sg_list + wr->wr.num_sge);
+
+  sge->addr = qe->dma;
+  sge->length = qe->len;
+  sge->lkey = q->ctrl->rdev->pd->local_dma_lkey;
+  wr->wr.num_sge++;
+  wr->wr.wr_cqe = &qe->cqe;
+}
+
+/* posts the first n scratch wrs of q as one chain, ringing the doorbell
+ * once. caller holds q->sq_lock and the credits for them */
+inline static int sswap_rdma_post_chain(struct rdma_queue *q, int n)
+{
+  const struct ib_send_wr *bad_wr;
+  int i, ret;
+
+  for (i = 0; i + 1 < n; i++)
+    q->wrs[i].wr.next = &q->wrs[i + 1].wr;
+  q->wrs[n - 1].wr.next = NULL;
 
-  atomic_inc(&q->pending);
-  ret = ib_post_send(q->qp, &rdma_wr.wr, &bad_wr);
+  ret = ib_post_send(q->qp, &q->wrs[0].wr, &bad_wr);
   if (unlikely(ret)) {
     pr_err("ib_post_send failed: %d\n", ret);
   }
@@ -518,6 +1232,18 @@ inline static int sswap_rdma_post_rdma(struct rdma_queue *q, struct rdma_req *qe
   return ret;
 }
 
+inline static int sswap_rdma_post_rdma(struct rdma_queue *q, struct rdma_req *qe,
+  u64 raddr, enum ib_wr_opcode op)
+{
+  int ret;
+
+  ret = sswap_rdma_prep_rdma(q, 0, qe, raddr, op);
+  if (unlikely(ret))
+    return ret;
+
+  return sswap_rdma_post_chain(q, 1);
+}
+
 /*
 static void sswap_rdma_recv_remotemr_done(struct ib_cq *cq, struct ib_wc *wc)
 {
@@ -565,77 +1291,72 @@ static int sswap_rdma_post_recv(struct rdma_queue *q, struct rdma_req *qe,
 }
 */
 
-/* allocates a sswap rdma request, creates a dma mapping for it in
- * req->dma, and synchronizes the dma mapping in the direction of
- * the dma map.
+/* hands out the next slot of the queue's request ring and creates a dma
+ * mapping for it in req->dma, synchronized in the direction of the dma map
+ * (or just takes the physical address of the page with physaddr).
+ * The caller holds q->sq_lock and a credit for the slot: slots come back in
+ * posting order, so with a credit in hand the next slot is always free.
  * Don't touch the page with cpu after creating the request for it!
- * Deallocates the request if there was an error */
-inline static int get_req_for_page(struct rdma_req **req, struct ib_device *dev,
-				struct page *page, enum dma_data_direction dir)
+ * Gives the slot back if there was an error */
+inline static int get_req_for_range(struct rdma_queue *q, struct rdma_req **req,
+				struct page *page, unsigned int off, unsigned int len,
+				enum dma_data_direction dir)
 {
-  int ret;
-
-  ret = 0;
-  *req = kmem_cache_alloc(req_cache, GFP_ATOMIC);
-  if (unlikely(!req)) {
-    pr_err("no memory for req\n");
-    ret = -ENOMEM;
-    goto out;
-  }
+  *req = &q->reqs[q->head & (QP_MAX_SEND_WR - 1)];
+  q->head++;
 
   (*req)->page = page;
-  init_completion(&(*req)->done);
+  (*req)->ec = NULL; /* and move, they share the field */
+  (*req)->bounce = NULL;
+  (*req)->dedup = NULL;
+  (*req)->len = len;
 
-  (*req)->dma = ib_dma_map_page(dev, page, 0, PAGE_SIZE, dir);
-  if (unlikely(ib_dma_mapping_error(dev, (*req)->dma))) {
+  (*req)->dma = sswap_rdma_map_page(q, page, off, len, dir);
+  if (unlikely(!(*req)->dma)) {
     pr_err("ib_dma_mapping_error\n");
-    ret = -ENOMEM;
-    kmem_cache_free(req_cache, req);
-    goto out;
+    q->head--;
+    return -ENOMEM;
   }
 
-  ib_dma_sync_single_for_device(dev, (*req)->dma, PAGE_SIZE, dir);
-out:
-  return ret;
+  return 0;
 }
 
-/* the buffer needs to come from kernel (not high memory) */
-inline static int get_req_for_buf(struct rdma_req **req, struct ib_device *dev,
-				void *buf, size_t size,
-				enum dma_data_direction dir)
+inline static int get_req_for_page(struct rdma_queue *q, struct rdma_req **req,
+				struct page *page, enum dma_data_direction dir)
 {
-  int ret;
+  return get_req_for_range(q, req, page, 0, PAGE_SIZE, dir);
+}
 
-  ret = 0;
-  *req = kmem_cache_alloc(req_cache, GFP_ATOMIC);
-  if (unlikely(!req)) {
-    pr_err("no memory for req\n");
-    ret = -ENOMEM;
-    goto out;
-  }
+/* like get_req_for_page, but for a page stored compressed (bounce isn't
+ * NULL) the dma goes to the first len bytes of bounce instead */
+inline static int get_req_for_bounce(struct rdma_queue *q,
+  struct rdma_req **req, struct page *page, struct page *bounce,
+  unsigned int len, enum dma_data_direction dir)
+{
+  int ret;
 
-  init_completion(&(*req)->done);
+  if (!bounce)
+    return get_req_for_page(q, req, page, dir);
 
-  (*req)->dma = ib_dma_map_single(dev, buf, size, dir);
-  if (unlikely(ib_dma_mapping_error(dev, (*req)->dma))) {
-    pr_err("ib_dma_mapping_error\n");
-    ret = -ENOMEM;
-    kmem_cache_free(req_cache, req);
-    goto out;
+  ret = get_req_for_range(q, req, bounce, 0, len, dir);
+  if (likely(!ret)) {
+    (*req)->page = page;
+    (*req)->bounce = bounce;
   }
-
-  ib_dma_sync_single_for_device(dev, (*req)->dma, size, dir);
-out:
   return ret;
 }
 
-inline static void sswap_rdma_wait_completion(struct ib_cq *cq,
-					      struct rdma_req *qe)
+/* gives back the last n slots handed out, for wrs that were never posted.
+ * caller holds q->sq_lock */
+inline static void put_reqs(struct rdma_queue *q, int n,
+  enum dma_data_direction dir)
 {
-  ndelay(1000);
-  while (!completion_done(&qe->done)) {
-    ndelay(250);
-    ib_process_cq_direct(cq, 1);
+  struct rdma_req *req;
+
+  while (n--) {
+    q->head--;
+    req = &q->reqs[q->head & (QP_MAX_SEND_WR - 1)];
+    sswap_rdma_unmap_page(q, req->dma, req->len, dir);
   }
 }
 
@@ -669,80 +1390,1359 @@ static inline int drain_queue(struct rdma_queue *q)
   return 1;
 }
 
-static inline int write_queue_add(struct rdma_queue *q, struct page *page,
-				  u64 roffset/*, u32 rkey*/)
+/* credit based flow control: every posted wr holds one of the
+ * QP_MAX_SEND_WR credits of its queue, and with it a slot of the request
+ * ring, until its completion hands it back. */
+static inline bool try_get_credits(struct rdma_queue *q, int n)
 {
-  struct rdma_req *req;
-  struct ib_device *dev = q->ctrl->rdev->dev;
-  struct ib_sge sge = {};
-  int ret, inflight;
-
-  while ((inflight = atomic_read(&q->pending)) >= QP_MAX_SEND_WR - 8) {
-    BUG_ON(inflight > QP_MAX_SEND_WR);
-    poll_target(q, 2048);
+  int inflight;
+
+  for (;;) {
+    inflight = atomic_read(&q->pending);
+    if (inflight + n > QP_MAX_SEND_WR)
+      return false;
+    if (atomic_cmpxchg(&q->pending, inflight, inflight + n) == inflight)
+      return true;
+  }
+}
+
+/* writers run from reclaim and can sleep, so without credits they wait
+ * for the write completions instead of polling. with selective signaling
+ * credits come back in bursts of up to WRITE_SIGNAL_INTERVAL, and the
+ * flush work makes sure an idle tail still gives its credits back */
+static inline void get_write_credits(struct rdma_queue *q, int n)
+{
+  while (!try_get_credits(q, n)) {
     pr_info_ratelimited("back pressure writes");
+    wait_event(q->credit_wait,
+               atomic_read(&q->pending) + n <= QP_MAX_SEND_WR);
+  }
+}
+
+static inline void put_credits(struct rdma_queue *q, int n)
+{
+  atomic_sub(n, &q->pending);
+  if (wq_has_sleeper(&q->credit_wait))
+    wake_up(&q->credit_wait);
+}
+
+/* back pressure in-flight reads, can't send more than QP_MAX_SEND_WR at
+ * a time */
+static inline void get_read_credits(struct rdma_queue *q, int n)
+{
+  while (!try_get_credits(q, n)) {
+    if (q->qp_type == QP_READ_ASYNC)
+      sswap_rdma_poll_async(q, 8);
+    else
+      poll_target(q, 8);
+    pr_info_ratelimited("back pressure happened on reads");
+  }
+}
+
+static inline int write_queue_add(struct rdma_queue *q, struct page *page,
+				  u64 roffset, u64 raddr, struct page *bounce,
+				  u32 len, struct dedup_entry *dd)
+{
+  struct rdma_req *req;
+  u32 unsignaled;
+  int ret;
+
+  get_write_credits(q, 1);
+
+  spin_lock(&q->sq_lock);
+  ret = get_req_for_bounce(q, &req, page, bounce, len, DMA_TO_DEVICE);
+  if (unlikely(ret))
+    goto out_unlock;
+
+  req->roffset = roffset;
+  req->dedup = dd;
+  req->cqe.done = sswap_rdma_write_done;
+  ret = sswap_rdma_prep_rdma(q, 0, req, raddr, IB_WR_RDMA_WRITE);
+  if (unlikely(ret)) {
+    put_reqs(q, 1, DMA_TO_DEVICE);
+    goto out_unlock;
+  }
+
+  /* selective signaling: only every WRITE_SIGNAL_INTERVAL-th write makes
+   * a cqe, which retires the writes before it in one go */
+  unsignaled = q->unsignaled;
+  if (++q->unsignaled < WRITE_SIGNAL_INTERVAL) {
+    q->wrs[0].wr.send_flags = 0;
+    if (q->unsignaled == 1)
+      queue_delayed_work(system_unbound_wq, &q->flush_work,
+                         WRITE_FLUSH_DELAY);
+  } else {
+    q->unsignaled = 0;
+  }
+
+  ret = sswap_rdma_post_chain(q, 1);
+  if (unlikely(ret)) {
+    put_reqs(q, 1, DMA_TO_DEVICE);
+    q->unsignaled = unsignaled;
+  }
+
+out_unlock:
+  spin_unlock(&q->sq_lock);
+  if (unlikely(ret))
+    put_credits(q, 1);
+  return ret;
+}
+
+/* unsignaled writes at the tail of a queue only retire once a signaled wr
+ * follows them. post a signaled zero length write after them so their
+ * pages leave writeback. returns 0 if the tail is signaled now, or had
+ * nothing to signal */
+static int sswap_rdma_flush_queue(struct rdma_queue *q)
+{
+  struct rdma_req *req;
+  int ret = 0;
+
+  /* a full ring has signaled writes in flight, they retire the tail */
+  if (!try_get_credits(q, 1))
+    return -EBUSY;
+
+  spin_lock(&q->sq_lock);
+  if (!q->unsignaled) {
+    ret = -EAGAIN;
+    goto out_unlock;
+  }
+
+  req = &q->reqs[q->head & (QP_MAX_SEND_WR - 1)];
+  q->head++;
+  req->page = NULL;
+  req->ec = NULL;
+  req->dma = 0;
+  req->cqe.done = sswap_rdma_write_done;
+
+  memset(&q->wrs[0], 0, sizeof(q->wrs[0]));
+  q->wrs[0].wr.wr_cqe = &req->cqe;
+  q->wrs[0].wr.num_sge = 0;
+  q->wrs[0].wr.opcode = IB_WR_RDMA_WRITE;
+  q->wrs[0].wr.send_flags = IB_SEND_SIGNALED;
+
+  ret = sswap_rdma_post_chain(q, 1);
+  if (unlikely(ret))
+    q->head--;
+  else
+    q->unsignaled = 0;
+
+out_unlock:
+  spin_unlock(&q->sq_lock);
+  if (ret)
+    put_credits(q, 1);
+  return ret == -EAGAIN ? 0 : ret;
+}
+
+/* the tail of a queue that went idle */
+static void sswap_rdma_flush_writes(struct work_struct *work)
+{
+  struct rdma_queue *q =
+    container_of(to_delayed_work(work), struct rdma_queue, flush_work);
+
+  if (sswap_rdma_flush_queue(q))
+    queue_delayed_work(system_unbound_wq, &q->flush_work, WRITE_FLUSH_DELAY);
+}
+
+/* signals the tails of the write queues a write of entry may sit on, so
+ * that whoever waits for it doesn't wait for the flush work. the write
+ * went to the entry's server, or to several with erasure coding */
+static void sswap_rdma_kick_writes(u64 entry)
+{
+  int s, i;
+
+  for (s = 0; s < nservers; s++) {
+    if (!ec_k && s != raddr_server(entry))
+      continue;
+    for (i = 0; i < queues_per_type; i++)
+      sswap_rdma_flush_queue(
+        &gctrls[s]->queues[QP_WRITE_SYNC * queues_per_type + i]);
+  }
+}
+
+/* the read holds compact_srcu at srcu_idx until it completes, the caller
+ * still does if it fails */
+static inline int begin_read(struct rdma_queue *q, struct page *page,
+			     u64 roffset/*, u32 rkey*/, struct page *bounce,
+			     u32 len, int srcu_idx)
+{
+  struct rdma_req *req;
+  int ret;
+
+  get_read_credits(q, 1);
+
+  spin_lock(&q->sq_lock);
+  ret = get_req_for_bounce(q, &req, page, bounce, len, DMA_FROM_DEVICE);
+  if (unlikely(ret))
+    goto out_unlock;
+
+  req->cqe.done = sswap_rdma_read_done;
+  req->srcu_idx = srcu_idx;
+  ret = sswap_rdma_post_rdma(q, req, roffset, IB_WR_RDMA_READ);
+  if (unlikely(ret))
+    put_reqs(q, 1, DMA_FROM_DEVICE);
+
+out_unlock:
+  spin_unlock(&q->sq_lock);
+  if (unlikely(ret))
+    put_credits(q, 1);
+  return ret;
+}
+
+/* whether the read of page i can join the wr of page i - 1: both are
+ * whole pages and i is the remote page right after i - 1, in the same
+ * block */
+static inline bool read_contiguous(u64 *raddrs, struct page **bounces,
+                                   int i)
+{
+  return !bounces[i] && !bounces[i - 1] &&
+         raddrs[i] == raddrs[i - 1] + PAGE_SIZE &&
+         (raddrs[i] >> BLOCK_SHIFT) == (raddrs[i - 1] >> BLOCK_SHIFT);
+}
+
+/* posts reads for up to RDMA_MAX_CHAIN pages as one chain of wrs, so the
+ * whole cluster costs a single doorbell and a single completion. runs of
+ * remotely contiguous pages are read by a single wr that scatters them
+ * with one sge per page. returns the number of pages posted, the reads of
+ * which hold compact_srcu at srcu_idxs like begin_read's */
+static inline int begin_read_chain(struct rdma_queue *q, struct page **pages,
+                                   u64 *raddrs, struct page **bounces,
+                                   u32 *lens, int *srcu_idxs, int n)
+{
+  struct rdma_req *req;
+  int i, w = 0, ret;
+
+  BUG_ON(n > RDMA_MAX_CHAIN);
+
+  get_read_credits(q, n);
+
+  spin_lock(&q->sq_lock);
+  for (i = 0; i < n; i++) {
+    ret = get_req_for_bounce(q, &req, pages[i], bounces[i], lens[i],
+                             DMA_FROM_DEVICE);
+    if (unlikely(ret))
+      break;
+
+    req->cqe.done = sswap_rdma_read_done;
+    req->srcu_idx = srcu_idxs[i];
+    if (w && read_contiguous(raddrs, bounces, i) &&
+        q->wrs[w - 1].wr.num_sge < q->max_sge) {
+      sswap_rdma_add_sge(q, w - 1, i, req);
+      continue;
+    }
+    ret = __sswap_rdma_prep_rdma(q, w, i, req, raddrs[i], IB_WR_RDMA_READ);
+    if (unlikely(ret)) {
+      put_reqs(q, 1, DMA_FROM_DEVICE);
+      break;
+    }
+    q->wrs[w++].wr.send_flags = 0;
+  }
+
+  if (w) {
+    /* the tail is the only signaled wr and retires the whole chain */
+    q->wrs[w - 1].wr.send_flags = IB_SEND_SIGNALED;
+    ret = sswap_rdma_post_chain(q, w);
+    if (unlikely(ret)) {
+      put_reqs(q, i, DMA_FROM_DEVICE);
+      i = 0;
+    }
+  }
+  spin_unlock(&q->sq_lock);
+
+  if (i < n)
+    put_credits(q, n - i);
+
+  return i;
+}
+
+/* makes sure the leaf of the offset map that holds roffset's entry is
+ * there, for a store. false if it can't be allocated */
+static bool rpage_leaf_get(u64 roffset)
+{
+  u64 **dir = &offset_map[roffset >> RPAGE_LEAF_SHIFT];
+  u16 **cdir = &clen_map[roffset >> RPAGE_LEAF_SHIFT];
+  u16 *cleaf;
+  u64 *leaf;
+
+  if (likely(READ_ONCE(*dir)))
+    return true;
+
+  /* the lengths leaf goes in first, an offset with a leaf has both */
+  if (compress && !READ_ONCE(*cdir)) {
+    cleaf = kzalloc(RPAGE_CLEN_LEAF_SIZE, GFP_NOIO | __GFP_NOWARN);
+    if (!cleaf) {
+      pr_err_ratelimited("no memory for the offset map\n");
+      return false;
+    }
+    if (cmpxchg(cdir, NULL, cleaf))
+      kfree(cleaf);
+    else
+      atomic_inc(&num_clen_leaves);
+  }
+
+  leaf = (u64 *)get_zeroed_page(GFP_NOIO | __GFP_NOWARN);
+  if (!leaf) {
+    pr_err_ratelimited("no memory for the offset map\n");
+    return false;
+  }
+  /* someone else brought it in first */
+  if (cmpxchg(dir, NULL, leaf))
+    free_page((unsigned long)leaf);
+  else
+    atomic_inc(&num_map_leaves);
+  return true;
+}
+
+static void rpage_leaves_free(void)
+{
+  unsigned long i;
+
+  for (i = 0; i < RPAGE_NUM_LEAVES; i++) {
+    free_page((unsigned long)offset_map[i]);
+    offset_map[i] = NULL;
+    kfree(clen_map[i]);
+    clen_map[i] = NULL;
+  }
+}
+
+/* reads and writes of an offset go through different qps, so nothing
+ * orders them on the wire. a read of an offset whose write is still in
+ * flight waits here until the write completion clears the flag. the
+ * write may be unsignaled, so its queue is signaled first */
+static inline void sswap_rdma_wait_write(u64 roffset)
+{
+  unsigned long *entry = (unsigned long *)rpage_entry_ptr(roffset);
+
+  if (unlikely(test_bit(RPAGE_WRITEBACK_BIT, entry))) {
+    sswap_rdma_kick_writes(READ_ONCE(*entry));
+    while (test_bit(RPAGE_WRITEBACK_BIT, entry))
+      cpu_relax();
+  }
+  smp_rmb();
+}
+
+/* sets the writeback flag of roffset and returns the remote page the
+ * entry points to. a write that reuses the remote page of an offset goes
+ * to this one, the page may have moved since the entry was first read. a
+ * move of the page still going on is aborted, see compact_flush */
+static inline u64 sswap_rdma_begin_write(u64 roffset)
+{
+  u64 *p = rpage_entry_ptr(roffset);
+  u64 entry, new;
+
+  do {
+    entry = READ_ONCE(*p);
+    new = (entry & ~(1UL << RPAGE_MOVING_BIT)) | (1UL << RPAGE_WRITEBACK_BIT);
+  } while (cmpxchg(p, entry, new) != entry);
+  return rpage_addr(entry);
+}
+
+/* picks the server a newly swapped out page goes to. rr and weighted go
+ * by allocation order, hash by swap offset. all of them keep stripe pages
+ * in a row on one server, so readahead chains stay on one qp */
+static u32 sswap_rdma_place(u64 roffset)
+{
+  unsigned int n;
+  u32 w, i;
+
+  if (nservers == 1)
+    return 0;
+
+  switch (place_policy) {
+    case PLACE_HASH:
+      return hash_64(roffset / stripe, 32) % nservers;
+    case PLACE_WEIGHTED:
+      n = this_cpu_inc_return(place_rr) / stripe;
+      w = n % weight_sum;
+      for (i = 0; w >= weights[i]; i++)
+        w -= weights[i];
+      return i;
+    default:
+      n = this_cpu_inc_return(place_rr) / stripe;
+      return n % nservers;
+  }
+}
+
+/* compressed length of what roffset holds remotely, 0 if it is a whole
+ * page */
+static inline u32 rpage_clen(u64 roffset)
+{
+  u16 *leaf;
+
+  if (!compress)
+    return 0;
+  leaf = READ_ONCE(clen_map[roffset >> RPAGE_LEAF_SHIFT]);
+  return leaf ? READ_ONCE(leaf[roffset & (RPAGE_LEAF_ENTRIES - 1)]) : 0;
+}
+
+/* for an offset that has been stored, see rpage_entry_ptr */
+static inline void rpage_set_clen(u64 roffset, u32 clen)
+{
+  u16 *leaf = READ_ONCE(clen_map[roffset >> RPAGE_LEAF_SHIFT]);
+
+  BUG_ON(!leaf);
+  WRITE_ONCE(leaf[roffset & (RPAGE_LEAF_ENTRIES - 1)], clen);
+}
+
+/* the remote page right after (dir 1) or before (dir -1) the whole page
+ * stored for neighbour, 0 if there is none in the same block */
+static inline u64 rpage_next_to(u64 neighbour, int dir)
+{
+  u64 entry = rpage_entry(neighbour);
+  u64 raddr;
+
+  if (!entry || rpage_filled(entry) || rpage_clen(neighbour))
+    return 0;
+  raddr = rpage_addr(entry) + dir * PAGE_SIZE;
+  if ((raddr >> BLOCK_SHIFT) != (rpage_addr(entry) >> BLOCK_SHIFT))
+    return 0;
+  return raddr;
+}
+
+/* readahead fetches runs of swap offsets, so try to put roffset's page
+ * right after the one of the offset before it, or right before the one of
+ * the offset after it. the run can then be read with a single wr */
+static u64 sswap_rdma_alloc_near(u64 roffset)
+{
+  u64 raddr;
+
+  if (roffset > 0) {
+    raddr = rpage_next_to(roffset - 1, 1);
+    if (raddr && alloc_remote_page_at(raddr))
+      return raddr;
+  }
+  if (roffset + 1 < num_pages_total) {
+    raddr = rpage_next_to(roffset + 1, -1);
+    if (raddr && alloc_remote_page_at(raddr))
+      return raddr;
+  }
+  return 0;
+}
+
+/* allocates a remote page for roffset next to its neighbours', or on the
+ * server placement picks, or on the next one that has room */
+static u64 sswap_rdma_alloc_page(u64 roffset)
+{
+  u32 server;
+  u64 raddr;
+  int i;
+
+  raddr = sswap_rdma_alloc_near(roffset);
+  if (raddr)
+    return raddr;
+
+  server = sswap_rdma_place(roffset);
+  for (i = 0; i < nservers; i++) {
+    raddr = alloc_remote_page((server + i) % nservers);
+    if (raddr)
+      return raddr;
+  }
+  return 0;
+}
+
+/* like sswap_rdma_alloc_page, for a slot of 1 << slot_shift bytes */
+static u64 sswap_rdma_alloc_slot(u64 roffset, u32 slot_shift)
+{
+  u32 server = sswap_rdma_place(roffset);
+  u64 raddr;
+  int i;
+
+  for (i = 0; i < nservers; i++) {
+    raddr = alloc_remote_slot((server + i) % nservers, slot_shift);
+    if (raddr)
+      return raddr;
+  }
+  return 0;
+}
+
+/* size of the remote space a page compressed to clen bytes takes */
+static inline u32 clen_shift(u32 clen)
+{
+  if (!clen)
+    return PAGE_SHIFT;
+  return max_t(u32, fls(clen - 1), min_slot_shift);
+}
+
+/* compresses page into bounce. returns the compressed length, or 0 if that
+ * would not fit the largest slot */
+static u32 sswap_rdma_compress(struct page *page, struct page *bounce)
+{
+  void *wrkmem = get_cpu_var(cz_wrkmem);
+  int len;
+
+  len = LZ4_compress_default(page_address(page), page_address(bounce),
+                             PAGE_SIZE, 1 << max_slot_shift, wrkmem);
+  put_cpu_var(cz_wrkmem);
+
+  return len > 0 ? len : 0;
+}
+
+/* the bounce page a read of roffset goes through, NULL if the page is
+ * stored whole and read in place */
+static inline struct page *read_bounce(u64 roffset)
+{
+  if (!rpage_clen(roffset))
+    return NULL;
+  return mempool_alloc(cz_page_pool, GFP_NOIO);
+}
+
+static bool dedup_put(u64 raddr);
+
+/* gives back the remote page, or the slot of a page compressed to clen
+ * bytes, at raddr. returns false if other offsets still share it */
+static bool sswap_rdma_free_raddr(u64 raddr, u32 clen)
+{
+  if (dedup && !dedup_put(raddr))
+    return false;
+
+  if (clen)
+    free_remote_slot(raddr);
+  else
+    free_remote_page(raddr);
+  return true;
+}
+
+/* takes roffset out of the map and gives back its remote page or slot.
+ * that aborts a move of the page, see compact_flush. returns false if
+ * other offsets still share the page */
+static bool sswap_rdma_free_remote(u64 roffset)
+{
+  u64 raddr = rpage_addr(xchg(rpage_entry_ptr(roffset), 0));
+  u32 clen = rpage_clen(roffset);
+
+  if (clen)
+    rpage_set_clen(roffset, 0);
+  return sswap_rdma_free_raddr(raddr, clen);
+}
+
+/* remote pages of failed writes. the allocator can't take them back from
+ * the write completion, the undo work hands them back */
+struct write_undo {
+  struct llist_node node;
+  u64 raddr;
+  u32 clen;
+};
+static LLIST_HEAD(write_undos);
+
+static void sswap_rdma_undo_writes(struct work_struct *work)
+{
+  struct llist_node *list = llist_del_all(&write_undos);
+  struct write_undo *u, *next;
+
+  llist_for_each_entry_safe(u, next, list, node) {
+    if (sswap_rdma_free_raddr(u->raddr, u->clen))
+      atomic_dec(&num_swap_pages);
+    kfree(u);
+  }
+}
+static DECLARE_WORK(write_undo_work, sswap_rdma_undo_writes);
+
+/* takes roffset, whose write failed or never went out, out of the map.
+ * that also clears its writeback flag. its remote page never got the
+ * data, so nothing may read it any more */
+static void sswap_rdma_write_undo(u64 roffset)
+{
+  struct write_undo *u = kmalloc(sizeof(*u), GFP_ATOMIC);
+  u64 raddr = rpage_addr(rpage_entry(roffset));
+  u32 clen = rpage_clen(roffset);
+
+  if (clen)
+    rpage_set_clen(roffset, 0);
+  rpage_set_entry(roffset, 0);
+
+  if (unlikely(!u)) {
+    pr_err_ratelimited("leaking remote page %llx of a failed write\n", raddr);
+    return;
+  }
+  u->raddr = raddr;
+  u->clen = clen;
+  llist_add(&u->node, &write_undos);
+  queue_work(system_unbound_wq, &write_undo_work);
+}
+
+static void sswap_cz_destroy(void)
+{
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    vfree(per_cpu(cz_wrkmem, cpu));
+    per_cpu(cz_wrkmem, cpu) = NULL;
+  }
+  mempool_destroy(cz_page_pool);
+  cz_page_pool = NULL;
+}
+
+static int sswap_cz_setup(void)
+{
+  int cpu;
+
+  if (ec_k) {
+    pr_err("compress and ec_k can't be used together\n");
+    return -EINVAL;
+  }
+
+  cz_page_pool = mempool_create_page_pool(CZ_POOL_SIZE, 0);
+  if (!cz_page_pool)
+    goto out_destroy;
+
+  for_each_possible_cpu(cpu) {
+    per_cpu(cz_wrkmem, cpu) = vmalloc(LZ4_MEM_COMPRESS);
+    if (!per_cpu(cz_wrkmem, cpu))
+      goto out_destroy;
+  }
+
+  pr_info("compressing pages into %d to %d byte slots\n",
+          1 << min_slot_shift, 1 << max_slot_shift);
+  return 0;
+
+out_destroy:
+  sswap_cz_destroy();
+  return -ENOMEM;
+}
+
+/*
+ * dedup: a page whose contents are already stored remotely maps its offset
+ * to that remote page instead of being written again. entries are found by
+ * a 128 bit fingerprint of the contents, two xxh64 with different seeds,
+ * so that two different pages colliding is far less likely than a
+ * corrupted transfer. the remote address leads back to the entry when an
+ * offset lets go of its page, the last one frees it. remote pages are
+ * never written in place in this mode, since other offsets may share
+ * them, and a page is only shared once its own write completed.
+ */
+
+#define DEDUP_SEED2 0x9e3779b97f4a7c15ULL
+
+static const struct rhashtable_params dedup_fp_params = {
+  .head_offset = offsetof(struct dedup_entry, fp_node),
+  .key_offset = offsetof(struct dedup_entry, fp),
+  .key_len = sizeof(((struct dedup_entry *)0)->fp),
+  .automatic_shrinking = true,
+};
+
+static const struct rhashtable_params dedup_raddr_params = {
+  .head_offset = offsetof(struct dedup_entry, raddr_node),
+  .key_offset = offsetof(struct dedup_entry, raddr),
+  .key_len = sizeof(((struct dedup_entry *)0)->raddr),
+  .automatic_shrinking = true,
+};
+
+static void dedup_fingerprint(struct page *page, u64 *fp)
+{
+  void *p = page_address(page);
+
+  fp[0] = xxh64(p, PAGE_SIZE, 0);
+  fp[1] = xxh64(p, PAGE_SIZE, DEDUP_SEED2);
+}
+
+/* takes a reference on the remote copy of the contents fp, NULL if there
+ * is none that can be shared yet */
+static struct dedup_entry *dedup_get(const u64 *fp)
+{
+  struct dedup_entry *e;
+
+  rcu_read_lock();
+  e = rhashtable_lookup(&dedup_fp_map, fp, dedup_fp_params);
+  if (e && (!smp_load_acquire(&e->ready) ||
+            !refcount_inc_not_zero(&e->refs)))
+    e = NULL;
+  rcu_read_unlock();
+  return e;
+}
+
+/* indexes raddr as the remote copy of the contents fp. returns NULL if it
+ * can't be, the page is then stored for its offset only */
+static struct dedup_entry *dedup_add(const u64 *fp, u64 raddr, u32 clen)
+{
+  struct dedup_entry *e;
+  int ret;
+
+  /* this is the swap out path, don't reclaim for it */
+  e = kmem_cache_alloc(dedup_cache, GFP_NOWAIT | __GFP_NOWARN);
+  if (!e)
+    return NULL;
+  e->fp[0] = fp[0];
+  e->fp[1] = fp[1];
+  e->raddr = raddr;
+  e->clen = clen;
+  e->ready = false;
+  refcount_set(&e->refs, 1);
+
+  spin_lock(&dedup_lock);
+  ret = rhashtable_insert_fast(&dedup_raddr_map, &e->raddr_node,
+                               dedup_raddr_params);
+  if (!ret) {
+    /* -EEXIST when a copy of the same contents is still being written */
+    ret = rhashtable_lookup_insert_fast(&dedup_fp_map, &e->fp_node,
+                                        dedup_fp_params);
+    if (ret)
+      rhashtable_remove_fast(&dedup_raddr_map, &e->raddr_node,
+                             dedup_raddr_params);
+  }
+  spin_unlock(&dedup_lock);
+
+  if (ret) {
+    kmem_cache_free(dedup_cache, e);
+    return NULL;
+  }
+  return e;
+}
+
+static void dedup_free_rcu(struct rcu_head *rcu)
+{
+  kmem_cache_free(dedup_cache, container_of(rcu, struct dedup_entry, rcu));
+}
+
+/* drops an offset's reference on the remote page raddr. returns true if
+ * it was the last one and the page is to be freed */
+static bool dedup_put(u64 raddr)
+{
+  struct dedup_entry *e;
+
+  /* the caller's reference keeps e alive past the rcu section */
+  rcu_read_lock();
+  e = rhashtable_lookup(&dedup_raddr_map, &raddr, dedup_raddr_params);
+  rcu_read_unlock();
+  if (!e)
+    return true;
+
+  if (!refcount_dec_and_lock(&e->refs, &dedup_lock)) {
+    atomic_dec(&dedup_shared);
+    return false;
+  }
+  rhashtable_remove_fast(&dedup_fp_map, &e->fp_node, dedup_fp_params);
+  rhashtable_remove_fast(&dedup_raddr_map, &e->raddr_node,
+                         dedup_raddr_params);
+  spin_unlock(&dedup_lock);
+  call_rcu(&e->rcu, dedup_free_rcu);
+  return true;
+}
+
+static void dedup_free_entry(void *ptr, void *arg)
+{
+  kmem_cache_free(dedup_cache, ptr);
+}
+
+static void sswap_dedup_destroy(void)
+{
+  if (!dedup_cache)
+    return;
+  rhashtable_destroy(&dedup_fp_map);
+  rhashtable_free_and_destroy(&dedup_raddr_map, dedup_free_entry, NULL);
+  rcu_barrier();
+  kmem_cache_destroy(dedup_cache);
+  dedup_cache = NULL;
+}
+
+static int sswap_dedup_setup(void)
+{
+  int ret;
+
+  if (ec_k) {
+    pr_err("dedup and ec_k can't be used together\n");
+    return -EINVAL;
+  }
+
+  ret = rhashtable_init(&dedup_fp_map, &dedup_fp_params);
+  if (ret)
+    return ret;
+  ret = rhashtable_init(&dedup_raddr_map, &dedup_raddr_params);
+  if (ret) {
+    rhashtable_destroy(&dedup_fp_map);
+    return ret;
+  }
+  dedup_cache = KMEM_CACHE(dedup_entry, 0);
+  if (!dedup_cache) {
+    rhashtable_destroy(&dedup_raddr_map);
+    rhashtable_destroy(&dedup_fp_map);
+    return -ENOMEM;
+  }
+
+  pr_info("deduplicating remote pages\n");
+  return 0;
+}
+
+/*
+ * erasure coded store mode (ec_k > 0). a page is split into ec_k data
+ * fragments plus ec_r parity fragments, each on a different server. ec_k
+ * pages share a group of ec_k + ec_r remote pages, one per server, and
+ * slot s of the group keeps its fragment f at s * frag_size in remote page
+ * f. that is (k + r) / k times the memory, instead of the 2-3x of keeping
+ * copies. the offset map entry of a page points at its group and names its
+ * slot, the writeback bit stays where it is.
+ *
+ * reads fetch k fragments. data fragments land in the page itself and need
+ * no decoding. parity ones go to a bounce page and are only picked when a
+ * data fragment's server is down or much more backed up.
+ */
+
+#define EC_SLOT_SHIFT 1
+#define EC_SLOT_MASK 0x7
+#define EC_GROUP_ALIGN 64
+/* a parity fragment is read instead of a data fragment only when the data
+ * fragment's server has this many more reads queued */
+#define EC_SLOW_GAP 64
+#define EC_POOL_SIZE 256
+
+struct ec_group {
+  u64 raddr[EC_MAX_FRAGS];
+  /* slots in use, plus one while the group still takes new pages */
+  atomic_t live;
+};
+
+struct ec_io {
+  struct page *page;
+  /* parity fragments, of a write or of a degraded read */
+  struct page *bounce;
+  u64 roffset;
+  struct ec_group *group;
+  int slot;
+  bool write;
+  bool failed;
+  int tries;
+  atomic_t remaining;
+  u8 sel[EC_MAX_FRAGS]; /* the fragments a read fetches */
+  struct work_struct retry;
+};
+
+struct ec_open {
+  spinlock_t lock;
+  struct ec_group *group;
+  int next;
+};
+
+static struct sswap_ec ec;
+static struct kmem_cache *ec_group_cache;
+static struct kmem_cache *ec_io_cache;
+static mempool_t *ec_group_pool;
+static mempool_t *ec_io_pool;
+static mempool_t *ec_page_pool;
+static DEFINE_PER_CPU(struct ec_open, ec_open);
+
+static inline struct ec_group *ec_entry_group(u64 entry)
+{
+  return (struct ec_group *)(unsigned long)(entry & ~(u64)(EC_GROUP_ALIGN - 1));
+}
+
+static inline int ec_entry_slot(u64 entry)
+{
+  return (entry >> EC_SLOT_SHIFT) & EC_SLOT_MASK;
+}
+
+static inline u64 ec_frag_raddr(struct ec_group *g, int slot, int f)
+{
+  return g->raddr[f] + slot * ec.frag_size;
+}
+
+/* where fragment f of io sits locally: its page, and the offset in it */
+static inline struct page *ec_frag_page(struct ec_io *io, int f,
+                                        unsigned int *off)
+{
+  if (f < ec.k) {
+    *off = f * ec.frag_size;
+    return io->page;
+  }
+  *off = (f - ec.k) * ec.frag_size;
+  return io->bounce;
+}
+
+static void ec_put_group(struct ec_group *g)
+{
+  int f;
+
+  if (!atomic_dec_and_test(&g->live))
+    return;
+
+  for (f = 0; f < ec.k + ec.r; f++)
+    free_remote_page(g->raddr[f]);
+  mempool_free(g, ec_group_pool);
+}
+
+/* a new group on k + r different servers that are up, starting at the next
+ * server in turn */
+static struct ec_group *ec_new_group(void)
+{
+  struct ec_group *g = mempool_alloc(ec_group_pool, GFP_NOIO);
+  u32 start = this_cpu_inc_return(place_rr);
+  u32 server;
+  int i, n = 0;
+
+  for (i = 0; i < nservers && n < ec.k + ec.r; i++) {
+    server = (start + i) % nservers;
+    if (test_bit(server, servers_down))
+      continue;
+    g->raddr[n] = alloc_remote_page(server);
+    if (g->raddr[n])
+      n++;
+  }
+
+  if (n < ec.k + ec.r) {
+    pr_err_ratelimited("no room for a group of %d fragments\n", ec.k + ec.r);
+    while (n--)
+      free_remote_page(g->raddr[n]);
+    mempool_free(g, ec_group_pool);
+    return NULL;
+  }
+
+  atomic_set(&g->live, 1);
+  return g;
+}
+
+/* hands out the next slot of this cpu's open group, as an offset map
+ * entry. returns 0 if no group can be had */
+static u64 ec_alloc_slot(void)
+{
+  struct ec_group *g, *fresh = NULL, *closed = NULL;
+  struct ec_open *o;
+  int slot = 0;
+
+  for (;;) {
+    o = get_cpu_ptr(&ec_open);
+    spin_lock(&o->lock);
+    if (!o->group && fresh) {
+      o->group = fresh;
+      o->next = 0;
+      fresh = NULL;
+    }
+    g = o->group;
+    if (g) {
+      slot = o->next++;
+      atomic_inc(&g->live);
+      if (o->next == ec.k) {
+        o->group = NULL;
+        closed = g;
+      }
+    }
+    spin_unlock(&o->lock);
+    put_cpu_ptr(&ec_open);
+
+    if (g)
+      break;
+    fresh = ec_new_group();
+    if (!fresh)
+      return 0;
+  }
+
+  /* someone else refilled this cpu's group in the meantime */
+  if (fresh)
+    ec_put_group(fresh);
+  /* a full group lives on through its slots only */
+  if (closed)
+    ec_put_group(closed);
+
+  return (unsigned long)g | (slot << EC_SLOT_SHIFT);
+}
+
+/* posts the transfer of fragment f of io on the queue of its server */
+static int ec_post_frag(struct ec_io *io, int f, enum qp_type type)
+{
+  enum dma_data_direction dir = io->write ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+  u64 raddr = ec_frag_raddr(io->group, io->slot, f);
+  struct rdma_queue *q;
+  struct rdma_req *req;
+  struct page *page;
+  unsigned int off;
+  int ret;
+
+  q = sswap_rdma_get_queue(raddr_server(raddr), raw_smp_processor_id(), type);
+  page = ec_frag_page(io, f, &off);
+
+  if (io->write)
+    get_write_credits(q, 1);
+  else
+    get_read_credits(q, 1);
+
+  spin_lock(&q->sq_lock);
+  ret = get_req_for_range(q, &req, page, off, ec.frag_size, dir);
+  if (unlikely(ret))
+    goto out_unlock;
+
+  req->ec = io;
+  req->roffset = io->roffset;
+  req->cqe.done = io->write ? sswap_rdma_write_done : sswap_rdma_read_done;
+  ret = sswap_rdma_prep_rdma(q, 0, req, raddr,
+                             io->write ? IB_WR_RDMA_WRITE : IB_WR_RDMA_READ);
+  if (unlikely(ret)) {
+    put_reqs(q, 1, dir);
+    goto out_unlock;
+  }
+
+  ret = sswap_rdma_post_chain(q, 1);
+  if (unlikely(ret)) {
+    put_reqs(q, 1, dir);
+    /* the qp is in error */
+    set_bit(raddr_server(raddr), servers_down);
+  } else if (io->write) {
+    /* signaled, so it retires the unsignaled writes before it too */
+    q->unsignaled = 0;
+  }
+
+out_unlock:
+  spin_unlock(&q->sq_lock);
+  if (unlikely(ret))
+    put_credits(q, 1);
+  return ret;
+}
+
+/* picks the k fragments a read fetches, least backed up servers first with
+ * parity fragments counting EC_SLOW_GAP extra */
+static int ec_pick_frags(struct ec_io *io)
+{
+  int load[EC_MAX_FRAGS];
+  bool used[EC_MAX_FRAGS] = { false };
+  int cpu = raw_smp_processor_id();
+  int f, i, best;
+  u32 server;
+
+  for (f = 0; f < ec.k + ec.r; f++) {
+    server = raddr_server(io->group->raddr[f]);
+    if (test_bit(server, servers_down)) {
+      load[f] = INT_MAX;
+      continue;
+    }
+    load[f] = atomic_read(&sswap_rdma_get_queue(server, cpu,
+                                                QP_READ_SYNC)->pending);
+    if (f >= ec.k)
+      load[f] += EC_SLOW_GAP;
+  }
+
+  for (i = 0; i < ec.k; i++) {
+    best = -1;
+    for (f = 0; f < ec.k + ec.r; f++)
+      if (!used[f] && load[f] != INT_MAX &&
+          (best < 0 || load[f] < load[best]))
+        best = f;
+    if (best < 0)
+      return -EIO;
+    used[best] = true;
+    io->sel[i] = best;
+  }
+
+  return 0;
+}
+
+static int ec_issue_read(struct ec_io *io, enum qp_type type)
+{
+  int i;
+
+  if (ec_pick_frags(io)) {
+    pr_err_ratelimited("fewer than %d servers up for offset %llu\n",
+                       ec.k, io->roffset);
+    return -EIO;
+  }
+
+  for (i = 0; i < ec.k; i++)
+    if (io->sel[i] >= ec.k && !io->bounce)
+      io->bounce = mempool_alloc(ec_page_pool, GFP_NOIO);
+
+  io->failed = false;
+  io->tries++;
+  atomic_set(&io->remaining, ec.k);
+  for (i = 0; i < ec.k; i++) {
+    if (ec_post_frag(io, io->sel[i], type)) {
+      io->failed = true;
+      ec_frag_done(io);
+    }
+  }
+
+  return 0;
+}
+
+static void ec_free_io(struct ec_io *io)
+{
+  if (io->bounce)
+    mempool_free(io->bounce, ec_page_pool);
+  mempool_free(io, ec_io_pool);
+}
+
+static void ec_read_end(struct ec_io *io, bool ok)
+{
+  if (ok)
+    SetPageUptodate(io->page);
+  else
+    SetPageError(io->page);
+  unlock_page(io->page);
+  ec_free_io(io);
+}
+
+/* a fragment read failed and took its server down with it, fetch the page
+ * again from the servers that are left. runs in process context, and goes
+ * through the async queues since nobody polls the sync ones for it */
+static void ec_read_retry(struct work_struct *work)
+{
+  struct ec_io *io = container_of(work, struct ec_io, retry);
+
+  if (io->tries > ec.r || ec_issue_read(io, QP_READ_ASYNC))
+    ec_read_end(io, false);
+}
+
+static void ec_read_finish(struct ec_io *io)
+{
+  u8 *frags[EC_MAX_FRAGS];
+  unsigned int off;
+  struct page *page;
+  int f, i;
+
+  if (unlikely(io->failed)) {
+    schedule_work(&io->retry);
+    return;
   }
 
-  ret = get_req_for_page(&req, dev, page, DMA_TO_DEVICE);
-  if (unlikely(ret))
-    return ret;
+  for (i = 0; i < ec.k && io->sel[i] < ec.k; i++)
+    ;
+  if (i < ec.k) {
+    /* some data fragments are missing, rebuild them from the parity */
+    for (f = 0; f < ec.k + ec.r; f++) {
+      page = ec_frag_page(io, f, &off);
+      frags[f] = page ? page_address(page) + off : NULL;
+    }
+    if (sswap_ec_decode(&ec, io->sel, frags)) {
+      pr_err("could not decode offset %llu\n", io->roffset);
+      ec_read_end(io, false);
+      return;
+    }
+  }
 
-  req->cqe.done = sswap_rdma_write_done;
-  ret = sswap_rdma_post_rdma(q, req, &sge, roffset, /*rkey,*/IB_WR_RDMA_WRITE);
+  ec_read_end(io, true);
+}
 
-  return ret;
+static void ec_write_finish(struct ec_io *io)
+{
+  unsigned long *entry = (unsigned long *)rpage_entry_ptr(io->roffset);
+
+  if (unlikely(io->failed))
+    pr_err_ratelimited("some fragments of offset %llu were not written\n",
+                       io->roffset);
+
+  clear_bit_unlock(RPAGE_WRITEBACK_BIT, entry);
+  sswap_rdma_end_write(io->page, true);
+  ec_free_io(io);
 }
 
-static inline int begin_read(struct rdma_queue *q, struct page *page,
-			     u64 roffset/*, u32 rkey*/)
+static void ec_frag_done(struct ec_io *io)
 {
-  struct rdma_req *req;
-  struct ib_device *dev = q->ctrl->rdev->dev;
-  struct ib_sge sge = {};
-  int ret, inflight;
-
-  /* back pressure in-flight reads, can't send more than
-   * QP_MAX_SEND_WR at a time */
-  while ((inflight = atomic_read(&q->pending)) >= QP_MAX_SEND_WR) {
-    BUG_ON(inflight > QP_MAX_SEND_WR); /* only valid case is == */
-    poll_target(q, 8);
-    pr_info_ratelimited("back pressure happened on reads");
+  if (!atomic_dec_and_test(&io->remaining))
+    return;
+
+  if (io->write)
+    ec_write_finish(io);
+  else
+    ec_read_finish(io);
+}
+
+static int sswap_ec_write(struct page *page, u64 roffset)
+{
+  u64 entry = rpage_entry(roffset);
+  u8 *frags[EC_MAX_FRAGS];
+  struct ec_io *io;
+  unsigned int off;
+  int f;
+
+  if (!entry) {
+    entry = ec_alloc_slot();
+    if (!entry) {
+      pr_err("bad remote page alloc\n");
+      return -1;
+    }
+    rpage_set_entry(roffset, entry);
+    atomic_inc(&num_swap_pages);
   }
 
-  ret = get_req_for_page(&req, dev, page, DMA_TO_DEVICE);
-  if (unlikely(ret))
-    return ret;
+  io = mempool_alloc(ec_io_pool, GFP_NOIO);
+  io->page = page;
+  io->bounce = mempool_alloc(ec_page_pool, GFP_NOIO);
+  io->roffset = roffset;
+  io->group = ec_entry_group(entry);
+  io->slot = ec_entry_slot(entry);
+  io->write = true;
+  io->failed = false;
+  atomic_set(&io->remaining, ec.k + ec.r);
+
+  for (f = 0; f < ec.k + ec.r; f++)
+    frags[f] = page_address(ec_frag_page(io, f, &off)) + off;
+  sswap_ec_encode(&ec, frags);
+
+  set_bit(RPAGE_WRITEBACK_BIT, (unsigned long *)rpage_entry_ptr(roffset));
+  for (f = 0; f < ec.k + ec.r; f++) {
+    if (ec_post_frag(io, f, QP_WRITE_SYNC)) {
+      io->failed = true;
+      ec_frag_done(io);
+    }
+  }
 
-  req->cqe.done = sswap_rdma_read_done;
-  ret = sswap_rdma_post_rdma(q, req, &sge, roffset/*, rkey*/,IB_WR_RDMA_READ);
+  return 0;
+}
+
+static int sswap_ec_read(struct page *page, u64 roffset, enum qp_type type)
+{
+  u64 entry = rpage_entry(roffset);
+  struct ec_io *io;
+  int ret;
+
+  BUG_ON(entry == 0);
+
+  io = mempool_alloc(ec_io_pool, GFP_NOIO);
+  io->page = page;
+  io->bounce = NULL;
+  io->roffset = roffset;
+  io->group = ec_entry_group(entry);
+  io->slot = ec_entry_slot(entry);
+  io->write = false;
+  io->tries = 0;
+  INIT_WORK(&io->retry, ec_read_retry);
+
+  ret = ec_issue_read(io, type);
+  if (ret)
+    ec_free_io(io);
   return ret;
 }
 
+static void sswap_ec_destroy(void)
+{
+  mempool_destroy(ec_page_pool);
+  mempool_destroy(ec_io_pool);
+  mempool_destroy(ec_group_pool);
+  kmem_cache_destroy(ec_io_cache);
+  kmem_cache_destroy(ec_group_cache);
+}
+
+static int sswap_ec_setup(void)
+{
+  int cpu, ret;
+
+  ret = sswap_ec_init(&ec, ec_k, ec_r);
+  if (ret) {
+    pr_err("ec_k must be 2, 4 or 8 and ec_r 1 to %d\n", EC_MAX_R);
+    return ret;
+  }
+  /* the parity fragments of a page share one bounce page */
+  if (ec.r > ec.k) {
+    pr_err("ec_r can't be larger than ec_k\n");
+    return -EINVAL;
+  }
+  if (ec.k + ec.r > nservers) {
+    pr_err("ec_k + ec_r is %d, but there are only %d servers\n",
+           ec.k + ec.r, nservers);
+    return -EINVAL;
+  }
+
+  for_each_possible_cpu(cpu)
+    spin_lock_init(&per_cpu_ptr(&ec_open, cpu)->lock);
+
+  ec_group_cache = kmem_cache_create("sswap_ec_group", sizeof(struct ec_group),
+                                     EC_GROUP_ALIGN, 0, NULL);
+  ec_io_cache = KMEM_CACHE(ec_io, 0);
+  if (!ec_group_cache || !ec_io_cache)
+    goto out_destroy;
+
+  /* stores run in reclaim, they can't count on allocations succeeding */
+  ec_group_pool = mempool_create_slab_pool(EC_POOL_SIZE, ec_group_cache);
+  ec_io_pool = mempool_create_slab_pool(EC_POOL_SIZE, ec_io_cache);
+  ec_page_pool = mempool_create_page_pool(EC_POOL_SIZE, 0);
+  if (!ec_group_pool || !ec_io_pool || !ec_page_pool)
+    goto out_destroy;
+
+  pr_info("erasure coding %d+%d, %zu byte fragments, %s\n", ec.k, ec.r,
+          ec.frag_size, ec.avx2 ? "avx2" : "scalar");
+  return 0;
+
+out_destroy:
+  sswap_ec_destroy();
+  return -ENOMEM;
+}
+
+/* posts an RDMA write of page and returns right away. the page stays under
+ * writeback until sswap_rdma_write_done ends it */
 int sswap_rdma_write(struct page *page, u64 roffset)
 {
   int ret;
   struct rdma_queue *q;
+  struct page *bounce = NULL;
+  struct dedup_entry *dd = NULL;
+  u32 clen = 0;
   //int num_swap_pages_tmp;
   u64 page_offset = roffset;
-  u64 raddr = offset_to_rpage_addr[page_offset];
+  u64 raddr;
+  u64 fp[2];
   //u64 raddr_block = 0;
   //u32 rkey = 0;
 
+  /* not necessarily a swap cache page, the compressed cache of
+   * fastswap.c writes back private copies */
   BUG_ON(roffset >= num_pages_total);
-  VM_BUG_ON_PAGE(!PageSwapCache(page), page);
+  VM_BUG_ON_PAGE(!PageWriteback(page), page);
+
+  if (!rpage_leaf_get(page_offset))
+    return -1;
+
+  /* the page was same filled before, it has no remote page to reuse */
+  if (rpage_filled(rpage_entry(page_offset)))
+    sswap_rdma_free_page(page_offset);
+  raddr = rpage_addr(rpage_entry(page_offset));
+
+  if (ec_k)
+    return sswap_ec_write(page, roffset);
+
+  if (dedup) {
+    /* the old contents may be shared, let go of them instead of writing
+     * over them */
+    sswap_rdma_free_page(page_offset);
+    raddr = 0;
+
+    dedup_fingerprint(page, fp);
+    dd = dedup_get(fp);
+    if (dd) {
+      if (compress)
+        rpage_set_clen(page_offset, dd->clen);
+      rpage_set_entry(page_offset, dd->raddr);
+      atomic_inc(&dedup_shared);
+      atomic64_inc(&dedup_hits);
+      sswap_rdma_end_write(page, true);
+      return 0;
+    }
+  }
+
+  if (compress) {
+    bounce = mempool_alloc(cz_page_pool, GFP_NOIO);
+    clen = sswap_rdma_compress(page, bounce);
+    if (clen) {
+      atomic64_inc(&cz_stored);
+      atomic64_add(clen, &cz_bytes);
+    } else {
+      mempool_free(bounce, cz_page_pool);
+      bounce = NULL;
+      atomic64_inc(&cz_whole);
+    }
+  }
+
+  /* a rewrite that compressed to another slot size, or not at all */
+  if (raddr && clen_shift(clen) != clen_shift(rpage_clen(page_offset))) {
+    if (sswap_rdma_free_remote(page_offset))
+      atomic_dec(&num_swap_pages);
+    rpage_set_entry(page_offset, 0);
+    raddr = 0;
+  }
 
   if(raddr == 0) {
     //spin_lock(locks+ (page_offset % num_groups));
-    raddr = alloc_remote_page();
+    if (clen)
+      raddr = sswap_rdma_alloc_slot(page_offset, clen_shift(clen));
+    else
+      raddr = sswap_rdma_alloc_page(page_offset);
     if(raddr == 0) {
       pr_err("bad remote page alloc\n");
       //spin_unlock(locks + (page_offset % num_groups));
+      if (bounce)
+        mempool_free(bounce, cz_page_pool);
       return -1;
     }
-    offset_to_rpage_addr[page_offset] = raddr;
+    rpage_set_entry(page_offset, raddr);
+    if (!clen)
+      compact_set_owner(raddr, page_offset);
     // spin_unlock(locks + (page_offset % num_groups));
 
     atomic_inc(&num_swap_pages);
+    if (dedup)
+      dd = dedup_add(fp, raddr, clen);
     /*
     num_swap_pages_tmp = atomic_read(&num_swap_pages);
     if(num_swap_pages_tmp % print_interval == 0) {
@@ -753,8 +2753,6 @@ int sswap_rdma_write(struct page *page, u64 roffset)
 
   BUG_ON(raddr == 0);
 
-  q = sswap_rdma_get_queue(smp_processor_id(), QP_WRITE_SYNC);
-
   //raddr_block = raddr >> BLOCK_SHIFT;
   //raddr_block = raddr_block << BLOCK_SHIFT;
   //rkey = get_rkey(raddr_block);
@@ -762,14 +2760,78 @@ int sswap_rdma_write(struct page *page, u64 roffset)
     //pr_err("read_async:remote address(%p) is invalid.\n", (void*)raddr);
     //return -1;
   //}
-  ret = write_queue_add(q, page, raddr/*, rkey*/);
-  BUG_ON(ret);
-  drain_queue(q);
+  if (compress)
+    rpage_set_clen(page_offset, clen);
+  raddr = sswap_rdma_begin_write(page_offset);
+  /* a server that lost writes gets no more, the page goes to disk */
+  if (unlikely(test_bit(raddr_server(raddr), servers_down)))
+    goto out_undo;
+  /* the queue only needs to be close to this cpu, and getting credits
+   * may sleep */
+  q = sswap_rdma_get_queue(raddr_server(raddr), raw_smp_processor_id(),
+                           QP_WRITE_SYNC);
+  ret = write_queue_add(q, page, page_offset, raddr, bounce,
+                        clen ?: PAGE_SIZE, dd);
+  if (unlikely(ret))
+    goto out_undo;
 
-  return ret;
+  return 0;
+
+out_undo:
+  /* the caller ends the page's writeback when the store fails */
+  pr_err_ratelimited("could not post write of offset %llu\n", page_offset);
+  if (bounce)
+    mempool_free(bounce, cz_page_pool);
+  sswap_rdma_write_undo(page_offset);
+  return -1;
 }
 EXPORT_SYMBOL(sswap_rdma_write);
 
+/* records that roffset is a page of value repeated, instead of writing it
+ * to a remote page. only values with equal halves fit the entry, which
+ * covers zero and every byte, halfword and word fill. returns -1 for the
+ * others, the page has to be written then */
+int sswap_rdma_write_filled(u64 roffset, u64 value)
+{
+  BUG_ON(roffset >= num_pages_total);
+  if ((u32)value != value >> 32 || !rpage_leaf_get(roffset))
+    return -1;
+
+  /* drops the remote copy of an older version of the page */
+  sswap_rdma_free_page(roffset);
+  rpage_set_entry(roffset, (value << 32) | (1UL << RPAGE_FILLED_BIT));
+  atomic_inc(&num_filled_pages);
+  return 0;
+}
+EXPORT_SYMBOL(sswap_rdma_write_filled);
+
+/* fills in page if roffset is same filled, no read needed then. returns
+ * false if the page has to be read */
+static bool sswap_rdma_read_filled(struct page *page, u64 roffset)
+{
+  u64 entry = rpage_entry(roffset);
+  u64 value, *p;
+  int i;
+
+  if (!rpage_filled(entry))
+    return false;
+
+  value = entry >> 32;
+  value |= value << 32;
+  p = page_address(page);
+  if (!value)
+    clear_page(p);
+  else if (value == (u8)value * 0x0101010101010101ULL)
+    memset(p, (u8)value, PAGE_SIZE);
+  else
+    for (i = 0; i < PAGE_SIZE / sizeof(*p); i++)
+      p[i] = value;
+
+  SetPageUptodate(page);
+  unlock_page(page);
+  return true;
+}
+
 static int sswap_rdma_recv_remotemr_fake(struct sswap_rdma_ctrl *ctrl)
 {
   ctrl->servermr.baseaddr = 0;
@@ -813,19 +2875,29 @@ out:
 int sswap_rdma_read_async(struct page *page, u64 roffset)
 {
   struct rdma_queue *q;
-  int ret;
-  u64 raddr = offset_to_rpage_addr[roffset];
+  struct page *bounce;
+  int ret, idx;
+  u64 raddr;
   //u64 raddr_block;
   //u32 rkey = 0;
 
   BUG_ON(roffset >= num_pages_total);
+  sswap_rdma_wait_write(roffset);
+  if (sswap_rdma_read_filled(page, roffset))
+    return 0;
+  if (ec_k)
+    return sswap_ec_read(page, roffset, QP_READ_ASYNC);
+
+  idx = compact_read_lock();
+  raddr = rpage_addr(rpage_entry(roffset));
   BUG_ON(raddr == 0);
-  BUG_ON((raddr & ((1 << PAGE_SHIFT) - 1)) != 0);
+  BUG_ON(!rpage_clen(roffset) && (raddr & ((1 << PAGE_SHIFT) - 1)) != 0);
   VM_BUG_ON_PAGE(!PageSwapCache(page), page);
   VM_BUG_ON_PAGE(!PageLocked(page), page);
   VM_BUG_ON_PAGE(PageUptodate(page), page);
 
-  q = sswap_rdma_get_queue(smp_processor_id(), QP_READ_ASYNC);
+  q = sswap_rdma_get_queue(raddr_server(raddr), smp_processor_id(),
+                           QP_READ_ASYNC);
   
   //raddr_block = raddr >> BLOCK_SHIFT;
   //raddr_block = raddr_block << BLOCK_SHIFT;
@@ -834,13 +2906,104 @@ int sswap_rdma_read_async(struct page *page, u64 roffset)
     //pr_err("read_async:remote address(%p) is invalid.\n", (void*)raddr);
     //return -1;
   //}
-  ret = begin_read(q, page, raddr/*, rkey*/);
+  bounce = read_bounce(roffset);
+  ret = begin_read(q, page, raddr/*, rkey*/, bounce,
+                   rpage_clen(roffset) ?: PAGE_SIZE, idx);
+  if (unlikely(ret)) {
+    compact_read_unlock(idx);
+    if (bounce)
+      mempool_free(bounce, cz_page_pool);
+  }
 
+  /* a polled cq is reaped by whoever posts to it */
+  if (READ_ONCE(q->polled))
+    sswap_rdma_poll_async(q, ASYNC_POLL_BUDGET);
 
   return ret;
 }
 EXPORT_SYMBOL(sswap_rdma_read_async);
 
+/* like sswap_rdma_read_async, but posts the cluster in chains of up to
+ * RDMA_MAX_CHAIN wrs. a chain ends where the pages move to another server.
+ * returns the number of pages, from the start of pages, that were posted */
+int sswap_rdma_read_async_batch(struct page **pages, pgoff_t *roffsets, int nr)
+{
+  struct rdma_queue *q = NULL;
+  u64 raddrs[RDMA_MAX_CHAIN];
+  struct page *bounces[RDMA_MAX_CHAIN];
+  u32 lens[RDMA_MAX_CHAIN];
+  int idxs[RDMA_MAX_CHAIN];
+  int i, n, posted, done = 0;
+
+  /* fragments go to k servers per page, there are no chains to build */
+  if (ec_k) {
+    for (; done < nr; done++) {
+      BUG_ON(roffsets[done] >= num_pages_total);
+      sswap_rdma_wait_write(roffsets[done]);
+      if (sswap_rdma_read_filled(pages[done], roffsets[done]))
+        continue;
+      if (sswap_ec_read(pages[done], roffsets[done], QP_READ_ASYNC))
+        break;
+    }
+    return done;
+  }
+
+  while (done < nr) {
+    BUG_ON(roffsets[done] >= num_pages_total);
+    sswap_rdma_wait_write(roffsets[done]);
+    if (sswap_rdma_read_filled(pages[done], roffsets[done])) {
+      done++;
+      continue;
+    }
+
+    n = min(nr - done, RDMA_MAX_CHAIN);
+    for (i = 0; i < n; i++) {
+      BUG_ON(roffsets[done + i] >= num_pages_total);
+      sswap_rdma_wait_write(roffsets[done + i]);
+      /* same filled pages end the chain, they are filled in at its head */
+      if (i && rpage_filled(rpage_entry(roffsets[done + i]))) {
+        n = i;
+        break;
+      }
+      idxs[i] = compact_read_lock();
+      raddrs[i] = rpage_addr(rpage_entry(roffsets[done + i]));
+      BUG_ON(raddrs[i] == 0);
+      if (i && raddr_server(raddrs[i]) != raddr_server(raddrs[0])) {
+        compact_read_unlock(idxs[i]);
+        n = i;
+        break;
+      }
+      VM_BUG_ON_PAGE(!PageSwapCache(pages[done + i]), pages[done + i]);
+      VM_BUG_ON_PAGE(!PageLocked(pages[done + i]), pages[done + i]);
+      VM_BUG_ON_PAGE(PageUptodate(pages[done + i]), pages[done + i]);
+      bounces[i] = read_bounce(roffsets[done + i]);
+      lens[i] = rpage_clen(roffsets[done + i]) ?: PAGE_SIZE;
+    }
+
+    if (q && READ_ONCE(q->polled))
+      sswap_rdma_poll_async(q, ASYNC_POLL_BUDGET);
+    q = sswap_rdma_get_queue(raddr_server(raddrs[0]), smp_processor_id(),
+                             QP_READ_ASYNC);
+    posted = begin_read_chain(q, pages + done, raddrs, bounces, lens, idxs,
+                              n);
+    done += posted;
+    if (posted < n) {
+      for (i = posted; i < n; i++) {
+        compact_read_unlock(idxs[i]);
+        if (bounces[i])
+          mempool_free(bounces[i], cz_page_pool);
+      }
+      break;
+    }
+  }
+
+  if (q && READ_ONCE(q->polled))
+    sswap_rdma_poll_async(q, ASYNC_POLL_BUDGET);
+
+  return done;
+}
+EXPORT_SYMBOL(sswap_rdma_read_async_batch);
+
 void sswap_rdma_free_page(u64 roffset) {
   //int num_swap_pages_tmp;
   int page_offset = roffset/*>> PAGE_SHIFT*/;
@@ -848,15 +3011,31 @@ void sswap_rdma_free_page(u64 roffset) {
   BUG_ON(roffset >= num_pages_total);
 
   //spin_lock(locks + (page_offset % num_groups));
-  if(offset_to_rpage_addr[page_offset] == 0) {
+  if(rpage_entry(page_offset) == 0) {
     //pr_err("no mapping for the page being free\n");
     //spin_unlock(locks + (page_offset % num_groups));
     return;
   }
-  free_remote_page(offset_to_rpage_addr[page_offset]);
-  offset_to_rpage_addr[page_offset] = 0;
-  //spin_unlock(locks + (page_offset % num_groups));
+  if (rpage_filled(rpage_entry(page_offset))) {
+    rpage_set_entry(page_offset, 0);
+    atomic_dec(&num_filled_pages);
+    return;
+  }
+  /* the remote page must not be handed out again under a write. a failed
+   * write takes the offset out of the map itself */
+  sswap_rdma_wait_write(page_offset);
+  if (!rpage_entry(page_offset))
+    return;
+  if (ec_k) {
+    ec_put_group(ec_entry_group(rpage_entry(page_offset)));
+  } else {
+    if (!sswap_rdma_free_remote(page_offset))
+      goto out_shared;
+  }
   atomic_dec(&num_swap_pages);
+out_shared:
+  rpage_set_entry(page_offset, 0);
+  //spin_unlock(locks + (page_offset % num_groups));
 
   /*
   num_swap_pages_tmp = atomic_read(&num_swap_pages);
@@ -871,19 +3050,29 @@ EXPORT_SYMBOL(sswap_rdma_free_page);
 int sswap_rdma_read_sync(struct page *page, u64 roffset)
 {
   struct rdma_queue *q;
-  int ret;
-  u64 raddr = offset_to_rpage_addr[roffset];
+  struct page *bounce;
+  int ret, idx;
+  u64 raddr;
   //u64 raddr_block;
   //u32 rkey = 0;
 
-  BUG_ON(raddr == 0);
   BUG_ON(roffset >= num_pages_total);
-  BUG_ON((raddr & ((1 << PAGE_SHIFT) - 1)) != 0);
+  sswap_rdma_wait_write(roffset);
+  if (sswap_rdma_read_filled(page, roffset))
+    return 0;
+  if (ec_k)
+    return sswap_ec_read(page, roffset, QP_READ_SYNC);
+
+  idx = compact_read_lock();
+  raddr = rpage_addr(rpage_entry(roffset));
+  BUG_ON(raddr == 0);
+  BUG_ON(!rpage_clen(roffset) && (raddr & ((1 << PAGE_SHIFT) - 1)) != 0);
   VM_BUG_ON_PAGE(!PageSwapCache(page), page);
   VM_BUG_ON_PAGE(!PageLocked(page), page);
   VM_BUG_ON_PAGE(PageUptodate(page), page);
 
-  q = sswap_rdma_get_queue(smp_processor_id(), QP_READ_SYNC);
+  q = sswap_rdma_get_queue(raddr_server(raddr), smp_processor_id(),
+                           QP_READ_SYNC);
   //raddr_block = raddr >> BLOCK_SHIFT;
   //raddr_block = raddr_block << BLOCK_SHIFT;
   //rkey = get_rkey(raddr_block);
@@ -891,49 +3080,315 @@ int sswap_rdma_read_sync(struct page *page, u64 roffset)
     //pr_err("read_sync:remote address(%p) is invalid.\n", (void*)raddr);
     //return -1;
   //}
-  ret = begin_read(q, page, raddr/*, rkey*/);
+  bounce = read_bounce(roffset);
+  ret = begin_read(q, page, raddr/*, rkey*/, bounce,
+                   rpage_clen(roffset) ?: PAGE_SIZE, idx);
+  if (unlikely(ret)) {
+    compact_read_unlock(idx);
+    if (bounce)
+      mempool_free(bounce, cz_page_pool);
+  }
 
   return ret;
 }
 EXPORT_SYMBOL(sswap_rdma_read_sync);
 
+static void compact_io_done(struct compact_batch *b)
+{
+  if (atomic_dec_and_test(&b->remaining))
+    complete(&b->done);
+}
+
+/* posts the read of page i of b from its old remote page, or the write of
+ * it to its new one, on the queue of its server */
+static int compact_post(struct compact_batch *b, int i, bool write)
+{
+  enum dma_data_direction dir = write ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+  u64 raddr = write ? b->to[i] : b->from[i];
+  struct rdma_queue *q;
+  struct rdma_req *req;
+  int ret;
+
+  q = sswap_rdma_get_queue(raddr_server(raddr), raw_smp_processor_id(),
+                           write ? QP_WRITE_SYNC : QP_READ_ASYNC);
+
+  if (write)
+    get_write_credits(q, 1);
+  else
+    get_read_credits(q, 1);
+
+  spin_lock(&q->sq_lock);
+  ret = get_req_for_page(q, &req, b->pages[i], dir);
+  if (unlikely(ret))
+    goto out_unlock;
+
+  req->move = b;
+  req->roffset = b->roffsets[i];
+  req->cqe.done = write ? sswap_rdma_write_done : sswap_rdma_read_done;
+  ret = sswap_rdma_prep_rdma(q, 0, req, raddr,
+                             write ? IB_WR_RDMA_WRITE : IB_WR_RDMA_READ);
+  if (unlikely(ret)) {
+    put_reqs(q, 1, dir);
+    goto out_unlock;
+  }
+
+  ret = sswap_rdma_post_chain(q, 1);
+  if (unlikely(ret))
+    put_reqs(q, 1, dir);
+  else if (write)
+    /* signaled, so it retires the unsignaled writes before it too */
+    q->unsignaled = 0;
+
+out_unlock:
+  spin_unlock(&q->sq_lock);
+  if (unlikely(ret))
+    put_credits(q, 1);
+  else if (!write && READ_ONCE(q->polled))
+    sswap_rdma_poll_async(q, ASYNC_POLL_BUDGET);
+  return ret;
+}
+
+/* reads all pages of b from their old remote pages, or writes them to
+ * their new ones, and waits until that is done. -EIO if any failed */
+static int compact_copy(struct compact_batch *b, bool write)
+{
+  int i;
+
+  b->failed = false;
+  reinit_completion(&b->done);
+  atomic_set(&b->remaining, b->n + 1);
+  for (i = 0; i < b->n; i++) {
+    if (compact_post(b, i, write)) {
+      b->failed = true;
+      compact_io_done(b);
+    }
+  }
+  compact_io_done(b);
+  wait_for_completion(&b->done);
+
+  return b->failed ? -EIO : 0;
+}
+
+/* moves the pages of b, whose entries have the moving bit set. once the
+ * new pages hold the contents the entries point to them, which lets go of
+ * the bit, and the old pages wait for the next pass to be freed. a write
+ * or a free of an offset meanwhile takes the bit off its entry, and the
+ * copy of that page is dropped. so is every copy if one of them failed */
+static void compact_flush(struct compact_batch *b)
+{
+  u64 *entry, from;
+  bool ok;
+  int i;
+
+  ok = !compact_copy(b, false) && !compact_copy(b, true);
+  for (i = 0; i < b->n; i++) {
+    entry = rpage_entry_ptr(b->roffsets[i]);
+    from = b->from[i] | (1UL << RPAGE_MOVING_BIT);
+    if (ok && cmpxchg(entry, from, b->to[i]) == from) {
+      compact_set_owner(b->to[i], b->roffsets[i]);
+      compact.pages[compact.npages++] = b->from[i];
+      atomic64_inc(&compact_moved);
+    } else {
+      if (!ok)
+        cmpxchg(entry, from, b->from[i]);
+      free_remote_page(b->to[i]);
+      atomic64_inc(&compact_aborted);
+    }
+  }
+  b->n = 0;
+}
+
+/* one compaction pass: picks sparse blocks of the servers that are up and
+ * moves their pages, whose offsets it finds in the reverse map. pages that
+ * are being written, or freed, are left where they are. returns false if
+ * it picked no blocks */
+static bool compact_pass(void)
+{
+  struct compact_batch *b = &compact.batch;
+  u32 budget, picked, s, i, p;
+  u64 roffset, from, to;
+  u32 *owners;
+
+  budget = clamp(READ_ONCE(compact_mbps), 0,
+                 COMPACT_MAX_PAGES >> (MB_SHIFT - PAGE_SHIFT));
+  budget <<= MB_SHIFT - PAGE_SHIFT;
+  picked = budget;
+  for (s = 0; s < nservers && compact.nblocks < COMPACT_MAX_BLOCKS; s++)
+    if (!test_bit(s, servers_down))
+      compact.nblocks += compact_pick(s, compact.blocks + compact.nblocks,
+                                      COMPACT_MAX_BLOCKS - compact.nblocks,
+                                      &budget);
+  picked -= budget;
+  if (!compact.nblocks)
+    return false;
+  /* pages of the blocks parked in magazines count as used */
+  compact_drain_magazines();
+
+  for (i = 0; i < compact.nblocks && picked; i++) {
+    owners = READ_ONCE(compact_owners[raddr_block_idx(compact.blocks[i])]);
+    if (!owners)
+      continue;
+    for (p = 0; p < COMPACT_BLOCK_PAGES && picked; p++) {
+      from = compact.blocks[i] + ((u64)p << PAGE_SHIFT);
+      roffset = READ_ONCE(owners[p]);
+      if (rpage_entry(roffset) != from)
+        continue;
+      picked--;
+
+      to = alloc_remote_page(raddr_server(from));
+      if (!to) {
+        picked = 0;
+        break;
+      }
+      /* a write or a free may have come in since */
+      if (cmpxchg(rpage_entry_ptr(roffset), from,
+                  from | (1UL << RPAGE_MOVING_BIT)) != from) {
+        free_remote_page(to);
+        continue;
+      }
+      b->roffsets[b->n] = roffset;
+      b->from[b->n] = from;
+      b->to[b->n] = to;
+      if (++b->n == COMPACT_BATCH)
+        compact_flush(b);
+    }
+    cond_resched();
+  }
+  if (b->n)
+    compact_flush(b);
+  return true;
+}
+
+/* frees the pages the last pass moved out of its blocks, and puts the
+ * blocks back. the emptied ones go on to gc */
+static void compact_retire(void)
+{
+  if (compact.npages)
+    compact_free_pages(compact.pages, compact.npages);
+  compact_end(compact.blocks, compact.nblocks);
+  compact.npages = 0;
+  compact.nblocks = 0;
+}
+
+static int compact_fn(void *data)
+{
+  while (!kthread_should_stop()) {
+    if (READ_ONCE(compact_mbps) > 0 && compact_pass()) {
+      /* reads that found an old page in the map have completed after
+       * this */
+      synchronize_srcu(&compact_srcu);
+      compact_retire();
+    }
+    schedule_timeout_interruptible(msecs_to_jiffies(COMPACT_INTERVAL));
+  }
+  return 0;
+}
+
+static void sswap_compact_destroy(void)
+{
+  int i;
+
+  if (compact_task)
+    kthread_stop(compact_task);
+  compact_task = NULL;
+  for (i = 0; i < COMPACT_BATCH; i++) {
+    if (compact.batch.pages[i])
+      __free_page(compact.batch.pages[i]);
+    compact.batch.pages[i] = NULL;
+  }
+  vfree(compact.pages);
+  compact.pages = NULL;
+  if (compact_owners)
+    for (i = 0; i < max_table_blocks; i++)
+      kfree(compact_owners[i]);
+  vfree(compact_owners);
+  compact_owners = NULL;
+}
+
+static int sswap_compact_setup(void)
+{
+  int i;
+
+  compact.pages = vmalloc(COMPACT_MAX_PAGES * sizeof(u64));
+  compact_owners = vzalloc(max_table_blocks * sizeof(*compact_owners));
+  if (!compact.pages || !compact_owners)
+    goto out_nomem;
+  for (i = 0; i < COMPACT_BATCH; i++) {
+    compact.batch.pages[i] = alloc_page(GFP_KERNEL);
+    if (!compact.batch.pages[i])
+      goto out_nomem;
+  }
+  init_completion(&compact.batch.done);
+
+  compact_task = kthread_run(compact_fn, NULL, "rblock_compact");
+  if (IS_ERR(compact_task)) {
+    pr_err("cannot start the compaction thread\n");
+    i = PTR_ERR(compact_task);
+    compact_task = NULL;
+    sswap_compact_destroy();
+    return i;
+  }
+  return 0;
+
+out_nomem:
+  sswap_compact_destroy();
+  return -ENOMEM;
+}
+
 int sswap_rdma_poll_load(int cpu)
 {
-  struct rdma_queue *q = sswap_rdma_get_queue(cpu, QP_READ_SYNC);
-  return drain_queue(q);
+  struct rdma_queue *q, *aq;
+  int server;
+
+  /* the sync read went to the server of its page, the other queues are
+   * empty and return right away */
+  for (server = 0; server < nservers; server++) {
+    q = sswap_rdma_get_queue(server, cpu, QP_READ_SYNC);
+    aq = sswap_rdma_get_queue(server, cpu, QP_READ_ASYNC);
+
+    /* the fault usually waits on readahead from the async queue next, so
+     * reap it here rather than wait for poll_timer */
+    if (READ_ONCE(aq->polled))
+      sswap_rdma_poll_async(aq, ASYNC_POLL_BUDGET);
+    drain_queue(q);
+  }
+  return 1;
 }
 EXPORT_SYMBOL(sswap_rdma_poll_load);
 
 /* idx is absolute id (i.e. > than number of cpus) */
 inline enum qp_type get_queue_type(unsigned int idx)
 {
-  // numcpus = 8
-  if (idx < numcpus)
-    return QP_READ_SYNC;
-  else if (idx < numcpus * 2)
-    return QP_READ_ASYNC;
-  else if (idx < numcpus * 3)
-    return QP_WRITE_SYNC;
+  switch (idx / queues_per_type) {
+    case 0:
+      return QP_READ_SYNC;
+    case 1:
+      return QP_READ_ASYNC;
+    case 2:
+      return QP_WRITE_SYNC;
+  }
 
   BUG();
   return QP_READ_SYNC;
 }
 
-inline struct rdma_queue *sswap_rdma_get_queue(unsigned int cpuid,
+inline struct rdma_queue *sswap_rdma_get_queue(unsigned int server,
+					       unsigned int cpuid,
 					       enum qp_type type)
 {
-  BUG_ON(gctrl == NULL);
+  unsigned int k;
 
-  switch (type) {
-    case QP_READ_SYNC:
-      return &gctrl->queues[cpuid];
-    case QP_READ_ASYNC:
-      return &gctrl->queues[cpuid + numcpus];
-    case QP_WRITE_SYNC:
-      return &gctrl->queues[cpuid + numcpus * 2];
-    default:
-      BUG();
-  };
+  BUG_ON(server >= nservers || gctrls[server] == NULL);
+  BUG_ON(type > QP_WRITE_SYNC);
+
+  /* a sync read is drained by its cpu right after it is posted, so it
+   * needs a fixed qp. everything else round robins over the set */
+  if (type == QP_READ_SYNC || qps == 1)
+    k = cpuid % qps;
+  else
+    k = this_cpu_inc_return(qp_rr) % qps;
+
+  return &gctrls[server]->queues[(type * qsets + cpu_to_set(cpuid)) * qps + k];
 }
 
 void swap_pages_timer_callback(struct timer_list *timer) {
@@ -944,6 +3399,24 @@ void swap_pages_timer_callback(struct timer_list *timer) {
 
   pr_info("used swap memory = %d MB, current alloc memory = %d MB\n", (num_swap_pages_tmp >> (MB_SHIFT - PAGE_SHIFT)), ((num_alloc_blocks_tmp - num_free_blocks_tmp) << (BLOCK_SHIFT - MB_SHIFT)));
   pr_info("num_alloc_blocks = %d, num_free_blocks = %d, num_free_fail = %d\n", num_alloc_blocks_tmp, num_free_blocks_tmp, num_free_fail_tmp);
+  pr_info("blocks stolen from other cpus = %d, block fetches that found none = %d\n",
+          atomic_read(&num_fetch_steal), atomic_read(&num_fetch_empty));
+  pr_info("same filled pages = %d, offset map = %d KB\n",
+          atomic_read(&num_filled_pages),
+          (atomic_read(&num_map_leaves) << (PAGE_SHIFT - 10)) +
+          atomic_read(&num_clen_leaves) * (int)(RPAGE_CLEN_LEAF_SIZE >> 10));
+  if (dedup)
+    pr_info("dedup: %d of %d stored pages share a remote page, %lld writes saved\n",
+            atomic_read(&dedup_shared),
+            num_swap_pages_tmp + atomic_read(&dedup_shared),
+            atomic64_read(&dedup_hits));
+  if (compress)
+    pr_info("compressed stores = %lld (%lld MB), stored whole = %lld\n",
+            atomic64_read(&cz_stored), atomic64_read(&cz_bytes) >> MB_SHIFT,
+            atomic64_read(&cz_whole));
+  if (compact_task)
+    pr_info("compaction: pages moved = %lld, moves given up = %lld\n",
+            atomic64_read(&compact_moved), atomic64_read(&compact_aborted));
   mod_timer(timer, jiffies + msecs_to_jiffies(swap_pages_print_interval)); 
 }
 
@@ -1004,47 +3477,164 @@ static int sswap_rdma_write_read_test(void)
   return 0;
 }*/
 
+/* connects to every server of the sip list, server ids follow the order of
+ * the list */
+static int sswap_rdma_create_ctrls(void)
+{
+  char *list = serverip, *entry, *port;
+  int ret, p;
+
+  while ((entry = strsep(&list, ",")) != NULL) {
+    if (!*entry)
+      continue;
+    if (nservers == max_servers) {
+      pr_err("at most %d servers\n", max_servers);
+      ret = -EINVAL;
+      goto out_destroy;
+    }
+
+    p = serverport;
+    port = strchr(entry, ':');
+    if (port) {
+      *port++ = '\0';
+      if (kstrtoint(port, 10, &p)) {
+        pr_err("bad port %s\n", port);
+        ret = -EINVAL;
+        goto out_destroy;
+      }
+    }
+
+    ret = sswap_rdma_create_ctrl(&gctrls[nservers], entry, p);
+    if (ret) {
+      pr_err("could not create ctrl for %s:%d\n", entry, p);
+      if (gctrls[nservers]) {
+        kfree(gctrls[nservers]->queues);
+        kfree(gctrls[nservers]);
+        gctrls[nservers] = NULL;
+      }
+      goto out_destroy;
+    }
+
+    gctrls[nservers]->id = nservers;
+    ret = sswap_rdma_recv_remotemr_fake(gctrls[nservers]);
+    if (ret) {
+      pr_err("could not setup remote memory region\n");
+      goto out_destroy;
+    }
+    nservers++;
+  }
+
+  if (!nservers) {
+    pr_err("no server given in sip\n");
+    return -EINVAL;
+  }
+  return 0;
+
+out_destroy:
+  sswap_rdma_destroy_ctrls();
+  return ret;
+}
+
+static int sswap_rdma_parse_placement(void)
+{
+  char *list = sweight, *entry;
+  int i;
+
+  if (!strcmp(placement, "rr"))
+    place_policy = PLACE_RR;
+  else if (!strcmp(placement, "weighted"))
+    place_policy = PLACE_WEIGHTED;
+  else if (!strcmp(placement, "hash"))
+    place_policy = PLACE_HASH;
+  else {
+    pr_err("unknown placement %s\n", placement);
+    return -EINVAL;
+  }
+
+  if (stripe < 1) {
+    pr_err("stripe must be at least 1\n");
+    return -EINVAL;
+  }
+
+  /* missing weights count as 1 */
+  for (i = 0; i < max_servers; i++)
+    weights[i] = 1;
+  for (i = 0; (entry = strsep(&list, ",")) != NULL && i < max_servers; i++) {
+    if (*entry && kstrtou32(entry, 10, &weights[i])) {
+      pr_err("bad weight %s\n", entry);
+      return -EINVAL;
+    }
+  }
+  return 0;
+}
+
 static int __init sswap_rdma_init_module(void)
 {
   int ret;
   int i = 0;
 
+  /* the request rings hold QP_MAX_SEND_WR of these per queue */
+  BUILD_BUG_ON(sizeof(struct rdma_req) > SMP_CACHE_BYTES);
+
   pr_info("start: %s\n", __FUNCTION__);
   pr_info("* RDMA BACKEND *");
 
   numcpus = num_online_cpus();
-  numqueues = numcpus * 3;
-
-  req_cache = kmem_cache_create("sswap_req_cache", sizeof(struct rdma_req), 0,
-                      SLAB_TEMPORARY | SLAB_HWCACHE_ALIGN, NULL);
-
-  if (!req_cache) {
-    pr_err("no memory for cache allocation\n");
-    return -ENOMEM;
+  if (qsets <= 0)
+    qsets = numcpus;
+  qsets = min_t(int, qsets, nr_cpu_ids);
+  if (qps < 1) {
+    pr_err("qps must be at least 1\n");
+    return -EINVAL;
   }
+  queues_per_type = qsets * qps;
+  numqueues = queues_per_type * 3;
+  pr_info("%d queue sets of %d qps per direction, %d queues total\n",
+          qsets, qps, numqueues);
+
+  ret = sswap_rdma_parse_placement();
+  if (ret)
+    return ret;
 
   ib_register_client(&sswap_rdma_ib_client);
-  ret = sswap_rdma_create_ctrl(&gctrl);
+  ret = sswap_rdma_create_ctrls();
   if (ret) {
-    pr_err("could not create ctrl\n");
     ib_unregister_client(&sswap_rdma_ib_client);
     return -ENODEV;
   }
 
-  ret = sswap_rdma_recv_remotemr_fake(gctrl);
+  weight_sum = 0;
+  for (i = 0; i < nservers; i++)
+    weight_sum += weights[i];
+  if (place_policy == PLACE_WEIGHTED && !weight_sum) {
+    pr_err("all server weights are 0\n");
+    sswap_rdma_destroy_ctrls();
+    ib_unregister_client(&sswap_rdma_ib_client);
+    return -EINVAL;
+  }
+  pr_info("%d servers, placement %s, stripe %d pages\n", nservers,
+          placement, stripe);
+
+  if (ec_k)
+    ret = sswap_ec_setup();
+  if (!ret && compress)
+    ret = sswap_cz_setup();
+  if (!ret && dedup)
+    ret = sswap_dedup_setup();
+  /* only plain pages can be moved */
+  if (!ret && !ec_k && !compress && !dedup)
+    ret = sswap_compact_setup();
   if (ret) {
-    pr_err("could not setup remote memory region\n");
+    sswap_cz_destroy();
+    sswap_ec_destroy();
+    sswap_rdma_destroy_ctrls();
     ib_unregister_client(&sswap_rdma_ib_client);
-    return -ENODEV;
+    return ret;
   }
 
   for(i = 0;i < num_groups; ++i) {
     spin_lock_init(locks + i);
   }
-  
-  for(i = 0;i < num_pages_total; ++i) {
-    offset_to_rpage_addr[i] = 0; 
-  }
 
   //ret = sswap_rdma_write_read_test();
   //if(ret) {
@@ -13,15 +13,35 @@
 #include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/timer.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/irq_poll.h>
 
 #define num_groups 8
 // #define print_interval (256 * 1024)
 #define num_pages_total  (addr_space >> PAGE_SHIFT)
 #define swap_pages_print_interval 2000
 
+/* offset map entries are remote addresses of pages or of slots
+ * of compressed pages, at least 1 << min_slot_shift aligned, so the low
+ * bits are free to carry per-page state. the top bits hold the id of the
+ * server the page is on, see RADDR_SERVER_SHIFT */
+#define RPAGE_WRITEBACK_BIT 0 /* an RDMA write of the page is in flight */
+/* the compactor is moving the page to another remote page. a write or a
+ * free of the offset takes the bit off, which aborts the move, and reads
+ * go on with the old page */
+#define RPAGE_MOVING_BIT 1
+/* the page is one 32 bit value repeated and has no remote copy, the value
+ * is in the top half of the entry */
+#define RPAGE_FILLED_BIT 4
+#define RPAGE_FLAGS_MASK ((1UL << min_slot_shift) - 1)
+
 extern atomic_t num_alloc_blocks;
 extern atomic_t num_free_blocks;
 extern atomic_t num_free_fail;
+extern atomic_t num_fetch_steal;
+extern atomic_t num_fetch_empty;
 
 enum qp_type {
   QP_READ_SYNC,
@@ -32,15 +52,42 @@ enum qp_type {
 struct sswap_rdma_dev {
   struct ib_device *dev;
   struct ib_pd *pd;
+  /* dma addresses of the device are physical addresses, so pages are
+   * used through page_to_phys instead of being mapped per transfer */
+  bool identity_dma;
 };
 
+/* max number of wrs posted with a single doorbell */
+#define RDMA_MAX_CHAIN 16
+/* max number of remotely contiguous pages async reads fetch with one wr */
+#define RDMA_MAX_SGE 8
+
+/* a slot of a queue's request ring, one cache line each so completions
+ * on one cpu don't bounce the slots being filled on another */
+struct ec_io;
+struct dedup_entry;
+struct compact_batch;
+
 struct rdma_req {
-  struct completion done;
-  struct list_head list;
   struct ib_cqe cqe;
   u64 dma;
+  u32 len; /* bytes of page mapped at dma */
+  /* reads of swapped out pages hold compact_srcu from looking up the
+   * remote page until they complete */
+  int srcu_idx;
   struct page *page;
-};
+  u64 roffset;
+  /* ec_k and the compactor never run together, so a req is at most one
+   * of these. NULL for plain pages */
+  union {
+    struct ec_io *ec; /* fragment of an erasure coded page */
+    struct compact_batch *move; /* a copy of the compactor */
+  };
+  /* what the dma really goes to when page is stored compressed */
+  struct page *bounce;
+  /* the write makes this remote page shareable when it completes */
+  struct dedup_entry *dedup;
+} ____cacheline_aligned_in_smp;
 
 struct sswap_rdma_ctrl;
 
@@ -57,6 +104,43 @@ struct rdma_queue {
   struct completion cm_done;
 
   atomic_t pending;
+  /* writers sleep here when the send queue has no free slots */
+  wait_queue_head_t credit_wait;
+
+  /* request ring of QP_MAX_SEND_WR slots. slots are handed out at head in
+   * posting order and come back at tail in completion order, which for an
+   * RC qp is the same order */
+  struct rdma_req *reqs;
+  spinlock_t sq_lock; /* serializes handing out slots and posting */
+  u32 head; /* under sq_lock */
+  u32 tail; /* only touched by the completion handler */
+  /* a write of this qp failed, which leaves the qp in error: every write
+   * retired from then on failed too. only touched by the completion
+   * handler */
+  bool write_failed;
+
+  /* write queues only signal every WRITE_SIGNAL_INTERVAL-th wr. writes
+   * posted since the last signaled one, under sq_lock */
+  u32 unsignaled;
+  /* signals the tail of the queue when no signaled write follows it */
+  struct delayed_work flush_work;
+
+  /* async read queues are reaped by interrupts at low completion rates
+   * and by polling at high ones, see sswap_rdma_async_poll */
+  struct irq_poll iop;
+  bool polled; /* cq is not armed, reaped by poll_timer and submitters */
+  struct hrtimer poll_timer;
+  u64 window_start; /* completion rate window, under cq_lock */
+  u32 window_comps;
+  struct ib_wc wcs[16]; /* under cq_lock */
+
+  /* sges a wr of this qp can take, more than one only for async reads */
+  u32 max_sge;
+
+  /* wrs of the chain being posted, under sq_lock. a wr with several sges
+   * uses the ones following its own */
+  struct ib_rdma_wr wrs[RDMA_MAX_CHAIN];
+  struct ib_sge sges[RDMA_MAX_CHAIN];
 };
 
 struct sswap_rdma_memregion {
@@ -65,6 +149,7 @@ struct sswap_rdma_memregion {
 };
 
 struct sswap_rdma_ctrl {
+  int id; /* server id, its position in the sip list */
   struct sswap_rdma_dev *rdev; // TODO: move this to queue
   struct rdma_queue *queues;
   struct sswap_rdma_memregion servermr;
@@ -84,13 +169,56 @@ struct timer_list swap_pages_timer;
 
 atomic_t num_swap_pages = ATOMIC_INIT(0);
 spinlock_t locks[num_groups];
-u64 offset_to_rpage_addr[num_pages_total] = {0};
 
-struct rdma_queue *sswap_rdma_get_queue(unsigned int idx, enum qp_type type);
+/* the offset map, a directory of leaves of RPAGE_LEAF_ENTRIES entries,
+ * one page each. a leaf comes in when an offset in it is first stored and
+ * stays until unload, so the map grows with the part of the swap space in
+ * use rather than with addr_space. offsets without a leaf read as 0 */
+#define RPAGE_LEAF_SHIFT (PAGE_SHIFT - 3)
+#define RPAGE_LEAF_ENTRIES (1UL << RPAGE_LEAF_SHIFT)
+#define RPAGE_NUM_LEAVES DIV_ROUND_UP(num_pages_total, RPAGE_LEAF_ENTRIES)
+u64 *offset_map[RPAGE_NUM_LEAVES];
+
+static inline u64 rpage_entry(u64 roffset)
+{
+  u64 *leaf = READ_ONCE(offset_map[roffset >> RPAGE_LEAF_SHIFT]);
+
+  return leaf ? READ_ONCE(leaf[roffset & (RPAGE_LEAF_ENTRIES - 1)]) : 0;
+}
+
+/* the entry of an offset that has been stored, for updating it */
+static inline u64 *rpage_entry_ptr(u64 roffset)
+{
+  u64 *leaf = READ_ONCE(offset_map[roffset >> RPAGE_LEAF_SHIFT]);
+
+  BUG_ON(!leaf);
+  return &leaf[roffset & (RPAGE_LEAF_ENTRIES - 1)];
+}
+
+static inline void rpage_set_entry(u64 roffset, u64 entry)
+{
+  WRITE_ONCE(*rpage_entry_ptr(roffset), entry);
+}
+
+static inline u64 rpage_addr(u64 entry)
+{
+  return entry & ~RPAGE_FLAGS_MASK;
+}
+
+static inline bool rpage_filled(u64 entry)
+{
+  return entry & (1UL << RPAGE_FILLED_BIT);
+}
+
+struct rdma_queue *sswap_rdma_get_queue(unsigned int server,
+                                        unsigned int idx, enum qp_type type);
 enum qp_type get_queue_type(unsigned int idx);
 int sswap_rdma_read_async(struct page *page, u64 roffset);
+int sswap_rdma_read_async_batch(struct page **pages, pgoff_t *roffsets, int nr);
 int sswap_rdma_read_sync(struct page *page, u64 roffset);
 int sswap_rdma_write(struct page *page, u64 roffset);
+int sswap_rdma_write_filled(u64 roffset, u64 value);
+void sswap_rdma_set_write_end(void (*fn)(struct page *page, bool ok));
 int sswap_rdma_poll_load(int cpu);
 void sswap_rdma_free_page(u64 roffset);
 
@@ -11,6 +11,10 @@
 #include <linux/vmalloc.h>
 #include <linux/smp.h>
 #include <linux/delay.h>
+#include <linux/percpu.h>
+#include <linux/sort.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
 
 atomic_t num_alloc_blocks = ATOMIC_INIT(0);
 EXPORT_SYMBOL(num_alloc_blocks);
@@ -21,12 +25,97 @@ EXPORT_SYMBOL(num_free_blocks);
 atomic_t num_free_fail = ATOMIC_INIT(0);
 EXPORT_SYMBOL(num_free_fail);
 
+atomic_t num_fetch_steal = ATOMIC_INIT(0);
+EXPORT_SYMBOL(num_fetch_steal);
+
+atomic_t num_fetch_empty = ATOMIC_INIT(0);
+EXPORT_SYMBOL(num_fetch_empty);
+
+struct block_info *block_table[max_table_blocks];
+EXPORT_SYMBOL(block_table);
+static DECLARE_BITMAP(block_table_used, max_table_blocks);
+static DEFINE_SPINLOCK(block_table_lock);
+static u32 block_table_hint;
+
+// per cpu magazines of pages taken from the blocks of each server, so most
+// allocations and frees touch no lock. refills and drains move mag_batch
+// pages at a time
+struct rpage_magazines {
+    struct rpage_magazine s[max_servers];
+};
+static DEFINE_PER_CPU(struct rpage_magazines, magazines);
+
+// the kernel side of a pair of shm rings. blocks are taken off the alloc
+// ring ahead of time by refill_task, so that fetch_cache finds one in the
+// kernel instead of waiting for the daemon. several cpus may share the
+// rings, and other cpus and refill_task take from them too: lock makes
+// them a single consumer of the alloc ring, free_lock a single producer
+// of the free ring. the other side's index is cached so the shared lines
+// are only read when the cached one runs out
+struct block_reserve {
+    spinlock_t lock;
+    u32 n;
+    struct cpu_cache_block items[reserve_size];
+    struct cpu_cache_ring *alloc_ring;
+    struct cpu_cache_block *alloc_items;
+    u32 alloc_head;
+    u32 alloc_tail; // last tail seen
+
+    spinlock_t free_lock ____cacheline_aligned_in_smp;
+    struct cpu_cache_ring *free_ring;
+    u64 *free_items;
+    u32 free_tail;
+    u32 free_head; // last head seen
+} ____cacheline_aligned_in_smp;
+static struct block_reserve *reserves;
+// copied from the header once it is checked, the daemon may scribble on it
+static u32 nr_rings, alloc_mask, free_mask;
+static struct task_struct *refill_task;
+
+// blocks of a free list with all their pages free. gc_task moves them off
+// the free list, so the list only holds blocks that are partly in use and
+// gc finds the empty ones without walking anything. alloc_remote_block
+// takes from here before it fetches a new block. under the free list's lock
+struct empty_blocks {
+    struct list_head list;
+    u32 n;
+    u32 low; // fewest there were since gc last gave any back
+};
+static struct empty_blocks empty_blocks[max_servers][num_free_lists];
+// blocks that became empty since the last gc pass, see gc_take_empty
+static LLIST_HEAD(gc_candidates);
+static struct task_struct *gc_task;
+
+// takes a free index of block_table, or returns -1 if there is none
+static int block_table_get(void) {
+    u32 idx;
+
+    spin_lock(&block_table_lock);
+    idx = find_next_zero_bit(block_table_used, max_table_blocks, block_table_hint);
+    if(idx == max_table_blocks)
+        idx = find_first_zero_bit(block_table_used, max_table_blocks);
+    if(idx < max_table_blocks) {
+        set_bit(idx, block_table_used);
+        block_table_hint = idx + 1;
+    }
+    spin_unlock(&block_table_lock);
+
+    return idx < max_table_blocks ? idx : -1;
+}
+
+static void block_table_put(u32 idx) {
+    WRITE_ONCE(block_table[idx], NULL);
+    spin_lock(&block_table_lock);
+    clear_bit(idx, block_table_used);
+    spin_unlock(&block_table_lock);
+}
+
 u32 get_rkey(u64 raddr) {
     struct block_info *bi = NULL;
     
     BUG_ON((raddr & ((1 << BLOCK_SHIFT) - 1)) != 0);
 
-    bi = rhashtable_lookup_fast(blocks_map, &raddr, blocks_map_params);
+    bi = raddr_to_block(raddr);
     if(!bi/* || bi->rkey == 0*/) {
         pr_err("cannot get rkey(with remote address:%p)\n", (void*)raddr);
         return 0;
@@ -36,7 +125,9 @@ u32 get_rkey(u64 raddr) {
 EXPORT_SYMBOL(get_rkey);
 
 void cpu_cache_dump(void) {
-    pr_info("cpu_cache_ block_size = %lld\n", cpu_cache_->block_size);
+    pr_info("cpu_cache_ version = %u, block_size = %lld, rings = %u, alloc slots = %u, free slots = %u\n",
+            cpu_cache_->version, cpu_cache_->block_size, cpu_cache_->nr_rings,
+            cpu_cache_->alloc_slots, cpu_cache_->free_slots);
 }
 EXPORT_SYMBOL(cpu_cache_dump);
 
@@ -91,7 +182,7 @@ int cpu_cache_init(void) {
     }
     // return 0;
 
-    cpu_cache_ = (struct cpu_cache_storage *) vmap(pages_, addr_space_->nrpages, VM_MAP, PAGE_KERNEL);
+    cpu_cache_ = (struct cpu_cache_header *) vmap(pages_, i, VM_MAP, PAGE_KERNEL);
     if(cpu_cache_ == NULL) {
         pr_err("Bad v-mapping for cpu_cache_\n");
         kfree(pages_);
@@ -99,331 +190,998 @@ int cpu_cache_init(void) {
     }
 
     pr_info("cpu_cache_ address is %p\n", (void*)cpu_cache_);
-
     kfree(pages_);
+
+    // the daemon writes the header before it feeds any block, a file of an
+    // older daemon has no header at all
+    if(cpu_cache_check(cpu_cache_, (u64)i << PAGE_SHIFT) || cpu_cache_->block_size != rblock_size) {
+        pr_err("cpu_cache has no usable version %u header, restart the block provider\n", CPU_CACHE_VERSION);
+        cpu_cache_delete();
+        cpu_cache_ = NULL;
+        return -1;
+    }
+    nr_rings = cpu_cache_->nr_rings;
+    alloc_mask = cpu_cache_->alloc_slots - 1;
+    free_mask = cpu_cache_->free_slots - 1;
+
     return 0;
 }
 EXPORT_SYMBOL(cpu_cache_init);
 
-u32 get_length_fetch(u32 nproc) {
-    u32 writer = cpu_cache_->writer[nproc];
-    u32 reader = cpu_cache_->reader[nproc];
-    if (writer == reader) {
+// takes up to max blocks off r's alloc ring, without waiting for the
+// provider. returns how many were taken. callers hold r->lock
+static u32 ring_pop(struct block_reserve *r, struct cpu_cache_block *out, u32 max) {
+    u32 n, i;
+
+    if(r->alloc_tail == r->alloc_head)
+        r->alloc_tail = smp_load_acquire(&r->alloc_ring->tail);
+    n = r->alloc_tail - r->alloc_head;
+    if(n > alloc_mask + 1) {
+        pr_err_ratelimited("alloc ring overrun: head %u, tail %u\n", r->alloc_head, r->alloc_tail);
+        r->alloc_tail = r->alloc_head;
         return 0;
     }
-    if (writer > reader) {
-        return (writer - reader);
-    } else {
-        return (max_alloc_item - reader + writer);
+    n = min(n, max);
+
+    for(i = 0; i < n; ++i)
+        out[i] = r->alloc_items[(r->alloc_head + i) & alloc_mask];
+    if(n) {
+        r->alloc_head += n;
+        smp_store_release(&r->alloc_ring->head, r->alloc_head);
     }
+    return n;
 }
 
-u32 get_length_free(u32 nproc) {
-    u32 writer = cpu_cache_->free_writer[nproc];
-    u32 reader = cpu_cache_->free_reader[nproc];
-    if (writer == reader) {
-        return 0;
-    }
-    if (writer > reader) {
-        return (writer - reader);
-    } else {
-        return (max_free_item - reader + writer);
+// whether r has blocks, without taking its lock
+static bool reserve_empty(struct block_reserve *r) {
+    return !READ_ONCE(r->n) && READ_ONCE(r->alloc_ring->tail) == READ_ONCE(r->alloc_head);
+}
+
+// moves blocks from r's alloc ring into r until it holds high of them or
+// the ring is empty. returns how many were moved
+static u32 reserve_fill(struct block_reserve *r, u32 high) {
+    u32 got = 0;
+
+    spin_lock(&r->lock);
+    if(r->n < high) {
+        got = ring_pop(r, r->items + r->n, high - r->n);
+        r->n += got;
     }
+    spin_unlock(&r->lock);
+
+    return got;
 }
 
-int fetch_cache(u64 *raddr, u32 *rkey) {
-    u32 nproc = raw_smp_processor_id();
-    u32 reader;
-    // struct raddr_rkey fetch_one;
+// takes a block out of r, or straight off its alloc ring when r is empty.
+// the reserves of other cpus are only tried, a busy one is skipped rather
+// than waited for
+static bool reserve_pop(struct block_reserve *r, struct cpu_cache_block *item, bool own) {
+    bool found = false;
 
-    BUG_ON(nproc > nprocs);
+    if(!own && reserve_empty(r))
+        return false;
 
-    reader = cpu_cache_->reader[nproc];
-    BUG_ON(reader >= max_alloc_item);
+    if(own)
+        spin_lock(&r->lock);
+    else if(!spin_trylock(&r->lock))
+        return false;
 
-    while(get_length_fetch(nproc) == 0) ;
-    cpu_cache_->reader[nproc] = (cpu_cache_->reader[nproc] + 1) % max_alloc_item;
+    if(r->n) {
+        *item = r->items[--r->n];
+        found = true;
+    } else {
+        found = ring_pop(r, item, 1);
+    }
+    if(r->n < reserve_low && refill_task)
+        wake_up_process(refill_task);
+    spin_unlock(&r->lock);
+
+    return found;
+}
+
+// hands out a block for this cpu. it comes from this cpu's reserve if
+// there is one, from another cpu's reserve or ring otherwise. never waits
+// on the daemon, -EAGAIN means that no block has been produced yet
+int fetch_cache(u64 *raddr, u32 *rkey, u32 *server) {
+    u32 own = raw_smp_processor_id() % nr_rings;
+    struct cpu_cache_block item;
+    bool found = false;
+    u32 i;
+
+    for(i = 0; i < nr_rings && !found; ++i)
+        found = reserve_pop(reserves + (own + i) % nr_rings, &item, i == 0);
+    if(!found) {
+        atomic_inc(&num_fetch_empty);
+        return -EAGAIN;
+    }
+    if(i > 1)
+        atomic_inc(&num_fetch_steal);
+
+    *raddr = item.addr;
+    *rkey = item.rkey;
+    *server = item.server;
 
-    while(cpu_cache_->items[nproc][reader].addr == -1 || cpu_cache_->items[nproc][reader].rkey == -1) ;
-    
-    *raddr = cpu_cache_->items[nproc][reader].addr;
-    *rkey = cpu_cache_->items[nproc][reader].rkey;
-    
     BUG_ON(*raddr == 0);
     BUG_ON(*rkey == 0);
 
-    cpu_cache_->items[nproc][reader].addr = -1;
-    cpu_cache_->items[nproc][reader].rkey = -1;
+    if (*server >= max_servers || raddr_server(*raddr)) {
+        pr_err("bad block from cache: server %u, raddr %p\n", *server, (void*)*raddr);
+        return -EINVAL;
+    }
 
     return 0;
 }
 
+// keeps the reserves topped up. the daemon may fall behind, then the
+// rings are looked at again after a wait that backs off while nothing
+// arrives
+static int refill_fn(void *data) {
+    u32 wait = refill_min_wait;
+    u32 got, i;
+    bool low;
+
+    while(!kthread_should_stop()) {
+        // before the scan, so that a wake up during it is not lost
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        got = 0;
+        low = false;
+        for(i = 0; i < nr_rings; ++i) {
+            got += reserve_fill(reserves + i, reserve_high);
+            if(READ_ONCE(reserves[i].n) < reserve_low)
+                low = true;
+        }
+
+        if(!low) {
+            wait = refill_min_wait;
+            schedule();
+            continue;
+        }
+        wait = got ? refill_min_wait : min(wait * 2, (u32)refill_max_wait);
+        schedule_timeout(msecs_to_jiffies(wait));
+    }
+    __set_current_state(TASK_RUNNING);
+
+    return 0;
+}
+
+// gives n blocks back to the provider on this cpu's free ring, published
+// with one release. blocks that don't fit are lost to the client and
+// counted in num_free_fail
+void add_free_cache_batch(const u64 *raddrs, u32 n) {
+    struct block_reserve *r = reserves + raw_smp_processor_id() % nr_rings;
+    unsigned long flags;
+    u32 room, i;
+
+    // callers may be in any context
+    spin_lock_irqsave(&r->free_lock, flags);
+    room = free_mask + 1 - (r->free_tail - r->free_head);
+    if(room < n) {
+        r->free_head = smp_load_acquire(&r->free_ring->head);
+        room = free_mask + 1 - (r->free_tail - r->free_head);
+    }
+    if(room > free_mask + 1)
+        room = 0;
+
+    for(i = 0; i < n && i < room; ++i)
+        r->free_items[(r->free_tail + i) & free_mask] = raddrs[i];
+    if(i) {
+        r->free_tail += i;
+        smp_store_release(&r->free_ring->tail, r->free_tail);
+    }
+    spin_unlock_irqrestore(&r->free_lock, flags);
+
+    if(i < n)
+        atomic_add(n - i, &num_free_fail);
+}
+
 void add_free_cache(u64 raddr/*, u32 rkey*/) {
-    u32 nproc = raw_smp_processor_id();
-    u32 writer;
-    
-    BUG_ON(nproc > nprocs);
-    writer = cpu_cache_->free_writer[nproc];
+    add_free_cache_batch(&raddr, 1);
+}
 
-    if(get_length_free(nproc) < max_free_item - 1) {
-        cpu_cache_->free_writer[nproc] = (cpu_cache_->free_writer[nproc] + 1) % max_free_item;
-    } else {
-        atomic_inc(&num_free_fail);
-        return;
+// sets up the kernel side of every pair of rings in the checked cpu_cache_
+static int reserves_init(void) {
+    struct block_reserve *r;
+    u32 i;
+
+    reserves = kcalloc(nr_rings, sizeof(*reserves), GFP_KERNEL);
+    if(!reserves)
+        return -ENOMEM;
+
+    for(i = 0; i < nr_rings; ++i) {
+        r = reserves + i;
+        spin_lock_init(&r->lock);
+        r->alloc_ring = cpu_cache_alloc_ring(cpu_cache_, i);
+        r->alloc_items = cpu_cache_alloc_items(cpu_cache_, i);
+        r->alloc_head = READ_ONCE(r->alloc_ring->head);
+        r->alloc_tail = r->alloc_head;
+
+        spin_lock_init(&r->free_lock);
+        r->free_ring = cpu_cache_free_ring(cpu_cache_, i);
+        r->free_items = cpu_cache_free_items(cpu_cache_, i);
+        r->free_tail = READ_ONCE(r->free_ring->tail);
+        r->free_head = smp_load_acquire(&r->free_ring->head);
     }
- 
-    cpu_cache_->free_items[nproc][writer] = raddr;
+    return 0;
+}
+
+// makes bi a page block with all its pages free
+static void block_reset_pages(struct block_info *bi) {
+    u32 i;
+
+    bi->cnt = rblock_size >> PAGE_SHIFT;
+    // pops hand out the pages in ascending order
+    bi->free_top = rblock_size >> PAGE_SHIFT;
+    for(i = 0; i < bi->free_top; ++i)
+        bi->free_stack[i] = bi->free_top - 1 - i;
+    bitmap_fill(bi->in_stack, rblock_size >> PAGE_SHIFT);
+    bi->slot_shift = PAGE_SHIFT;
+    bi->slots_bitmap = NULL;
+    bitmap_zero(bi->rpages_bitmap, rblock_size >> PAGE_SHIFT);
 }
 
-// must obtain "free_blocks_list_lock" when excute this function
-int alloc_remote_block(u32 free_list_idx) {
+// fetches a block of any server from the cache and makes it known to
+// get_rkey. the block is on no free list yet
+static struct block_info *fetch_remote_block(void) {
     struct block_info *bi;
     u64 raddr_ = 0;
     u32 rkey_ = 0;
-    int ret;
+    u32 server_ = 0;
+    int ret, idx;
 
-    ret = fetch_cache(&raddr_, &rkey_);
+    ret = fetch_cache(&raddr_, &rkey_, &server_);
     if(ret) {
-        pr_err("fetch cache error.\n");
-        return -1;
+        if(ret != -EAGAIN)
+            pr_err("fetch cache error.\n");
+        return NULL;
     }
 
     BUG_ON(raddr_ == 0 || rkey_ == 0 || raddr_ == -1 || rkey_ == -1);
 
     //pr_info("fetch a block with raddr = %p, rkey = %u\n", (void*)raddr_, rkey_);
     
-    bi = kmalloc(sizeof(struct block_info), GFP_KERNEL);
-    if(!bi) {
+    // callers hold spinlocks
+    bi = kmalloc(sizeof(struct block_info), GFP_ATOMIC);
+    idx = block_table_get();
+    if(!bi || idx < 0) {
         pr_err("init block meta data failed.\n");
-        return -1;
+        if(idx >= 0)
+            block_table_put(idx);
+        kfree(bi);
+        add_free_cache(raddr_ | ((u64)server_ << RADDR_SERVER_SHIFT));
+        return NULL;
     }
 
     // block_info init
-    bi->raddr = raddr_;
+    bi->raddr = ((u64)idx << BLOCK_SHIFT) | ((u64)server_ << RADDR_SERVER_SHIFT);
+    bi->remote = raddr_;
     bi->rkey = rkey_;
-    bi->cnt = rblock_size >> PAGE_SHIFT;
-    bi->free_list_idx = free_list_idx;
+    bi->idx = idx;
+    block_reset_pages(bi);
+    bi->free_list_idx = num_free_lists;
+    bi->gc_queued = false;
+    bi->compacting = false;
     spin_lock_init(&(bi->block_lock));
-    bitmap_zero(bi->rpages_bitmap, rblock_size >> PAGE_SHIFT);
     INIT_LIST_HEAD(&bi->block_node_list);
 
-    // insert to rhashtable (blocks_map)
-    rhashtable_insert_fast(blocks_map, &bi->block_node_rhash, blocks_map_params);
-    
-    // insert to free block list
-    //spin_lock(&free_blocks_list_lock);
-    list_add(&bi->block_node_list, free_blocks_lists + free_list_idx);
-    //spin_unlock(&free_blocks_list_lock);
+    // lookups may find it from here on
+    smp_store_release(&block_table[idx], bi);
 
     atomic_inc(&num_alloc_blocks);
+    return bi;
+}
+
+// the cache hands out blocks of all servers mixed, blocks of other servers
+// are parked on stray_blocks until someone asks for their server
+static struct block_info *take_remote_block(u32 server) {
+    struct block_info *bi = NULL;
+    int tries;
+
+    for(tries = 0; tries < max_stray_fetch; ++tries) {
+        spin_lock(&stray_blocks_lock);
+        bi = list_first_entry_or_null(stray_blocks + server, struct block_info, block_node_list);
+        if(bi)
+            list_del_init(&bi->block_node_list);
+        spin_unlock(&stray_blocks_lock);
+        if(bi)
+            break;
+
+        bi = fetch_remote_block();
+        if(!bi)
+            return NULL;
+        if(raddr_server(bi->raddr) == server)
+            break;
+
+        spin_lock(&stray_blocks_lock);
+        list_add_tail(&bi->block_node_list, stray_blocks + raddr_server(bi->raddr));
+        spin_unlock(&stray_blocks_lock);
+        bi = NULL;
+    }
+
+    if(!bi)
+        pr_err_ratelimited("no block of server %u in cache\n", server);
+    return bi;
+}
+
+// takes an empty block of server that gc has set aside, from the list
+// of free list held if there is one there, from any other list whose lock
+// is free otherwise. callers hold free list held's lock, or none with
+// held == num_free_lists
+static struct block_info *take_empty_block(u32 server, u32 held) {
+    struct empty_blocks *e;
+    struct block_info *bi = NULL;
+    u32 start = held < num_free_lists ? held : raw_smp_processor_id() % num_free_lists;
+    u32 i, j;
+
+    for(j = 0; j < num_free_lists && !bi; ++j) {
+        i = (start + j) % num_free_lists;
+        e = &empty_blocks[server][i];
+        if(!READ_ONCE(e->n))
+            continue;
+        if(i != held && !spin_trylock(free_blocks_list_locks[server] + i))
+            continue;
+
+        bi = list_first_entry_or_null(&e->list, struct block_info, block_node_list);
+        if(bi) {
+            list_del_init(&bi->block_node_list);
+            e->n--;
+            e->low = min(e->low, e->n);
+        }
+        if(i != held)
+            spin_unlock(free_blocks_list_locks[server] + i);
+    }
+    return bi;
+}
+
+// must obtain "free_blocks_list_lock" when excute this function.
+int alloc_remote_block(u32 server, u32 free_list_idx) {
+    struct block_info *bi = take_empty_block(server, free_list_idx);
+
+    if(!bi)
+        bi = take_remote_block(server);
+
+    if(!bi)
+        return -1;
+
+    // insert to free block list
+    bi->free_list_idx = free_list_idx;
+    list_add(&bi->block_node_list, free_blocks_lists[server] + free_list_idx);
     return 0;
 }
 EXPORT_SYMBOL(alloc_remote_block);
 
 
 
-u64 alloc_remote_page(void) {
-    struct block_info *bi/*, *entry, *next_entry*/;
-    u32 offset;
-    u64 raddr;
-    int ret;
-    //int counter = 0;
-    //int flag;
+// page blocks keep their free pages on a stack, so taking one is O(1).
+// alloc_remote_page_at takes pages out of the middle by setting their bit
+// in rpages_bitmap only, and pops skip such stale entries. in_stack keeps
+// a page from being on the stack twice. callers hold the block lock.
+static int block_pop_page(struct block_info *bi) {
+    u32 idx;
+
+    while(bi->free_top) {
+        idx = bi->free_stack[--bi->free_top];
+        __clear_bit(idx, bi->in_stack);
+        if(!__test_and_set_bit(idx, bi->rpages_bitmap)) {
+            bi->cnt -= 1;
+            return idx;
+        }
+    }
+    return -1;
+}
+
+static void block_push_page(struct block_info *bi, u32 idx) {
+    __clear_bit(idx, bi->rpages_bitmap);
+    bi->cnt += 1;
+    if(!__test_and_set_bit(idx, bi->in_stack))
+        bi->free_stack[bi->free_top++] = idx;
+}
+
+// takes up to mag_batch pages of server for an empty magazine. the pages
+// come off the block stacks of one free list, under one lock per block,
+// and go in so that the magazine hands them out in ascending order
+static void mag_refill(u32 server, struct rpage_magazine *mag) {
+    struct block_info *bi;
+    u64 raddrs[mag_batch];
     u32 nproc = raw_smp_processor_id();
     u32 free_list_idx = nproc % num_free_lists;
     u32 raw_free_list_idx = free_list_idx;
     u8 locked = 0;
+    int got = 0, idx, ret, i;
 
     do{
-        if(spin_trylock(free_blocks_list_locks + free_list_idx)) {
-            if(!list_empty(free_blocks_lists + free_list_idx)) {
+        if(spin_trylock(free_blocks_list_locks[server] + free_list_idx)) {
+            if(!list_empty(free_blocks_lists[server] + free_list_idx)) {
                 locked = 1;
                 break;
             } else {
-                spin_unlock(free_blocks_list_locks + free_list_idx);
+                spin_unlock(free_blocks_list_locks[server] + free_list_idx);
             }
-        } 
-        /*
-        spin_lock(free_blocks_list_locks + free_list_idx);
-        if(!list_empty(free_blocks_lists + free_list_idx)) {
-            locked = 1;
-            break;
-        } else {
-            spin_unlock(free_blocks_list_locks + free_list_idx);
-        }*/
+        }
         free_list_idx = (free_list_idx + 1) % num_free_lists;
     }while(free_list_idx != raw_free_list_idx);
 
     if(locked == 0) {
-        spin_lock(free_blocks_list_locks + free_list_idx);
+        spin_lock(free_blocks_list_locks[server] + free_list_idx);
     }
 
-    if(list_empty(free_blocks_lists + free_list_idx)) {
-        ret = alloc_remote_block(free_list_idx);
+    if(list_empty(free_blocks_lists[server] + free_list_idx)) {
+        ret = alloc_remote_block(server, free_list_idx);
         if(ret) {
-            pr_err("cannot fetch a block from cache.\n");
-            spin_unlock(free_blocks_list_locks + free_list_idx);
-            return 0;
+            pr_err_ratelimited("cannot fetch a block from cache.\n");
+            spin_unlock(free_blocks_list_locks[server] + free_list_idx);
+            return;
         }
     }
 
-    bi = list_first_entry(free_blocks_lists + free_list_idx, struct block_info, block_node_list);
-    if(!bi) {
-        pr_err("fail to add new block to free_blocks_list\n");
-        spin_unlock(free_blocks_list_locks + free_list_idx);
-        return 0;
+    // a partial batch is fine, a new block is only fetched when the list
+    // has no free page at all
+    while(got < mag_batch && !list_empty(free_blocks_lists[server] + free_list_idx)) {
+        bi = list_first_entry(free_blocks_lists[server] + free_list_idx, struct block_info, block_node_list);
+        if(bi->free_list_idx != free_list_idx) {
+            pr_err("block_info's free_list_idx error: 2\n");
+        }
+
+        spin_lock(&bi->block_lock);
+        while(got < mag_batch && (idx = block_pop_page(bi)) >= 0)
+            raddrs[got++] = bi->raddr + ((u64)idx << PAGE_SHIFT);
+        BUG_ON(bi->cnt > (rblock_size >> PAGE_SHIFT));
+
+        if(bi->cnt == 0) {
+            list_del(&bi->block_node_list);
+            bi->free_list_idx = num_free_lists;
+        }
+        spin_unlock(&bi->block_lock);
     }
+    spin_unlock(free_blocks_list_locks[server] + free_list_idx);
+
+    for(i = 0; i < got; ++i)
+        mag->raddrs[got - 1 - i] = raddrs[i];
+    mag->n = got;
+}
 
-    //BUG_ON(bi->free_list_idx != free_list_idx);
+static void free_to_blocks(const u64 *raddrs, u32 n);
+
+// returns a free page on server, or 0 if none can be had
+u64 alloc_remote_page(u32 server) {
+    struct rpage_magazine *mag;
+    u64 raddr = 0;
+
+    BUG_ON(server >= max_servers);
+
+    mag = &get_cpu_ptr(&magazines)->s[server];
+    for(;;) {
+        if(mag->n == 0)
+            mag_refill(server, mag);
+        if(mag->n == 0)
+            break;
+        raddr = mag->raddrs[--mag->n];
+        if(likely(!READ_ONCE(raddr_to_block(raddr)->compacting)))
+            break;
+        // freed into the magazine before its block was picked for
+        // compaction, it goes back to the block so the block can empty
+        free_to_blocks(&raddr, 1);
+        raddr = 0;
+    }
+    put_cpu_ptr(&magazines);
+
+    return raddr;
+}
+EXPORT_SYMBOL(alloc_remote_page);
+
+// allocates the page at raddr if it is free, so that a caller can put
+// pages that are read together next to each other. returns raddr, or 0 if
+// the page is taken or its block is not a page block with free pages
+u64 alloc_remote_page_at(u64 raddr) {
+    struct block_info *bi;
+    u32 server = raddr_server(raddr);
+    u32 offset, free_list_idx;
+    u64 ret = 0;
+
+    BUG_ON((raddr & ((1 << PAGE_SHIFT) - 1)) != 0);
+    BUG_ON(server >= max_servers);
+
+    rcu_read_lock();
+    bi = raddr_to_block(raddr);
+    if(!bi)
+        goto out;
+    // slot blocks on their lists have a free_list_idx too, see the
+    // barrier in alloc_remote_slot
+    free_list_idx = READ_ONCE(bi->free_list_idx);
+    smp_rmb();
+    if(free_list_idx >= num_free_lists || bi->slot_shift != PAGE_SHIFT)
+        goto out;
+
+    spin_lock(free_blocks_list_locks[server] + free_list_idx);
+    // the block may have filled up, moved lists or been freed by gc since,
+    // it is only still on this list when its free_list_idx says so
     if(bi->free_list_idx != free_list_idx) {
-        pr_err("block_info's free_list_idx error: 2\n");
+        spin_unlock(free_blocks_list_locks[server] + free_list_idx);
+        goto out;
     }
 
     spin_lock(&bi->block_lock);
-    offset = find_first_zero_bit(bi->rpages_bitmap, rblock_size >> PAGE_SHIFT);
-    BUG_ON(offset == (rblock_size >> PAGE_SHIFT));
-    set_bit(offset, bi->rpages_bitmap);
-    
-    bi->cnt -= 1;
-    BUG_ON(bi->cnt > (rblock_size >> PAGE_SHIFT));
+    offset = (raddr - bi->raddr) >> PAGE_SHIFT;
+    if(!test_and_set_bit(offset, bi->rpages_bitmap)) {
+        bi->cnt -= 1;
+        if(bi->cnt == 0) {
+            list_del(&bi->block_node_list);
+            bi->free_list_idx = num_free_lists;
+        }
+        ret = raddr;
+    }
+    spin_unlock(&bi->block_lock);
+    spin_unlock(free_blocks_list_locks[server] + free_list_idx);
 
-    if(bi->cnt == 0) {
-        list_del(&bi->block_node_list);
-        bi->free_list_idx = num_free_lists;
+out:
+    rcu_read_unlock();
+    return ret;
+}
+EXPORT_SYMBOL(alloc_remote_page_at);
+
+// hands bi to the gc thread if all of its nslots pages or slots are free.
+// callers hold the block lock. gc_take_empty sorts it out, the lists
+// can't be taken here in the right order
+static void gc_queue(struct block_info *bi, u32 nslots) {
+    if(bi->cnt == nslots && !bi->gc_queued) {
+        bi->gc_queued = true;
+        llist_add(&bi->gc_node, &gc_candidates);
     }
+}
 
-    spin_unlock(&bi->block_lock);
+static int raddr_cmp(const void *a, const void *b) {
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
 
-    /*
-    counter = 0;
-    list_for_each_entry_safe(entry, next_entry, free_blocks_lists + nproc, block_node_list) {
-        spin_lock(&entry->block_lock);
-        BUG_ON(entry->free_list_idx != nproc);
-        //if(entry->free_list_idx != nproc) {
-        //    pr_err("block_info's free_list_idx error: 2\n");
-        //}
-        flag = 0;
-        if(entry->cnt == (rblock_size >> PAGE_SHIFT)) {
-            counter++;
-            if(counter > 1) {
-                free_remote_block(entry);
-                flag = 1;
-            }
+    return x < y ? -1 : x > y;
+}
+
+// gives n sorted pages back to their blocks, locking each block once for
+// all its pages
+static void free_to_blocks(const u64 *raddrs, u32 n) {
+    struct block_info *bi;
+    u32 nproc = raw_smp_processor_id();
+    u32 free_list_idx = nproc % num_free_lists;
+    u32 i, j, offset, server;
+
+    for(i = 0; i < n; i = j) {
+        bi = raddr_to_block(raddrs[i]);
+        for(j = i + 1; j < n && raddr_block_idx(raddrs[j]) == raddr_block_idx(raddrs[i]); ++j)
+            ;
+        if(!bi) {
+            pr_err("the page being free(%p) is not exit: cannot find out block_info.\n", (void*)raddrs[i]);
+            continue;
         }
-        if(flag == 0) {
-            spin_unlock(&entry->block_lock);
+        server = raddr_server(bi->raddr);
+
+        spin_lock(&bi->block_lock);
+        for(; i < j; ++i) {
+            offset = (raddrs[i] - bi->raddr) >> PAGE_SHIFT;
+            BUG_ON(offset >= (rblock_size >> PAGE_SHIFT));
+            if(test_bit(offset, bi->rpages_bitmap))
+                block_push_page(bi, offset);
+            else
+                pr_err("the page being free(%p) is not exit: bitmap is incorrect.\n", (void*)raddrs[i]);
         }
-    }*/
-    spin_unlock(free_blocks_list_locks + free_list_idx);
 
-    raddr = bi->raddr + (offset << PAGE_SHIFT);
-    return raddr;
+        // the block was full and on no list, it has free pages again.
+        // a block being compacted stays off the lists until compact_end
+        if(bi->cnt && bi->free_list_idx == num_free_lists && !bi->compacting) {
+            spin_lock(free_blocks_list_locks[server] + free_list_idx);
+            bi->free_list_idx = free_list_idx;
+            list_add(&bi->block_node_list, free_blocks_lists[server] + free_list_idx);
+            spin_unlock(free_blocks_list_locks[server] + free_list_idx);
+        }
+        if(!bi->compacting)
+            gc_queue(bi, rblock_size >> PAGE_SHIFT);
+        spin_unlock(&bi->block_lock);
+    }
+}
+
+// gives the n oldest pages of a full magazine back to their blocks
+static void mag_drain(u32 server, struct rpage_magazine *mag, u32 n) {
+    u64 raddrs[mag_batch];
+
+    BUG_ON(n > mag_batch || n > mag->n);
+
+    memcpy(raddrs, mag->raddrs, n * sizeof(u64));
+    memmove(mag->raddrs, mag->raddrs + n, (mag->n - n) * sizeof(u64));
+    mag->n -= n;
+    sort(raddrs, n, sizeof(u64), raddr_cmp, NULL);
+    free_to_blocks(raddrs, n);
 }
-EXPORT_SYMBOL(alloc_remote_page);
 
 void free_remote_page(u64 raddr) {
-    struct block_info *bi = NULL;
-    u64 raddr_block; 
-    u32 offset; 
-    u32 nproc = raw_smp_processor_id();
-    u32 free_list_idx = nproc % num_free_lists;
-    
+    struct rpage_magazine *mag;
+    u32 server = raddr_server(raddr);
+
     BUG_ON((raddr & ((1 << PAGE_SHIFT) - 1)) != 0);
+    BUG_ON(server >= max_servers);
+
+    // frees go to this cpu's magazine whatever cpu allocated the page, so
+    // they take no lock until the magazine overflows. pages of a block
+    // being compacted go to the block, so it can empty. one that is
+    // picked meanwhile is drained after this, see compact_drain_magazines
+    mag = &get_cpu_ptr(&magazines)->s[server];
+    if(unlikely(READ_ONCE(raddr_to_block(raddr)->compacting))) {
+        free_to_blocks(&raddr, 1);
+    } else {
+        if(mag->n == mag_size)
+            mag_drain(server, mag, mag_batch);
+        mag->raddrs[mag->n++] = raddr;
+    }
+    put_cpu_ptr(&magazines);
+}
+EXPORT_SYMBOL(free_remote_page);
 
-    raddr_block = raddr >> BLOCK_SHIFT;
-    raddr_block = raddr_block << BLOCK_SHIFT;
-    bi = rhashtable_lookup_fast(blocks_map, &raddr_block, blocks_map_params);
+// returns a free slot of 1 << slot_shift bytes on server, or 0 if none
+// can be had
+u64 alloc_remote_slot(u32 server, u32 slot_shift) {
+    struct block_info *bi;
+    u32 cls = slot_shift - min_slot_shift;
+    u32 nslots = rblock_size >> slot_shift;
+    u32 offset;
+
+    BUG_ON(server >= max_servers);
+    BUG_ON(slot_shift < min_slot_shift || slot_shift > max_slot_shift);
+
+    spin_lock(slot_blocks_list_locks[server] + cls);
+    bi = list_first_entry_or_null(slot_blocks_lists[server] + cls, struct block_info, block_node_list);
     if(!bi) {
-        pr_err("the page being free(%p) is not exit: cannot find out block_info.\n", (void*)raddr);
-        return;
-    }
+        bi = take_empty_block(server, num_free_lists);
+        if(!bi)
+            bi = take_remote_block(server);
+        if(!bi) {
+            spin_unlock(slot_blocks_list_locks[server] + cls);
+            return 0;
+        }
 
-    BUG_ON(raddr_block != bi->raddr);
-    BUG_ON(raddr < bi->raddr);
+        bi->slots_bitmap = kcalloc(BITS_TO_LONGS(nslots), sizeof(unsigned long), GFP_ATOMIC);
+        if(!bi->slots_bitmap) {
+            pr_err("alloc slot bitmap failed\n");
+            spin_lock(&stray_blocks_lock);
+            list_add(&bi->block_node_list, stray_blocks + server);
+            spin_unlock(&stray_blocks_lock);
+            spin_unlock(slot_blocks_list_locks[server] + cls);
+            return 0;
+        }
+        bi->slot_shift = slot_shift;
+        bi->cnt = nslots;
+        // alloc_remote_page_at must not take this for a page block
+        smp_wmb();
+        bi->free_list_idx = 0;
+        list_add(&bi->block_node_list, slot_blocks_lists[server] + cls);
+    }
 
-    //spin_lock(free_blocks_list_locks + nproc);
     spin_lock(&bi->block_lock);
+    offset = find_first_zero_bit(bi->slots_bitmap, nslots);
+    BUG_ON(offset == nslots);
+    set_bit(offset, bi->slots_bitmap);
 
-    offset = (raddr - bi->raddr) >> PAGE_SHIFT;
-    BUG_ON(offset >= (rblock_size >> PAGE_SHIFT));
+    bi->cnt -= 1;
+    if(bi->cnt == 0) {
+        list_del_init(&bi->block_node_list);
+        bi->free_list_idx = num_free_lists;
+    }
+    spin_unlock(&bi->block_lock);
+    spin_unlock(slot_blocks_list_locks[server] + cls);
 
-    if(test_bit(offset, bi->rpages_bitmap)) {
-        clear_bit(offset, bi->rpages_bitmap);
+    return bi->raddr + ((u64)offset << slot_shift);
+}
+EXPORT_SYMBOL(alloc_remote_slot);
+
+void free_remote_slot(u64 raddr) {
+    struct block_info *bi = NULL;
+    u32 offset, cls;
+    u32 server = raddr_server(raddr);
+
+    BUG_ON(server >= max_servers);
+
+    bi = raddr_to_block(raddr);
+    if(!bi || !bi->slots_bitmap) {
+        pr_err("the slot being free(%p) is not exit: cannot find out block_info.\n", (void*)raddr);
+        return;
+    }
+
+    BUG_ON((raddr & ((1 << bi->slot_shift) - 1)) != 0);
+    offset = (raddr - bi->raddr) >> bi->slot_shift;
+    cls = bi->slot_shift - min_slot_shift;
 
+    // list lock first, in the order alloc_remote_slot takes them
+    spin_lock(slot_blocks_list_locks[server] + cls);
+    spin_lock(&bi->block_lock);
+    if(test_and_clear_bit(offset, bi->slots_bitmap)) {
         bi->cnt += 1;
-        //if(bi->cnt == (rblock_size >> PAGE_SHIFT)) {
-        //    free_remote_block(bi);
-        //    spin_unlock(free_blocks_list_locks + nproc);
-        //    return; // no need to release block's lock
-        //} else if(bi->cnt == 1) {
         if(bi->cnt == 1) {
-            //BUG_ON(bi->free_list_idx != num_free_lists);
-            if(bi->free_list_idx != num_free_lists) {
-                pr_err("block_info's free_list_idx error: 3\n");
-            }
-            //while (!spin_trylock(free_blocks_list_locks + free_list_idx)) {
-            //    msleep(10);
-            //}
-            spin_lock(free_blocks_list_locks + free_list_idx);
-            bi->free_list_idx = free_list_idx;
-            list_add(&bi->block_node_list, free_blocks_lists + free_list_idx);
-            spin_unlock(free_blocks_list_locks + free_list_idx);
+            bi->free_list_idx = 0;
+            list_add_tail(&bi->block_node_list, slot_blocks_lists[server] + cls);
         }
+        gc_queue(bi, rblock_size >> bi->slot_shift);
     }
     else {
-        // error handler...
-        pr_err("the page being free(%p) is not exit: bitmap is incorrect.\n", (void*)raddr);
-        // return;
+        pr_err("the slot being free(%p) is not exit: bitmap is incorrect.\n", (void*)raddr);
     }
-
     spin_unlock(&bi->block_lock);
-    //spin_unlock(free_blocks_list_locks + nproc);
+    spin_unlock(slot_blocks_list_locks[server] + cls);
+}
+EXPORT_SYMBOL(free_remote_slot);
+
+// forgets bi, whose pages are all free and which is on no list. callers
+// give its address back to the provider
+static void release_block(struct block_info *bi) {
+    block_table_put(bi->idx);
+    kfree(bi->slots_bitmap);
+    kfree_rcu(bi, rcu);
+    atomic_inc(&num_free_blocks);
+}
+
+static u64 block_free_addr(struct block_info *bi) {
+    return bi->remote | ((u64)raddr_server(bi->raddr) << RADDR_SERVER_SHIFT);
 }
-EXPORT_SYMBOL(free_remote_page);
 
 // must obtain free_blocks_list_lock when excute this function
 void free_remote_block(struct block_info *bi) {
     list_del(&bi->block_node_list);
-    rhashtable_remove_fast(blocks_map, &bi->block_node_rhash, blocks_map_params);
+    bi->free_list_idx = num_free_lists;
+    add_free_cache(block_free_addr(bi)/*, bi->rkey*/);
+    release_block(bi);
+}
+EXPORT_SYMBOL(free_remote_block);
 
-    add_free_cache(bi->raddr/*, bi->rkey*/);
+// takes sparse page blocks of server out of allocation, for the caller
+// to move their pages out of. picks blocks until their used pages would
+// go over budget, which is lowered by what they use, or max blocks are
+// picked. returns how many went into blocks, 0 if there are too few
+// sparse blocks for moving to free any
+u32 compact_pick(u32 server, u64 *blocks, u32 max, u32 *budget) {
+    struct block_info *bi, *tmp;
+    u32 npages = rblock_size >> PAGE_SHIFT;
+    u32 used, taken = 0, n = 0, i;
+
+    BUG_ON(server >= max_servers);
+
+    for(i = 0; i < num_free_lists && n < max; ++i) {
+        spin_lock(free_blocks_list_locks[server] + i);
+        list_for_each_entry_safe(bi, tmp, free_blocks_lists[server] + i, block_node_list) {
+            if(n == max)
+                break;
+            spin_lock(&bi->block_lock);
+            used = npages - bi->cnt;
+            if(used && used <= (npages >> compact_sparse_shift) && used <= *budget) {
+                list_del_init(&bi->block_node_list);
+                bi->free_list_idx = num_free_lists;
+                bi->compacting = true;
+                *budget -= used;
+                taken += used;
+                blocks[n++] = bi->raddr;
+            }
+            spin_unlock(&bi->block_lock);
+        }
+        spin_unlock(free_blocks_list_locks[server] + i);
+    }
 
-    kfree(bi);
+    if(n && n < compact_min_blocks) {
+        *budget += taken;
+        compact_end(blocks, n);
+        n = 0;
+    }
+    return n;
+}
+EXPORT_SYMBOL(compact_pick);
 
-    atomic_inc(&num_free_blocks);
+// puts blocks compact_pick took back into allocation. the ones that
+// emptied go to gc
+void compact_end(const u64 *blocks, u32 n) {
+    struct block_info *bi;
+    u32 server, i, j;
+
+    for(j = 0; j < n; ++j) {
+        bi = raddr_to_block(blocks[j]);
+        BUG_ON(!bi || !bi->compacting);
+        server = raddr_server(bi->raddr);
+        i = bi->idx % num_free_lists;
+
+        spin_lock(free_blocks_list_locks[server] + i);
+        spin_lock(&bi->block_lock);
+        bi->compacting = false;
+        if(bi->cnt) {
+            bi->free_list_idx = i;
+            list_add_tail(&bi->block_node_list, free_blocks_lists[server] + i);
+        }
+        gc_queue(bi, rblock_size >> PAGE_SHIFT);
+        spin_unlock(&bi->block_lock);
+        spin_unlock(free_blocks_list_locks[server] + i);
+    }
+}
+EXPORT_SYMBOL(compact_end);
+
+// gives the pages of blocks being compacted that sit in this cpu's
+// magazines back to their blocks. they would count as used, and keep
+// the blocks from emptying
+static void mag_drain_compacting(struct work_struct *work) {
+    struct rpage_magazines *mags;
+    struct rpage_magazine *mag;
+    u64 raddrs[mag_size];
+    u32 s, i, n, kept;
+
+    mags = get_cpu_ptr(&magazines);
+    for(s = 0; s < max_servers; ++s) {
+        mag = &mags->s[s];
+        n = 0;
+        kept = 0;
+        for(i = 0; i < mag->n; ++i) {
+            if(READ_ONCE(raddr_to_block(mag->raddrs[i])->compacting))
+                raddrs[n++] = mag->raddrs[i];
+            else
+                mag->raddrs[kept++] = mag->raddrs[i];
+        }
+        mag->n = kept;
+        if(n) {
+            sort(raddrs, n, sizeof(u64), raddr_cmp, NULL);
+            free_to_blocks(raddrs, n);
+        }
+    }
+    put_cpu_ptr(&magazines);
 }
-EXPORT_SYMBOL(free_remote_block);
 
-void gc_timer_callback(struct timer_list *timer) {
-  struct block_info *entry, *next_entry;  
-  u32 counter = 0;
-  int i;
-
-  for(i = 0;i < num_free_lists; ++i) {
-    if(spin_trylock(free_blocks_list_locks + i)) {
-        list_for_each_entry_safe(entry, next_entry, free_blocks_lists + i, block_node_list) {
-            spin_lock(&entry->block_lock);
-            //BUG_ON(entry->free_list_idx != i);
-            if(entry->free_list_idx != i) {
-                pr_err("entry's free list idx error: 1\n");
-            }
-            if(entry->cnt == (rblock_size >> PAGE_SHIFT)) {
-                counter++;
-                free_remote_block(entry);
-                continue;
+// drains the pages of the blocks compact_pick took out of every cpu's
+// magazines. frees of their pages after it don't go to a magazine. may
+// sleep
+int compact_drain_magazines(void) {
+    return schedule_on_each_cpu(mag_drain_compacting);
+}
+EXPORT_SYMBOL(compact_drain_magazines);
+
+// frees pages moved out of blocks being compacted. they go straight to
+// their blocks rather than to a magazine, where they would keep the
+// blocks from emptying. sorts raddrs
+void compact_free_pages(u64 *raddrs, u32 n) {
+    sort(raddrs, n, sizeof(u64), raddr_cmp, NULL);
+    free_to_blocks(raddrs, n);
+}
+EXPORT_SYMBOL(compact_free_pages);
+
+// moves bi, which was empty when it was queued, to the empty blocks of its
+// free list if it still is. an empty slot block becomes a page block on
+// the way, so any size can reuse it
+static void gc_take_empty(struct block_info *bi) {
+    u32 server = raddr_server(bi->raddr);
+    u32 cls, i;
+
+    // only gc turns a slot block back into a page block
+    if(bi->slots_bitmap) {
+        cls = bi->slot_shift - min_slot_shift;
+        spin_lock(slot_blocks_list_locks[server] + cls);
+        spin_lock(&bi->block_lock);
+        bi->gc_queued = false;
+        if(bi->cnt != (rblock_size >> bi->slot_shift)) {
+            spin_unlock(&bi->block_lock);
+            spin_unlock(slot_blocks_list_locks[server] + cls);
+            return;
+        }
+        list_del_init(&bi->block_node_list);
+        // alloc_remote_page_at must not take it for a page block yet
+        bi->free_list_idx = num_free_lists;
+        smp_wmb();
+        kfree(bi->slots_bitmap);
+        block_reset_pages(bi);
+        spin_unlock(&bi->block_lock);
+        spin_unlock(slot_blocks_list_locks[server] + cls);
+
+        i = bi->idx % num_free_lists;
+        spin_lock(free_blocks_list_locks[server] + i);
+        list_add(&bi->block_node_list, &empty_blocks[server][i].list);
+        empty_blocks[server][i].n++;
+        spin_unlock(free_blocks_list_locks[server] + i);
+        return;
+    }
+
+    // a page block may move between free lists, its list lock comes first
+    for(;;) {
+        i = READ_ONCE(bi->free_list_idx);
+        if(i >= num_free_lists) {
+            // all its pages were taken again since
+            spin_lock(&bi->block_lock);
+            if(bi->free_list_idx >= num_free_lists) {
+                bi->gc_queued = false;
+                spin_unlock(&bi->block_lock);
+                return;
             }
-            spin_unlock(&entry->block_lock);
+            spin_unlock(&bi->block_lock);
+            continue;
+        }
+        spin_lock(free_blocks_list_locks[server] + i);
+        // bi may have left list i since. a block is only locked under a
+        // list lock while it is on that list: a free that puts an unlisted
+        // block back on a list holds the block lock while it waits for the
+        // list lock. blocks join and leave list i only under its lock
+        if(READ_ONCE(bi->free_list_idx) == i) {
+            spin_lock(&bi->block_lock);
+            break;
         }
-        spin_unlock(free_blocks_list_locks + i);
+        spin_unlock(free_blocks_list_locks[server] + i);
     }
-  }
 
-  mod_timer(timer, jiffies + msecs_to_jiffies(rblock_gc_interval)); 
+    bi->gc_queued = false;
+    if(bi->cnt == (rblock_size >> PAGE_SHIFT)) {
+        list_move(&bi->block_node_list, &empty_blocks[server][i].list);
+        bi->free_list_idx = num_free_lists;
+        empty_blocks[server][i].n++;
+    }
+    spin_unlock(&bi->block_lock);
+    spin_unlock(free_blocks_list_locks[server] + i);
+}
+
+// gives back up to max of the empty blocks of free list i of server, the
+// ones unused the longest first. returns how many went into raddrs
+static u32 gc_release(u32 server, u32 i, u32 keep, u64 *raddrs, u32 max) {
+    struct empty_blocks *e = &empty_blocks[server][i];
+    struct block_info *bi;
+    u32 n = 0;
+
+    spin_lock(free_blocks_list_locks[server] + i);
+    if(e->low > keep)
+        max = min(max, e->low - keep);
+    else
+        max = 0;
+    while(n < max) {
+        bi = list_last_entry(&e->list, struct block_info, block_node_list);
+        list_del(&bi->block_node_list);
+        e->n--;
+        raddrs[n++] = block_free_addr(bi);
+        release_block(bi);
+    }
+    e->low = e->n;
+    spin_unlock(free_blocks_list_locks[server] + i);
+
+    return n;
+}
+
+// one gc pass: sorts out the blocks that became empty, and every gc_window
+// passes gives back the empty blocks that stayed unused the whole time,
+// beyond a reserve of about one per cpu. both are bounded, what is left
+// over waits for the next pass
+static void gc_pass(void) {
+    static u32 passes;
+    struct llist_node *todo, *next, *last = NULL;
+    u64 raddrs[gc_batch];
+    u32 keep, n = 0, scanned = 0, s, i;
+
+    todo = llist_del_all(&gc_candidates);
+    while(todo && scanned++ < gc_scan_budget) {
+        next = todo->next;
+        gc_take_empty(llist_entry(todo, struct block_info, gc_node));
+        todo = next;
+    }
+    if(todo) {
+        for(last = todo; last->next; last = last->next)
+            ;
+        llist_add_batch(todo, last, &gc_candidates);
+    }
+
+    if(++passes % gc_window)
+        return;
+
+    keep = max(1U, num_online_cpus() / num_free_lists);
+    for(s = 0; s < max_servers && n < gc_batch; ++s)
+        for(i = 0; i < num_free_lists && n < gc_batch; ++i)
+            if(READ_ONCE(empty_blocks[s][i].n))
+                n += gc_release(s, i, keep, raddrs + n, gc_batch - n);
+    if(n)
+        add_free_cache_batch(raddrs, n);
+}
+
+static int gc_fn(void *data) {
+    while(!kthread_should_stop()) {
+        gc_pass();
+        schedule_timeout_interruptible(msecs_to_jiffies(rblock_gc_interval));
+    }
+    return 0;
 }
 
 static int __init rpage_allocator_init_module(void) {
     int ret = 0;
     int i = 0;
+    int s = 0;
 
     ret = cpu_cache_init();
     if (ret) {
@@ -433,28 +1191,78 @@ static int __init rpage_allocator_init_module(void) {
 
     cpu_cache_dump();
 
-    blocks_map = kmalloc(sizeof(struct rhashtable), GFP_KERNEL);
-    if (!blocks_map) {
-        pr_err("alloc memory for blocks_map failed\n");
-        return -1;
+    for(s = 0; s < max_servers; ++s) {
+        for(i = 0; i < num_free_lists ; ++i) {
+            INIT_LIST_HEAD(free_blocks_lists[s] + i);
+            spin_lock_init(free_blocks_list_locks[s] + i);
+            INIT_LIST_HEAD(&empty_blocks[s][i].list);
+        }
+        INIT_LIST_HEAD(stray_blocks + s);
+        for(i = 0; i < num_slot_classes; ++i) {
+            INIT_LIST_HEAD(slot_blocks_lists[s] + i);
+            spin_lock_init(slot_blocks_list_locks[s] + i);
+        }
     }
+    spin_lock_init(&stray_blocks_lock);
 
-    rhashtable_init(blocks_map, &blocks_map_params);
-
-    for(i = 0; i < num_free_lists ; ++i) {
-        INIT_LIST_HEAD(free_blocks_lists + i);
-        spin_lock_init(free_blocks_list_locks + i);
+    ret = reserves_init();
+    if(ret) {
+        cpu_cache_delete();
+        return ret;
+    }
+    refill_task = kthread_run(refill_fn, NULL, "rblock_refill");
+    if(IS_ERR(refill_task)) {
+        pr_err("cannot start the block refill thread\n");
+        ret = PTR_ERR(refill_task);
+        refill_task = NULL;
+        kfree(reserves);
+        cpu_cache_delete();
+        return ret;
     }
 
-    timer_setup(&gc_timer, gc_timer_callback, 0);
-    mod_timer(&gc_timer, jiffies + msecs_to_jiffies(rblock_gc_interval));
+    gc_task = kthread_run(gc_fn, NULL, "rblock_gc");
+    if(IS_ERR(gc_task)) {
+        pr_err("cannot start the block gc thread\n");
+        ret = PTR_ERR(gc_task);
+        gc_task = NULL;
+        kthread_stop(refill_task);
+        refill_task = NULL;
+        kfree(reserves);
+        cpu_cache_delete();
+        return ret;
+    }
 
     return 0;
 }
 
 static void __exit rpage_allocator_cleanup_module(void) {
+    struct cpu_cache_block *item;
+    u64 raddrs[gc_batch];
+    u32 i, n, s;
+
+    BUILD_BUG_ON(reserve_size > gc_batch);
+    kthread_stop(gc_task);
+    gc_task = NULL;
+    kthread_stop(refill_task);
+    refill_task = NULL;
+    // the empty blocks gc kept aside go back too
+    for(s = 0; s < max_servers; ++s) {
+        for(i = 0; i < num_free_lists; ++i) {
+            empty_blocks[s][i].low = empty_blocks[s][i].n;
+            while((n = gc_release(s, i, 0, raddrs, gc_batch)))
+                add_free_cache_batch(raddrs, n);
+        }
+    }
+    // blocks still in the reserves were never used, give them back
+    for(i = 0; i < nr_rings; ++i) {
+        for(n = 0; n < reserves[i].n; ++n) {
+            item = reserves[i].items + n;
+            raddrs[n] = item->addr | ((u64)item->server << RADDR_SERVER_SHIFT);
+        }
+        add_free_cache_batch(raddrs, n);
+    }
+    kfree(reserves);
     cpu_cache_delete();
-    kfree(blocks_map);
 }
 
 module_init(rpage_allocator_init_module);
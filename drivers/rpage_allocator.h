@@ -4,92 +4,144 @@
 #include <linux/cpumask.h>
 #include <linux/slab.h>
 #include <linux/rhashtable.h>
+#include <linux/llist.h>
 #include <linux/module.h>
 
+#include "cpu_cache_abi.h"
+
 #define addr_space (1024 * 1024 * 1024 * 200l)
 #define rblock_size (4 * 1024 * 1024)
 #define max_block_num (addr_space / rblock_size)
 #define BLOCK_SHIFT 22
 #define MB_SHIFT 20
 
-// u32 num_cpus = num_online_cpus();
-#define nprocs 128
-#define max_alloc_item 256
-#define max_free_item 20480
-#define max_class_free_item 512
-#define class_num 16
+// ms between passes of the gc thread. empty blocks are kept for reuse,
+// and only what stayed unused for a whole gc_window passes is given back,
+// at most gc_batch blocks a pass. a pass looks at no more than
+// gc_scan_budget blocks that became empty
 #define rblock_gc_interval 500
+#define gc_window 4
+#define gc_batch 64
+#define gc_scan_budget 256
+// blocks kept in the kernel side reserve of each pair of shm rings, see
+// fetch_cache. the refill thread tops a reserve up to reserve_high once it
+// drops below reserve_low
+#define reserve_size 16
+#define reserve_low 4
+#define reserve_high 12
+// ms the refill thread waits before looking at the rings again while the
+// daemon has not caught up, doubled up to refill_max_wait
+#define refill_min_wait 1
+#define refill_max_wait 128
 #define num_free_lists 8
+// blocks may come from up to max_servers memory servers. the allocator
+// hands out addresses with the server id in the top bits, so a remote
+// address names a page on a specific server
+#define max_servers 16
+#define RADDR_SERVER_SHIFT 56
+#define raddr_server(raddr) ((u32)((raddr) >> RADDR_SERVER_SHIFT))
+// below the server id, an address handed out by the allocator is the
+// index of its block in block_table and the offset in the block, rather
+// than the server's address of the block. finding a block's rkey and
+// server address is an array index that way, with no hashing
+#define raddr_block_idx(raddr) \
+    ((u32)(((raddr) & ((1ULL << RADDR_SERVER_SHIFT) - 1)) >> BLOCK_SHIFT))
+// blocks the client can hold at once. fragmentation can keep more blocks
+// than addr_space needs, hence the slack
+#define max_table_blocks (2 * max_block_num)
+// how many blocks of other servers alloc_remote_block may fetch before it
+// gives up on the one it wants
+#define max_stray_fetch 64
+// sub-page slots for compressed pages: 512B, 1KB and 2KB. a block holds
+// slots of a single size, and is on the slot list of its size and server
+// instead of a page free list
+#define min_slot_shift 9
+#define max_slot_shift (PAGE_SHIFT - 1)
+#define num_slot_classes (max_slot_shift - min_slot_shift + 1)
+// a page block is sparse when at most 1 / (1 << compact_sparse_shift) of
+// its pages are used. compact_pick only takes sparse blocks, and no fewer
+// than compact_min_blocks of them, so moving their pages out frees blocks
+#define compact_sparse_shift 3
+#define compact_min_blocks 2
 
 extern atomic_t num_alloc_blocks;
 extern atomic_t num_free_blocks;
 extern atomic_t num_free_fail;
+extern atomic_t num_fetch_steal;
+extern atomic_t num_fetch_empty;
 
 
-struct raddr_rkey{
-    u64 addr;
-    u32 rkey;
-};
-
-struct item {
-    u64 addr;
-    u32 rkey;
-};
-
-struct cpu_cache_storage {
-    u64 block_size;
-    struct raddr_rkey items[nprocs][max_alloc_item];
-    u64 free_items[nprocs][max_free_item];
-    struct raddr_rkey class_items[class_num][max_alloc_item];
-    u64 class_free_items[class_num][max_class_free_item];
-
-    u32 reader[nprocs];
-    u32 class_reader[class_num];
-    u32 free_reader[nprocs];
-    u32 class_free_reader[nprocs];
-
-    u32 writer[nprocs];
-    u32 class_writer[class_num];
-    u32 free_writer[nprocs];
-    u32 class_free_writer[nprocs];
-};
-
 struct block_info{
-    u64 raddr;
+    u64 raddr; // server id and block_table index, see raddr_block_idx
+    u64 remote; // the server's address of the block
     u32 rkey;
+    u32 idx; // in block_table
     spinlock_t block_lock;
     u16 cnt;
     u32 free_list_idx;
+    // PAGE_SHIFT, or the slot size of a slot block
+    u32 slot_shift;
     DECLARE_BITMAP(rpages_bitmap, (rblock_size >> PAGE_SHIFT));
+    // free pages of a page block, see block_pop_page
+    u16 free_top;
+    u16 free_stack[rblock_size >> PAGE_SHIFT];
+    DECLARE_BITMAP(in_stack, (rblock_size >> PAGE_SHIFT));
+    // used slots of a slot block, rpages_bitmap is unused then
+    unsigned long *slots_bitmap;
 
-    struct rhash_head block_node_rhash;
     struct list_head block_node_list;
+    // queued for the gc thread once all its pages are free, under block_lock
+    bool gc_queued;
+    struct llist_node gc_node;
+    // picked for compaction, on no list and no page of it is handed out.
+    // under the block lock, with the free list lock to clear it
+    bool compacting;
+    // alloc_remote_page_at looks blocks up without holding a page in them
+    struct rcu_head rcu;
 };
 
-struct rhashtable_params blocks_map_params = {
-    .head_offset = offsetof(struct block_info, block_node_rhash),
-    .key_offset = offsetof(struct block_info, raddr),
-    .key_len = sizeof(((struct block_info *)0)->raddr),
-    .hashfn = jhash,
-    // .nulls_base = (1U << RHT_BASE_SHIFT), 
-    // not support in kernel 5.15
+extern struct block_info *block_table[max_table_blocks];
+
+#define mag_size 64
+#define mag_batch 32
+
+struct rpage_magazine {
+    u32 n;
+    u64 raddrs[mag_size];
 };
 
-struct rhashtable *blocks_map = NULL;
-struct list_head free_blocks_lists[num_free_lists];
-spinlock_t free_blocks_list_locks[num_free_lists];
+// the block raddr is in, NULL if the client doesn't hold it
+static inline struct block_info *raddr_to_block(u64 raddr)
+{
+    return READ_ONCE(block_table[raddr_block_idx(raddr)]);
+}
+
+struct list_head free_blocks_lists[max_servers][num_free_lists];
+spinlock_t free_blocks_list_locks[max_servers][num_free_lists];
+// blocks fetched while looking for a block of another server
+struct list_head stray_blocks[max_servers];
+spinlock_t stray_blocks_lock;
+struct list_head slot_blocks_lists[max_servers][num_slot_classes];
+spinlock_t slot_blocks_list_locks[max_servers][num_slot_classes];
 
-struct cpu_cache_storage *cpu_cache_ = NULL;
-struct timer_list gc_timer;
+struct cpu_cache_header *cpu_cache_ = NULL;
 
 int cpu_cache_init(void);
 void cpu_cache_dump(void);
 void cpu_cache_delete(void);
 
-int alloc_remote_block(u32 free_list_idx);
+int alloc_remote_block(u32 server, u32 free_list_idx);
 void free_remote_block(struct block_info *bi);
-u64 alloc_remote_page(void);
+u64 alloc_remote_page(u32 server);
+u64 alloc_remote_page_at(u64 raddr);
 void free_remote_page(u64 raddr);
-int fetch_cache(u64 *raddr, u32 *rkey);
+u64 alloc_remote_slot(u32 server, u32 slot_shift);
+void free_remote_slot(u64 raddr);
+u32 compact_pick(u32 server, u64 *blocks, u32 max, u32 *budget);
+void compact_end(const u64 *blocks, u32 n);
+void compact_free_pages(u64 *raddrs, u32 n);
+int compact_drain_magazines(void);
+int fetch_cache(u64 *raddr, u32 *rkey, u32 *server);
 void add_free_cache(u64 raddr/*, u32 rkey*/);
+void add_free_cache_batch(const u64 *raddrs, u32 n);
 u32 get_rkey(u64 raddr);
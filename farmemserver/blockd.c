@@ -0,0 +1,522 @@
+// Block provider for rpage_allocator. Creates /dev/shm/cpu_cache (see
+// drivers/cpu_cache_abi.h) and keeps every cpu's alloc ring between a low
+// and a high watermark with 4MB blocks that rmserver registers on demand
+// (see blockproto.h). Blocks the kernel frees come back on the free rings
+// and are returned to their server in batches.
+//
+//   blockd -s 10.0.0.1:50000,10.0.0.2:50000
+//
+// With -f N there are no servers: blockd makes up N servers' worth of
+// block addresses and rkeys, so rpage_allocator and its callers can be run
+// on one machine without RDMA. RDMA to such blocks fails, use rmserver
+// over soft-RoCE (rxe) for the whole path.
+//
+// Start it before loading rpage_allocator and stop it after unloading, the
+// kernel maps the file while it is loaded.
+//
+//   blockd -s 10.0.0.1:50000 -L 64
+//
+// only sets how far the servers' pools may grow, in GB, and exits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "blockproto.h"
+#include "../drivers/cpu_cache_abi.h"
+
+#define MAX_SERVERS 16 // max_servers of rpage_allocator
+#define RADDR_SERVER_SHIFT 56
+#define RETRY_NS 100000000ULL // before asking a server that had no block again
+#define MIN_POLL_US 50
+#define MAX_POLL_US 1000
+
+struct server {
+  char host[64];
+  char port[8];
+  int fd;
+  // registered blocks that are in no ring yet
+  struct blk_desc pool[BLK_MAX_BATCH];
+  uint32_t npool;
+  // freed blocks to send back with the next BLK_OP_FREE
+  uint64_t frees[BLK_MAX_BATCH];
+  uint32_t nfrees;
+  uint64_t retry_at;
+  uint64_t handed;
+  uint64_t returned;
+
+  // -f only
+  uint64_t *fake_free;
+  uint64_t fake_nfree;
+};
+
+static const char *path = "/dev/shm/cpu_cache";
+static struct cpu_cache_header *cache;
+static struct server servers[MAX_SERVERS];
+static int nservers;
+static int fake;
+static long fake_gb = 32;
+static uint32_t nrings;
+static uint32_t alloc_slots = 64;
+static uint32_t free_slots = 1024;
+static uint32_t low = 4;
+static uint32_t high = 8;
+static uint32_t batch = 32;
+static int interval = 10;
+static int next_server;
+static volatile sig_atomic_t stop;
+static volatile sig_atomic_t dump;
+
+static void die(const char *reason)
+{
+  fprintf(stderr, "%s - errno: %d\n", reason, errno);
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+  char *p = (char *) buf;
+
+  while (len) {
+    ssize_t r = read(fd, p, len);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+  const char *p = (const char *) buf;
+
+  while (len) {
+    ssize_t r = write(fd, p, len);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static void server_connect(struct server *s)
+{
+  struct addrinfo hints = {}, *res;
+  int one = 1;
+
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(s->host, s->port, &hints, &res)) {
+    fprintf(stderr, "cannot resolve %s\n", s->host);
+    exit(EXIT_FAILURE);
+  }
+
+  if ((s->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    die("error: socket failed.");
+  while (connect(s->fd, res->ai_addr, res->ai_addrlen)) {
+    if (stop)
+      exit(EXIT_FAILURE);
+    // rmserver may still be starting up
+    fprintf(stderr, "waiting for %s:%s\n", s->host, s->port);
+    sleep(1);
+  }
+  setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  freeaddrinfo(res);
+}
+
+// one request and its reply, body of the reply into out
+static int server_call(struct server *s, uint32_t op, const void *body,
+                       uint32_t n, size_t len, void *out, size_t size,
+                       struct blk_reply *reply)
+{
+  struct blk_req req;
+
+  req.op = op;
+  req.n = n;
+  if (write_full(s->fd, &req, sizeof(req)) ||
+      (len && write_full(s->fd, body, len)) ||
+      read_full(s->fd, reply, sizeof(*reply)))
+    die("error: lost the control connection to a server.");
+  if (reply->n && size && read_full(s->fd, out, reply->n * size))
+    die("error: lost the control connection to a server.");
+  return reply->status;
+}
+
+// asks s for another batch of blocks when its pool is empty
+static void server_refill(struct server *s, int id)
+{
+  struct blk_reply reply;
+  uint64_t addr;
+
+  if (s->npool || now_ns() < s->retry_at)
+    return;
+
+  if (fake) {
+    while (s->npool < batch && s->fake_nfree) {
+      addr = s->fake_free[--s->fake_nfree];
+      s->pool[s->npool].addr = addr;
+      s->pool[s->npool].rkey = 0x100 + id;
+      s->npool++;
+    }
+  } else {
+    server_call(s, BLK_OP_ALLOC, NULL, batch, 0, s->pool, sizeof(s->pool[0]), &reply);
+    s->npool = reply.n;
+  }
+
+  // out of blocks or quota, or no queue connected to register them for yet
+  if (!s->npool)
+    s->retry_at = now_ns() + RETRY_NS;
+}
+
+static void server_flush(struct server *s)
+{
+  struct blk_reply reply;
+
+  if (!s->nfrees)
+    return;
+  if (fake) {
+    memcpy(s->fake_free + s->fake_nfree, s->frees, s->nfrees * sizeof(uint64_t));
+    s->fake_nfree += s->nfrees;
+  } else {
+    server_call(s, BLK_OP_FREE, s->frees, s->nfrees, s->nfrees * sizeof(uint64_t),
+                NULL, 0, &reply);
+  }
+  s->returned += s->nfrees;
+  s->nfrees = 0;
+}
+
+// the next block to hand out, servers take turns. false if no server has
+// one right now
+static bool take_block(struct cpu_cache_block *b)
+{
+  for (int i = 0; i < nservers; i++) {
+    int id = next_server;
+    struct server *s = &servers[id];
+
+    next_server = (next_server + 1) % nservers;
+    server_refill(s, id);
+    if (!s->npool)
+      continue;
+
+    s->npool--;
+    b->addr = s->pool[s->npool].addr;
+    b->rkey = s->pool[s->npool].rkey;
+    b->server = id;
+    s->handed++;
+    return true;
+  }
+  return false;
+}
+
+// tops up every alloc ring that fell below low to high. returns the
+// number of blocks handed out
+static uint32_t fill_rings(void)
+{
+  uint32_t given = 0;
+
+  for (uint32_t r = 0; r < nrings; r++) {
+    struct cpu_cache_ring *ring = cpu_cache_alloc_ring(cache, r);
+    struct cpu_cache_block *items = cpu_cache_alloc_items(cache, r);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+    uint32_t n = 0;
+
+    if (tail - head >= low)
+      continue;
+    while (tail - head + n < high && take_block(&items[(tail + n) & (alloc_slots - 1)]))
+      n++;
+    if (n)
+      __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+    given += n;
+  }
+  return given;
+}
+
+// moves what the kernel freed to its servers' batches. returns the number
+// of blocks taken off the rings
+static uint32_t drain_rings(void)
+{
+  uint32_t got = 0;
+
+  for (uint32_t r = 0; r < nrings; r++) {
+    struct cpu_cache_ring *ring = cpu_cache_free_ring(cache, r);
+    __u64 *items = cpu_cache_free_items(cache, r);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t head = ring->head;
+
+    for (; head != tail; head++, got++) {
+      uint64_t raddr = items[head & (free_slots - 1)];
+      uint32_t id = raddr >> RADDR_SERVER_SHIFT;
+      struct server *s;
+
+      if (id >= (uint32_t) nservers) {
+        fprintf(stderr, "freed block %p names no server\n", (void *) raddr);
+        continue;
+      }
+      s = &servers[id];
+      s->frees[s->nfrees++] = raddr & ((1ULL << RADDR_SERVER_SHIFT) - 1);
+      if (s->nfrees == BLK_MAX_BATCH)
+        server_flush(s);
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  }
+  return got;
+}
+
+static void print_stats(void)
+{
+  uint32_t empty = 0, held = 0;
+
+  for (uint32_t r = 0; r < nrings; r++) {
+    struct cpu_cache_ring *ring = cpu_cache_alloc_ring(cache, r);
+    uint32_t n = ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    held += n;
+    empty += !n;
+  }
+  printf("rings: %u blocks queued, %u of %u empty\n", held, empty, nrings);
+
+  for (int i = 0; i < nservers; i++) {
+    struct server *s = &servers[i];
+    struct blk_stats st = {};
+    struct blk_reply reply;
+
+    if (fake) {
+      st.total_blocks = st.pool_blocks = (fake_gb << 30) / BLK_SIZE;
+      st.used_blocks = st.total_blocks - s->fake_nfree;
+    } else {
+      server_call(s, BLK_OP_STATS, NULL, 0, 0, &st, sizeof(st), &reply);
+    }
+    printf("server %d: handed out %llu, returned %llu, pooled %u, "
+           "server has %llu of %llu blocks in use, pool of %llu\n", i,
+           (unsigned long long) s->handed, (unsigned long long) s->returned,
+           s->npool, (unsigned long long) st.used_blocks,
+           (unsigned long long) st.total_blocks,
+           (unsigned long long) st.pool_blocks);
+  }
+  fflush(stdout);
+}
+
+// the layout rpage_allocator checks at load. every page is written, so the
+// file is fully populated before the kernel maps it
+static void create_cache(void)
+{
+  struct cpu_cache_header h = {};
+  size_t size;
+  int fd;
+
+  h.magic = CPU_CACHE_MAGIC;
+  h.version = CPU_CACHE_VERSION;
+  h.block_size = BLK_SIZE;
+  h.nr_rings = nrings;
+  h.alloc_slots = alloc_slots;
+  h.free_slots = free_slots;
+  if (cpu_cache_check(&h, ~0ULL)) {
+    fprintf(stderr, "slot counts must be powers of two of at least %d\n", min_ring_slots);
+    exit(EXIT_FAILURE);
+  }
+  size = (cpu_cache_size(&h) + 4095) & ~4095UL;
+
+  if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+    die("error: cannot open the cpu_cache file.");
+  if (ftruncate(fd, 0) || ftruncate(fd, size))
+    die("error: cannot size the cpu_cache file.");
+  cache = (struct cpu_cache_header *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED, fd, 0);
+  if (cache == MAP_FAILED)
+    die("error: cannot map the cpu_cache file.");
+  close(fd);
+
+  memset(cache, 0, size);
+  h.magic = 0;
+  *cache = h;
+  __atomic_store_n(&cache->magic, CPU_CACHE_MAGIC, __ATOMIC_RELEASE);
+  printf("%s: %u rings of %u alloc and %u free slots, %zu bytes\n", path,
+         nrings, alloc_slots, free_slots, size);
+}
+
+static void add_servers(char *list)
+{
+  for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+    struct server *s = &servers[nservers];
+    char *colon = strrchr(tok, ':');
+
+    if (nservers == MAX_SERVERS || !colon) {
+      fprintf(stderr, "servers are ip:port, at most %d of them\n", MAX_SERVERS);
+      exit(EXIT_FAILURE);
+    }
+    *colon = 0;
+    snprintf(s->host, sizeof(s->host), "%s", tok);
+    snprintf(s->port, sizeof(s->port), "%s", colon + 1);
+    nservers++;
+  }
+}
+
+static void add_fake_servers(int n)
+{
+  uint64_t blocks = (fake_gb << 30) / BLK_SIZE;
+
+  if (n < 1 || n > MAX_SERVERS) {
+    fprintf(stderr, "1 to %d fake servers\n", MAX_SERVERS);
+    exit(EXIT_FAILURE);
+  }
+  nservers = n;
+  for (int i = 0; i < n; i++) {
+    struct server *s = &servers[i];
+
+    s->fake_free = (uint64_t *) malloc(blocks * sizeof(uint64_t));
+    if (!s->fake_free)
+      die("error: out of memory.");
+    // block 0 would be a null address
+    for (uint64_t b = 0; b < blocks; b++)
+      s->fake_free[b] = (blocks - b) * BLK_SIZE;
+    s->fake_nfree = blocks;
+  }
+}
+
+static void on_signal(int sig)
+{
+  if (sig == SIGUSR1)
+    dump = 1;
+  else
+    stop = 1;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s -s ip:port[,ip:port...] | -f servers [-g GB per fake server]\n"
+                  "       [-r rings] [-a alloc_slots] [-F free_slots] [-l low] [-h high]\n"
+                  "       [-b batch] [-i stats_seconds] [-p path]\n"
+                  "       %s -s ip:port[,ip:port...] -L GB\n",
+          prog, prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  char *list = NULL;
+  int nfake = 0, limit = -1, opt;
+  uint64_t next_stats;
+  useconds_t poll = MIN_POLL_US;
+
+  nrings = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "s:f:g:r:a:F:l:h:b:i:p:L:")) != -1) {
+    switch (opt) {
+      case 's': list = optarg; break;
+      case 'f': nfake = atoi(optarg); break;
+      case 'g': fake_gb = atol(optarg); break;
+      case 'r': nrings = atoi(optarg); break;
+      case 'a': alloc_slots = atoi(optarg); break;
+      case 'F': free_slots = atoi(optarg); break;
+      case 'l': low = atoi(optarg); break;
+      case 'h': high = atoi(optarg); break;
+      case 'b': batch = atoi(optarg); break;
+      case 'i': interval = atoi(optarg); break;
+      case 'p': path = optarg; break;
+      case 'L': limit = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (!list == !nfake || nrings < 1 || low > high || high > alloc_slots ||
+      batch < 1 || batch > BLK_MAX_BATCH || fake_gb < 1)
+    usage(argv[0]);
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGUSR1, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  fake = nfake > 0;
+  if (limit >= 0) {
+    struct blk_reply reply;
+
+    if (fake)
+      usage(argv[0]);
+    add_servers(list);
+    for (int i = 0; i < nservers; i++) {
+      server_connect(&servers[i]);
+      // servers only take it from their own host
+      if (server_call(&servers[i], BLK_OP_LIMIT, NULL, limit, 0, NULL, 0, &reply))
+        die("error: a server refused the limit, run -L on the server.");
+    }
+    return 0;
+  }
+  if (fake) {
+    add_fake_servers(nfake);
+  } else {
+    add_servers(list);
+    for (int i = 0; i < nservers; i++)
+      server_connect(&servers[i]);
+  }
+  create_cache();
+  if (mlockall(MCL_CURRENT))
+    fprintf(stderr, "cannot lock memory, errno: %d\n", errno);
+
+  next_stats = now_ns() + interval * 1000000000ULL;
+  while (!stop) {
+    uint32_t work = drain_rings();
+
+    for (int i = 0; i < nservers; i++)
+      server_flush(&servers[i]);
+    work += fill_rings();
+
+    if (dump || (interval && now_ns() >= next_stats)) {
+      print_stats();
+      dump = 0;
+      next_stats = now_ns() + interval * 1000000000ULL;
+    }
+
+    // busy again as soon as there is work, slower polls while idle
+    poll = work ? MIN_POLL_US : (poll * 2 > MAX_POLL_US ? MAX_POLL_US : poll * 2);
+    if (!work)
+      usleep(poll);
+  }
+
+  // what the kernel has freed and blocks it never saw go back, blocks in
+  // the rings belong to the kernel
+  drain_rings();
+  for (int i = 0; i < nservers; i++) {
+    struct server *s = &servers[i];
+    uint64_t returned;
+
+    server_flush(s);
+    // pooled blocks were never handed out, they don't count as returned
+    returned = s->returned;
+    while (s->npool) {
+      s->frees[s->nfrees++] = s->pool[--s->npool].addr;
+      if (s->nfrees == BLK_MAX_BATCH)
+        server_flush(s);
+    }
+    server_flush(s);
+    s->returned = returned;
+  }
+  print_stats();
+  return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef BLOCKPROTO_H
+#define BLOCKPROTO_H
+
+// Control protocol between rmserver and the block provider (blockd). The
+// provider connects over TCP to the port number rmserver listens on for
+// RDMA and sends requests, each answered by one reply. rmserver grows its
+// pool in chunks as blocks are allocated and releases chunks whose blocks
+// have all come back, so it holds about what its clients hold. Fields are
+// in host byte order, both ends are expected to run on the same kind of
+// machine.
+//
+// rmserver tells clients apart by their ip. The blocks a provider gets are
+// registered in the protection domain of the queues the client node at the
+// same address connected, and count against that node's quota.
+
+#include <stdint.h>
+
+#define BLK_SIZE (4UL << 20)
+// most blocks one request asks for or returns
+#define BLK_MAX_BATCH 256
+
+enum blk_op {
+  BLK_OP_ALLOC = 1, // wants n blocks, the reply carries up to n blk_desc
+  BLK_OP_FREE = 2,  // n block addresses follow, the reply carries none
+  BLK_OP_STATS = 3, // the reply carries one blk_stats
+  BLK_OP_LIMIT = 4, // caps the server's pool at n GB, the reply carries none.
+                    // only taken from the server itself, -EPERM otherwise
+};
+
+struct blk_req {
+  uint32_t op;
+  uint32_t n;
+};
+
+// status is 0 or a negative errno. -EAGAIN from BLK_OP_ALLOC means no
+// queue of this client has connected yet, so there is no protection domain
+// to register blocks in; -EDQUOT means the client holds all its quota
+// allows; -ENOMEM means the server is out of blocks. An ALLOC that the
+// quota cuts short gets fewer than n blocks and status 0
+struct blk_reply {
+  int32_t status;
+  uint32_t n;
+};
+
+struct blk_desc {
+  uint64_t addr;
+  uint32_t rkey;
+  uint32_t pad;
+};
+
+// all for the calling client. total_blocks is what it may grow to, its
+// quota or the pool's cap, pool_blocks what the pool holds for it now
+struct blk_stats {
+  uint64_t total_blocks;
+  uint64_t used_blocks;
+  uint64_t pool_blocks;
+  uint64_t allocs;
+  uint64_t frees;
+};
+
+#endif
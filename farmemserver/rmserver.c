@@ -2,16 +2,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <rdma/rdma_cma.h>
 #include "sys/sysinfo.h"
+#include "blockproto.h"
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
 
-const size_t BUFFER_SIZE = 1024 * 1024 * 1024 * 32l;
+// how far the pool may grow, BLK_OP_LIMIT changes it at runtime
+static size_t BUFFER_SIZE = 1024 * 1024 * 1024 * 32l;
+// the pool grows by CHUNK_SIZE at a time, backed by pages of PAGE_BYTES
+static size_t PAGE_BYTES = 2UL << 20;
+static size_t CHUNK_SIZE = 256UL << 20;
+// one implicit on demand paging mr per client, if the device has it
+static bool USE_ODP = false;
+#define ACCESS_FLAGS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ)
+// what one client may hold, 0 for as much as the pool has. -Q sets it for
+// single clients
+static size_t QUOTA = 0;
+#define MAX_QUOTA_RULES 64
 const unsigned int NUM_PROCS = get_nprocs_conf();
 const unsigned int NUM_QUEUES_PER_PROC = 3;
-const unsigned int NUM_QUEUES = NUM_PROCS * NUM_QUEUES_PER_PROC;
+// a client's qsets * qps * 3, only sizes the listen backlog now
+static unsigned int NUM_QUEUES = NUM_PROCS * NUM_QUEUES_PER_PROC;
+// clients connect up to conn_window queues at once, see fastswap_rdma
+#define MIN_BACKLOG 128
 
 struct device {
   struct ibv_pd *pd;
@@ -22,25 +43,59 @@ struct queue {
   struct ibv_qp *qp;
   struct ibv_cq *cq;
   struct rdma_cm_id *cm_id;
-  struct ctrl *ctrl;
+  struct client *client;
   enum {
     INIT,
     CONNECTED
   } state;
 };
 
-struct ctrl {
-  struct queue *queues;
-  struct ibv_mr *mr_buffer;
-  void *buffer;
-  struct device *dev;
+// a piece of the pool. it is mapped and registered as a whole when the
+// blocks run out, and released again once none of its blocks is in use
+struct chunk {
+  char *base;
+  struct ibv_mr *mr; // NULL when the implicit odp mr covers it
+  bool huge;
+  uint32_t nfree;
+  uint16_t *free_blocks; // stack of free block indices
+};
 
-  struct ibv_comp_channel *comp_channel;
+// a compute node, told apart by its ip. its queues and chunks live in a
+// protection domain of their own, so its rkeys are no good on the queues of
+// other clients. it goes away, and its memory with it, once its last queue
+// and its last blockd connection are closed
+struct client {
+  struct in_addr ip;
+  struct device *dev; // NULL until its first queue connects
+  struct ibv_mr *odp_mr;
+
+  struct chunk **chunks;
+  size_t nchunks;
+  size_t max_chunks;
+  size_t used_blocks;
+  size_t quota; // bytes, 0 for no quota
+  uint64_t allocs;
+  uint64_t frees;
+  unsigned int nqueues;
+  unsigned int nconns;
+
+  struct client *next;
 };
 
-struct memregion {
-  uint64_t baseaddr;
-  uint32_t key;
+struct quota_rule {
+  struct in_addr ip;
+  size_t bytes;
+};
+
+// the pool is cut into BLK_SIZE blocks handed out to blockd, see
+// blocks_alloc. lock covers the clients and everything in them, the
+// control threads and the cm loop share them
+struct ctrl {
+  struct client *clients;
+  size_t nchunks; // of all clients together, BUFFER_SIZE caps them
+  pthread_mutex_t lock;
+
+  struct ibv_comp_channel *comp_channel;
 };
 
 static void die(const char *reason);
@@ -50,10 +105,26 @@ static int on_connect_request(struct rdma_cm_id *id, struct rdma_conn_param *par
 static int on_connection(struct queue *q);
 static int on_disconnect(struct queue *q);
 static int on_event(struct rdma_cm_event *event);
-static void destroy_device(struct ctrl *ctrl);
+static void chunk_release(struct client *c, size_t i);
+static void start_control(uint16_t port);
 
 static struct ctrl *gctrl = NULL;
-static unsigned int queue_ctr = 0;
+static struct quota_rule quota_rules[MAX_QUOTA_RULES];
+static unsigned int nquota_rules = 0;
+
+// -Q ip=GB
+static void add_quota_rule(const char *arg)
+{
+  struct quota_rule *r = &quota_rules[nquota_rules];
+  char ip[64];
+  long gb;
+
+  if (nquota_rules == MAX_QUOTA_RULES || sscanf(arg, "%63[^=]=%ld", ip, &gb) != 2 ||
+      gb < 0 || !inet_aton(ip, &r->ip))
+    die("error: quotas are given as ip=GB.");
+  r->bytes = (size_t) gb << 30;
+  nquota_rules++;
+}
 
 int main(int argc, char **argv)
 {
@@ -62,42 +133,52 @@ int main(int argc, char **argv)
   struct rdma_event_channel *ec = NULL;
   struct rdma_cm_id *listener = NULL;
   uint16_t port = 0;
+  int opt;
 
-  if (argc != 2) {
-    die("Need to specify a port number to listen");
+  while ((opt = getopt(argc, argv, "p:c:oq:Q:")) != -1) {
+    switch (opt) {
+      case 'p':
+        PAGE_BYTES = !strcasecmp(optarg, "1g") ? 1UL << 30 :
+                     !strcasecmp(optarg, "2m") ? 2UL << 20 : 4096;
+        break;
+      case 'c': CHUNK_SIZE = atol(optarg) << 20; break;
+      case 'o': USE_ODP = true; break;
+      case 'q': QUOTA = (size_t) atol(optarg) << 30; break;
+      case 'Q': add_quota_rule(optarg); break;
+      default: argc = 0;
+    }
   }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc < 2 || argc > 4) {
+    die("Usage: rmserver [-p 4k|2m|1g] [-c chunk MB] [-o] [-q GB] [-Q ip=GB]... <port> [number of client queues] [size in GB]");
+  }
+  if (argc >= 3)
+    TEST_Z(NUM_QUEUES = atoi(argv[2]));
+  // several servers on one box (e.g. over rxe) can't all grow to 32GB
+  if (argc >= 4)
+    TEST_Z(BUFFER_SIZE = 1024 * 1024 * 1024 * atol(argv[3]));
+  // whole pages and whole blocks, and block indices fit in a u16
+  CHUNK_SIZE = (CHUNK_SIZE + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+  TEST_Z(CHUNK_SIZE && CHUNK_SIZE % BLK_SIZE == 0 && CHUNK_SIZE / BLK_SIZE <= UINT16_MAX);
 
   addr.sin_family = AF_INET;
   addr.sin_port = htons(atoi(argv[1]));
 
   TEST_NZ(alloc_control());
+  start_control(atoi(argv[1]));
 
   TEST_Z(ec = rdma_create_event_channel());
   TEST_NZ(rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP));
   TEST_NZ(rdma_bind_addr(listener, (struct sockaddr *)&addr));
-  TEST_NZ(rdma_listen(listener, NUM_QUEUES + 1));
+  TEST_NZ(rdma_listen(listener, NUM_QUEUES + 1 > MIN_BACKLOG ? NUM_QUEUES + 1 : MIN_BACKLOG));
   port = ntohs(rdma_get_src_port(listener));
   printf("listening on port %d.\n", port);
+  printf("pool of up to %zu MB in %zu MB chunks of %zu KB pages\n",
+         BUFFER_SIZE >> 20, CHUNK_SIZE >> 20, PAGE_BYTES >> 10);
 
-  for (unsigned int i = 0; i < NUM_QUEUES; ++i) {
-    printf("waiting for queue connection: %d\n", i);
-    struct queue *q = &gctrl->queues[i];
-
-    // handle connection requests
-    while (rdma_get_cm_event(ec, &event) == 0) {
-      struct rdma_cm_event event_copy;
-
-      memcpy(&event_copy, event, sizeof(*event));
-      rdma_ack_cm_event(event);
-
-      if (on_event(&event_copy) || q->state == queue::CONNECTED)
-        break;
-    }
-  }
-
-  printf("done connecting all queues\n");
-
-  // handle disconnects, etc.
+  // clients come and go, each with as many queues as it likes
   while (rdma_get_cm_event(ec, &event) == 0) {
     struct rdma_cm_event event_copy;
 
@@ -110,7 +191,6 @@ int main(int argc, char **argv)
 
   rdma_destroy_event_channel(ec);
   rdma_destroy_id(listener);
-  destroy_device(gctrl);
   return 0;
 }
 
@@ -126,23 +206,67 @@ int alloc_control()
   TEST_Z(gctrl);
   memset(gctrl, 0, sizeof(struct ctrl));
 
-  gctrl->queues = (struct queue *) malloc(sizeof(struct queue) * NUM_QUEUES);
-  TEST_Z(gctrl->queues);
-  memset(gctrl->queues, 0, sizeof(struct queue) * NUM_QUEUES);
-  for (unsigned int i = 0; i < NUM_QUEUES; ++i) {
-    gctrl->queues[i].ctrl = gctrl;
-    gctrl->queues[i].state = queue::INIT;
-  }
-
+  TEST_NZ(pthread_mutex_init(&gctrl->lock, NULL));
 
   return 0;
 }
 
+// the client at ip, made up if it isn't known yet. callers hold the lock
+static struct client *client_get(struct in_addr ip)
+{
+  struct client *c;
+
+  for (c = gctrl->clients; c; c = c->next)
+    if (c->ip.s_addr == ip.s_addr)
+      return c;
+
+  c = (struct client *) calloc(1, sizeof(*c));
+  TEST_Z(c);
+  c->ip = ip;
+  c->quota = QUOTA;
+  for (unsigned int i = 0; i < nquota_rules; ++i)
+    if (quota_rules[i].ip.s_addr == ip.s_addr)
+      c->quota = quota_rules[i].bytes;
+  c->next = gctrl->clients;
+  gctrl->clients = c;
+  printf("client %s joined, quota %zu MB\n", inet_ntoa(ip), c->quota >> 20);
+  return c;
+}
+
+// drops c with all its memory once nothing refers to it any more. callers
+// hold the lock
+static void client_put(struct client *c)
+{
+  struct client **p;
+
+  if (c->nqueues || c->nconns)
+    return;
+
+  printf("client %s left, releasing %zu MB\n", inet_ntoa(c->ip),
+         (c->nchunks * CHUNK_SIZE) >> 20);
+  while (c->nchunks)
+    chunk_release(c, c->nchunks - 1);
+  free(c->chunks);
+  if (c->odp_mr)
+    ibv_dereg_mr(c->odp_mr);
+  if (c->dev) {
+    ibv_dealloc_pd(c->dev->pd);
+    free(c->dev);
+  }
+
+  for (p = &gctrl->clients; *p != c; p = &(*p)->next)
+    ;
+  *p = c->next;
+  free(c);
+}
+
+// callers hold the lock
 static device *get_device(struct queue *q)
 {
+  struct client *c = q->client;
   struct device *dev = NULL;
 
-  if (!q->ctrl->dev) {
+  if (!c->dev) {
     dev = (struct device *) malloc(sizeof(*dev));
     TEST_Z(dev);
     dev->verbs = q->cm_id->verbs;
@@ -150,32 +274,32 @@ static device *get_device(struct queue *q)
     dev->pd = ibv_alloc_pd(dev->verbs);
     TEST_Z(dev->pd);
 
-    struct ctrl *ctrl = q->ctrl;
-    ctrl->buffer = malloc(BUFFER_SIZE);
-    TEST_Z(ctrl->buffer);
-
-    TEST_Z(ctrl->mr_buffer = ibv_reg_mr(
-      dev->pd,
-      ctrl->buffer,
-      BUFFER_SIZE,
-      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ));
+    // once per client, its queues connect in bursts
+    struct ibv_device_attr attrs = {};
+    TEST_NZ(ibv_query_device(dev->verbs, &attrs));
+    printf("attrs: max_qp=%d, max_qp_wr=%d, max_cq=%d max_cqe=%d \
+            max_qp_rd_atom=%d, max_qp_init_rd_atom=%d\n", attrs.max_qp,
+            attrs.max_qp_wr, attrs.max_cq, attrs.max_cqe,
+            attrs.max_qp_rd_atom, attrs.max_qp_init_rd_atom);
+
+    // the nic faults pages of an implicit odp mr in as they are touched, so
+    // nothing is pinned and no chunk needs an mr of its own
+    if (USE_ODP) {
+      struct ibv_device_attr_ex attrx = {};
+      uint32_t rc = IBV_ODP_SUPPORT_READ | IBV_ODP_SUPPORT_WRITE;
+
+      if (!ibv_query_device_ex(dev->verbs, NULL, &attrx) &&
+          (attrx.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT) &&
+          (attrx.odp_caps.per_transport_caps.rc_odp_caps & rc) == rc)
+        c->odp_mr = ibv_reg_mr(dev->pd, NULL, SIZE_MAX, ACCESS_FLAGS | IBV_ACCESS_ON_DEMAND);
+      if (!c->odp_mr)
+        printf("no implicit odp on this device, registering chunks\n");
+    }
 
-    printf("registered memory region of %zu bytes\n", BUFFER_SIZE);
-    q->ctrl->dev = dev;
+    c->dev = dev;
   }
 
-  return q->ctrl->dev;
-}
-
-static void destroy_device(struct ctrl *ctrl)
-{
-  TEST_Z(ctrl->dev);
-
-  ibv_dereg_mr(ctrl->mr_buffer);
-  free(ctrl->buffer);
-  ibv_dealloc_pd(ctrl->dev->pd);
-  free(ctrl->dev);
-  ctrl->dev = NULL;
+  return c->dev;
 }
 
 static void create_qp(struct queue *q)
@@ -190,7 +314,7 @@ static void create_qp(struct queue *q)
   qp_attr.cap.max_send_sge = 1;
   qp_attr.cap.max_recv_sge = 1;
 
-  TEST_NZ(rdma_create_qp(q->cm_id, q->ctrl->dev->pd, &qp_attr));
+  TEST_NZ(rdma_create_qp(q->cm_id, q->client->dev->pd, &qp_attr));
   q->qp = q->cm_id->qp;
 }
 
@@ -198,24 +322,22 @@ int on_connect_request(struct rdma_cm_id *id, struct rdma_conn_param *param)
 {
 
   struct rdma_conn_param cm_params = {};
-  struct ibv_device_attr attrs = {};
-  struct queue *q = &gctrl->queues[queue_ctr++];
+  struct sockaddr_in *peer = (struct sockaddr_in *) rdma_get_peer_addr(id);
+  struct queue *q = (struct queue *) calloc(1, sizeof(*q));
 
-  TEST_Z(q->state == queue::INIT);
+  TEST_Z(q);
   printf("%s\n", __FUNCTION__);
 
   id->context = q;
   q->cm_id = id;
+  q->state = queue::INIT;
 
-  struct device *dev = get_device(q);
+  pthread_mutex_lock(&gctrl->lock);
+  q->client = client_get(peer->sin_addr);
+  q->client->nqueues++;
+  get_device(q);
   create_qp(q);
-
-  TEST_NZ(ibv_query_device(dev->verbs, &attrs));
-
-  printf("attrs: max_qp=%d, max_qp_wr=%d, max_cq=%d max_cqe=%d \
-          max_qp_rd_atom=%d, max_qp_init_rd_atom=%d\n", attrs.max_qp,
-          attrs.max_qp_wr, attrs.max_cq, attrs.max_cqe,
-          attrs.max_qp_rd_atom, attrs.max_qp_init_rd_atom);
+  pthread_mutex_unlock(&gctrl->lock);
 
   printf("ctrl attrs: initiator_depth=%d responder_resources=%d\n",
       param->initiator_depth, param->responder_resources);
@@ -231,7 +353,9 @@ int on_connect_request(struct rdma_cm_id *id, struct rdma_conn_param *param)
   cm_params.rnr_retry_count = param->rnr_retry_count;
   cm_params.flow_control = param->flow_control;
 
-  TEST_NZ(rdma_accept(q->cm_id, &cm_params));
+  // the client may have given up on the queue already
+  if (rdma_accept(q->cm_id, &cm_params))
+    on_disconnect(q);
 
   return 0;
 }
@@ -239,48 +363,31 @@ int on_connect_request(struct rdma_cm_id *id, struct rdma_conn_param *param)
 int on_connection(struct queue *q)
 {
   printf("%s\n", __FUNCTION__);
-  struct ctrl *ctrl = q->ctrl;
 
   TEST_Z(q->state == queue::INIT);
 
-  if (q == &ctrl->queues[0]) {
-    struct ibv_send_wr wr = {};
-    struct ibv_send_wr *bad_wr = NULL;
-    struct ibv_sge sge = {};
-    struct memregion servermr = {};
-
-    printf("connected. sending memory region info.\n");
-    printf("MR key=%u base vaddr=%p\n", ctrl->mr_buffer->rkey, ctrl->mr_buffer->addr);
-
-    servermr.baseaddr = (uint64_t) ctrl->mr_buffer->addr;
-    servermr.key  = ctrl->mr_buffer->rkey;
-
-    wr.opcode = IBV_WR_SEND;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
-
-    sge.addr = (uint64_t) &servermr;
-    sge.length = sizeof(servermr);
-
-    TEST_NZ(ibv_post_send(q->qp, &wr, &bad_wr));
-
-    // TODO: poll here
-  }
-
+  // the client learns the rkey of every block from blockd, there is no
+  // region of the whole buffer to announce
   q->state = queue::CONNECTED;
   return 0;
 }
 
+// tears down a queue in any state, and its client with it if that was the
+// client's last queue and blockd is gone too
 int on_disconnect(struct queue *q)
 {
+  struct client *c = q->client;
+
   printf("%s\n", __FUNCTION__);
 
-  if (q->state == queue::CONNECTED) {
-    q->state = queue::INIT;
-    rdma_destroy_qp(q->cm_id);
-    rdma_destroy_id(q->cm_id);
-  }
+  rdma_destroy_qp(q->cm_id);
+  rdma_destroy_id(q->cm_id);
+  free(q);
+
+  pthread_mutex_lock(&gctrl->lock);
+  c->nqueues--;
+  client_put(c);
+  pthread_mutex_unlock(&gctrl->lock);
 
   return 0;
 }
@@ -296,11 +403,371 @@ int on_event(struct rdma_cm_event *event)
     case RDMA_CM_EVENT_ESTABLISHED:
       return on_connection(q);
     case RDMA_CM_EVENT_DISCONNECTED:
-      on_disconnect(q);
-      return 1;
+    case RDMA_CM_EVENT_CONNECT_ERROR:
+    case RDMA_CM_EVENT_UNREACHABLE:
+    case RDMA_CM_EVENT_REJECTED:
+      return on_disconnect(q);
     default:
       printf("unknown event: %s\n", rdma_event_str(event->event));
-      return 1;
+      return 0;
   }
 }
 
+
+// huge pages if there are any left, 4KB pages with a hint for
+// transparent huge pages otherwise
+static char *map_pool_memory(size_t len, bool *huge)
+{
+  static bool warned = false;
+  void *p = MAP_FAILED;
+
+  if (PAGE_BYTES > 4096) {
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+             (__builtin_ctzl(PAGE_BYTES) << MAP_HUGE_SHIFT), -1, 0);
+    if (p == MAP_FAILED && !warned) {
+      fprintf(stderr, "out of %zu KB huge pages, see /proc/sys/vm/nr_hugepages\n",
+              PAGE_BYTES >> 10);
+      warned = true;
+    }
+  }
+  *huge = p != MAP_FAILED;
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED)
+      madvise(p, len, MADV_HUGEPAGE);
+  }
+  return p == MAP_FAILED ? NULL : (char *) p;
+}
+
+// maps and registers another chunk for c, NULL if that would take the
+// pool past BUFFER_SIZE or the memory can't be had. callers hold the lock
+static struct chunk *chunk_create(struct client *c)
+{
+  uint32_t n = CHUNK_SIZE / BLK_SIZE;
+  struct chunk *ch;
+
+  if ((gctrl->nchunks + 1) * CHUNK_SIZE > BUFFER_SIZE)
+    return NULL;
+  if (c->nchunks == c->max_chunks) {
+    size_t max = c->max_chunks ? 2 * c->max_chunks : 16;
+    struct chunk **chunks = (struct chunk **) realloc(c->chunks, max * sizeof(*chunks));
+
+    if (!chunks)
+      return NULL;
+    c->chunks = chunks;
+    c->max_chunks = max;
+  }
+
+  ch = (struct chunk *) calloc(1, sizeof(*ch));
+  if (!ch)
+    return NULL;
+  ch->free_blocks = (uint16_t *) malloc(n * sizeof(uint16_t));
+  ch->base = map_pool_memory(CHUNK_SIZE, &ch->huge);
+  if (!ch->free_blocks || !ch->base)
+    goto out_free;
+  if (!c->odp_mr) {
+    ch->mr = ibv_reg_mr(c->dev->pd, ch->base, CHUNK_SIZE, ACCESS_FLAGS);
+    if (!ch->mr) {
+      fprintf(stderr, "cannot register a chunk - errno: %d\n", errno);
+      goto out_free;
+    }
+  }
+
+  // blocks are handed out lowest address first
+  for (uint32_t i = 0; i < n; ++i)
+    ch->free_blocks[i] = n - 1 - i;
+  ch->nfree = n;
+  c->chunks[c->nchunks++] = ch;
+  gctrl->nchunks++;
+  printf("pool grew to %zu MB, %zu MB of it for %s\n", (gctrl->nchunks * CHUNK_SIZE) >> 20,
+         (c->nchunks * CHUNK_SIZE) >> 20, inet_ntoa(c->ip));
+  return ch;
+
+out_free:
+  if (ch->base)
+    munmap(ch->base, CHUNK_SIZE);
+  free(ch->free_blocks);
+  free(ch);
+  return NULL;
+}
+
+// callers hold the lock
+static void chunk_release(struct client *c, size_t i)
+{
+  struct chunk *ch = c->chunks[i];
+
+  if (ch->mr)
+    ibv_dereg_mr(ch->mr);
+  munmap(ch->base, CHUNK_SIZE);
+  free(ch->free_blocks);
+  free(ch);
+  c->chunks[i] = c->chunks[--c->nchunks];
+  gctrl->nchunks--;
+}
+
+// gives back chunks of c none of whose blocks are in use. one is kept for
+// the next allocations, unless the pool is over its limit
+static void chunks_trim(struct client *c)
+{
+  uint32_t n = CHUNK_SIZE / BLK_SIZE;
+  bool spare = gctrl->nchunks * CHUNK_SIZE <= BUFFER_SIZE;
+
+  for (size_t i = c->nchunks; i-- > 0;) {
+    if (c->chunks[i]->nfree != n)
+      continue;
+    if (spare) {
+      spare = false;
+      continue;
+    }
+    chunk_release(c, i);
+    printf("pool shrank to %zu MB\n", (gctrl->nchunks * CHUNK_SIZE) >> 20);
+  }
+}
+
+// the chunk of c with the fewest free blocks that still has one. filling
+// the fullest chunks first lets the others empty out and be released
+static struct chunk *chunk_pick(struct client *c)
+{
+  struct chunk *best = NULL;
+
+  for (size_t i = 0; i < c->nchunks; ++i) {
+    struct chunk *ch = c->chunks[i];
+    if (ch->nfree && (!best || ch->nfree < best->nfree))
+      best = ch;
+  }
+  return best;
+}
+
+// takes up to n free blocks for c, as many as its quota leaves room for,
+// growing the pool if they run out
+static int blocks_alloc(struct client *c, struct blk_desc *descs, uint32_t n, uint32_t *got)
+{
+  size_t room = c->quota / BLK_SIZE;
+  uint32_t k = 0;
+  struct chunk *ch;
+
+  *got = 0;
+  pthread_mutex_lock(&gctrl->lock);
+  if (!c->dev) {
+    pthread_mutex_unlock(&gctrl->lock);
+    return -EAGAIN;
+  }
+  if (c->quota) {
+    room = room > c->used_blocks ? room - c->used_blocks : 0;
+    if (!room) {
+      pthread_mutex_unlock(&gctrl->lock);
+      return -EDQUOT;
+    }
+    if (n > room)
+      n = room;
+  }
+
+  while (k < n && ((ch = chunk_pick(c)) || (ch = chunk_create(c)))) {
+    for (; k < n && ch->nfree; ++k) {
+      descs[k].addr = (uint64_t) (ch->base + ch->free_blocks[--ch->nfree] * BLK_SIZE);
+      descs[k].rkey = ch->mr ? ch->mr->rkey : c->odp_mr->rkey;
+      descs[k].pad = 0;
+    }
+  }
+  c->used_blocks += k;
+  c->allocs += k;
+  pthread_mutex_unlock(&gctrl->lock);
+
+  *got = k;
+  return k ? 0 : -ENOMEM;
+}
+
+// puts the blocks at addrs back in c's chunks. addresses that name no
+// block of c are skipped, one client can't free another's blocks
+static void blocks_free(struct client *c, const uint64_t *addrs, uint32_t n)
+{
+  uint32_t k = 0;
+
+  pthread_mutex_lock(&gctrl->lock);
+  for (uint32_t i = 0; i < n; ++i) {
+    struct chunk *ch = NULL;
+    uint64_t off = 0;
+
+    for (size_t j = 0; j < c->nchunks && !ch; ++j) {
+      off = addrs[i] - (uint64_t) c->chunks[j]->base;
+      if (addrs[i] >= (uint64_t) c->chunks[j]->base && off < CHUNK_SIZE)
+        ch = c->chunks[j];
+    }
+    if (!ch || off % BLK_SIZE || ch->nfree == CHUNK_SIZE / BLK_SIZE) {
+      fprintf(stderr, "free of unknown block %p\n", (void *) addrs[i]);
+      continue;
+    }
+    ch->free_blocks[ch->nfree++] = off / BLK_SIZE;
+    k++;
+  }
+  c->used_blocks -= k;
+  c->frees += k;
+  chunks_trim(c);
+  pthread_mutex_unlock(&gctrl->lock);
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+  char *p = (char *) buf;
+
+  while (len) {
+    ssize_t r = read(fd, p, len);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+  const char *p = (const char *) buf;
+
+  while (len) {
+    ssize_t r = write(fd, p, len);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += r;
+    len -= r;
+  }
+  return 0;
+}
+
+// serves one blockd connection until it closes. blocks go to the client
+// the connection comes from
+static void *control_conn(void *arg)
+{
+  int fd = (int) (intptr_t) arg;
+  struct blk_desc descs[BLK_MAX_BATCH];
+  uint64_t addrs[BLK_MAX_BATCH];
+  struct blk_stats stats;
+  struct blk_req req;
+  struct blk_reply reply;
+  struct sockaddr_in peer = {};
+  socklen_t peerlen = sizeof(peer);
+  struct client *c;
+  bool local;
+
+  if (getpeername(fd, (struct sockaddr *) &peer, &peerlen)) {
+    close(fd);
+    return NULL;
+  }
+  // only an admin on the server itself may resize the pool
+  local = peer.sin_addr.s_addr == htonl(INADDR_LOOPBACK);
+  pthread_mutex_lock(&gctrl->lock);
+  c = client_get(peer.sin_addr);
+  c->nconns++;
+  pthread_mutex_unlock(&gctrl->lock);
+
+  while (read_full(fd, &req, sizeof(req)) == 0) {
+    const void *body = NULL;
+    size_t len = 0;
+
+    reply.status = 0;
+    reply.n = 0;
+    if (req.n > BLK_MAX_BATCH && req.op != BLK_OP_LIMIT) {
+      fprintf(stderr, "control: batch of %u is too big\n", req.n);
+      break;
+    }
+
+    switch (req.op) {
+      case BLK_OP_ALLOC:
+        reply.status = blocks_alloc(c, descs, req.n, &reply.n);
+        body = descs;
+        len = reply.n * sizeof(descs[0]);
+        break;
+      case BLK_OP_FREE:
+        if (read_full(fd, addrs, req.n * sizeof(addrs[0])))
+          goto out;
+        blocks_free(c, addrs, req.n);
+        break;
+      case BLK_OP_STATS:
+        pthread_mutex_lock(&gctrl->lock);
+        stats.total_blocks = (c->quota && c->quota < BUFFER_SIZE ? c->quota : BUFFER_SIZE) / BLK_SIZE;
+        stats.used_blocks = c->used_blocks;
+        stats.pool_blocks = c->nchunks * (CHUNK_SIZE / BLK_SIZE);
+        stats.allocs = c->allocs;
+        stats.frees = c->frees;
+        pthread_mutex_unlock(&gctrl->lock);
+        reply.n = 1;
+        body = &stats;
+        len = sizeof(stats);
+        break;
+      case BLK_OP_LIMIT:
+        if (!local) {
+          reply.status = -EPERM;
+          break;
+        }
+        pthread_mutex_lock(&gctrl->lock);
+        BUFFER_SIZE = (size_t) req.n << 30;
+        for (struct client *o = gctrl->clients; o; o = o->next)
+          chunks_trim(o);
+        pthread_mutex_unlock(&gctrl->lock);
+        printf("pool limit set to %u GB\n", req.n);
+        break;
+      default:
+        reply.status = -EINVAL;
+    }
+
+    if (write_full(fd, &reply, sizeof(reply)) || (len && write_full(fd, body, len)))
+      break;
+  }
+
+out:
+  close(fd);
+  pthread_mutex_lock(&gctrl->lock);
+  c->nconns--;
+  client_put(c);
+  pthread_mutex_unlock(&gctrl->lock);
+  return NULL;
+}
+
+static void *control_listen(void *arg)
+{
+  int lfd = (int) (intptr_t) arg;
+
+  for (;;) {
+    pthread_t tid;
+    int fd = accept(lfd, NULL, NULL);
+    int one = 1;
+
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      die("error: accept on the control port failed.");
+    }
+    // a client that dies without closing must not keep its memory forever
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    printf("block provider connected\n");
+    TEST_NZ(pthread_create(&tid, NULL, control_conn, (void *) (intptr_t) fd));
+    pthread_detach(tid);
+  }
+  return NULL;
+}
+
+// blockd talks to us over tcp on the rdma port number, see blockproto.h
+static void start_control(uint16_t port)
+{
+  struct sockaddr_in addr = {};
+  pthread_t tid;
+  int fd, one = 1;
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+
+  TEST_Z((fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+  TEST_NZ(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)));
+  TEST_NZ(bind(fd, (struct sockaddr *) &addr, sizeof(addr)));
+  TEST_NZ(listen(fd, 64));
+  TEST_NZ(pthread_create(&tid, NULL, control_listen, (void *) (intptr_t) fd));
+  pthread_detach(tid);
+  printf("control port %d.\n", port);
+}